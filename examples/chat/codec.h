@@ -6,6 +6,7 @@
 
 #include "raner/byte_buffer.h"
 #include "raner/endian.h"
+#include "raner/shared_payload.h"
 #include "raner/tcp_connection.h"
 
 class LengthHeaderCodec {
@@ -47,6 +48,20 @@ class LengthHeaderCodec {
     conn->Send(&buf);
   }
 
+  // Frames 'message' once, to be sent to any number of connections.
+  static raner::SharedPayload Encode(std::string_view message) {
+    std::string frame;
+    frame.reserve(kHeaderLen + message.size());
+    uint32_t len = raner::ghtonl(static_cast<uint32_t>(message.size()));
+    frame.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    frame.append(message.data(), message.size());
+    return raner::SharedPayload(std::move(frame));
+  }
+
+  void Send(raner::TCPConnection* conn, const raner::SharedPayload& frame) {
+    conn->Send(frame);
+  }
+
  private:
   StringMessageCallback messageCallback_;
   const static size_t kHeaderLen = sizeof(uint32_t);
@@ -49,10 +49,11 @@ class ChatServer {
   typedef std::shared_ptr<ConnectionList> ConnectionListPtr;
 
   void onStringMessage(const TCPConnectionPtr&, const std::string& message) {
+    const SharedPayload frame = LengthHeaderCodec::Encode(message);
     ConnectionListPtr connections = getConnectionList();
     for (ConnectionList::iterator it = connections->begin();
          it != connections->end(); ++it) {
-      codec_.Send((*it).get(), message);
+      codec_.Send((*it).get(), frame);
     }
   }
 
@@ -2,20 +2,18 @@
 
 #include <glog/logging.h>
 
+#include "raner/broadcast_group.h"
 #include "raner/event_loop.h"
+#include "raner/event_loop_thread_pool.h"
 #include "raner/tcp_server.h"
 
 #include <stdio.h>
 #include <unistd.h>
-#include <set>
+#include <memory>
 #include <string_view>
 
 using namespace raner;
 
-typedef std::set<TCPConnectionPtr> ConnectionList;
-typedef std::unique_ptr<ConnectionList> ConnectionListPtr;
-thread_local ConnectionListPtr localConnections;
-
 class ChatServer {
  public:
   ChatServer(EventLoop* loop, std::string_view ip, uint16_t port)
@@ -30,8 +28,10 @@ class ChatServer {
   void SetThreadNum(int num_threads) { server_.SetThreadNum(num_threads); }
 
   void Start() {
-    server_.SetThreadInitCallback(std::bind(&ChatServer::threadInit, this, _1));
     server_.Start();
+    // Connections are accepted once the loop runs, after this.
+    connections_.reset(
+        new BroadcastGroup(server_.thread_pool()->GetAllLoops()));
   }
 
  private:
@@ -39,48 +39,22 @@ class ChatServer {
     LOG(INFO) << conn->GetLocalAddr() << " -> " << conn->GetPeerAddr() << " is "
               << (conn->Connected() ? "UP" : "DOWN");
 
+    // Closed connections leave the group by themselves.
     if (conn->Connected()) {
-      localConnections->insert(conn);
-    } else {
-      localConnections->erase(conn);
+      connections_->Join(conn);
     }
   }
 
   void onStringMessage(const TCPConnectionPtr&, const std::string& message) {
-    EventLoop::Functor f =
-        std::bind(&ChatServer::distributeMessage, this, message);
-    LOG(INFO) << "onStringMessage enter";
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (std::set<EventLoop*>::iterator it = loops_.begin(); it != loops_.end();
-         ++it) {
-      (*it)->QueueInLoop(f);
-    }
-    LOG(INFO) << "onStringMessage exit";
-  }
-
-  void distributeMessage(const std::string& message) {
-    LOG(INFO) << "begin";
-    for (ConnectionList::iterator it = localConnections->begin();
-         it != localConnections->end(); ++it) {
-      codec_.Send((*it).get(), message);
-    }
-    LOG(INFO) << "end";
-  }
-
-  void threadInit(EventLoop* loop) {
-    assert(localConnections == nullptr);
-    localConnections = std::make_unique<ConnectionList>();
-    assert(localConnections != nullptr);
-    std::lock_guard<std::mutex> lock(mutex_);
-    loops_.insert(loop);
+    // One task per loop, each sending the frame to the connections of its
+    // loop.
+    connections_->Publish(LengthHeaderCodec::Encode(message));
   }
 
+  // Destroyed after the server, whose connections use it.
+  std::unique_ptr<BroadcastGroup> connections_;
   TCPServer server_;
   LengthHeaderCodec codec_;
-
-  std::mutex mutex_;
-  std::set<EventLoop*> loops_;
 };
 
 int main(int argc, char* argv[]) {
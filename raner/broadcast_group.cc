@@ -0,0 +1,143 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/broadcast_group.h"
+
+#include <glog/logging.h>
+
+#include "raner/event_loop.h"
+
+namespace raner {
+
+// The subscribers in one loop. Only that loop reads or writes
+// 'subscribers_'.
+class BroadcastGroup::Shard : public std::enable_shared_from_this<Shard> {
+ public:
+  explicit Shard(EventLoop *loop) : loop_(loop), num_subscribers_(0) {}
+
+  EventLoop *loop() const { return loop_; }
+  size_t NumSubscribers() const {
+    return num_subscribers_.load(std::memory_order_relaxed);
+  }
+
+  void Join(const TCPConnectionPtr &conn) {
+    loop_->AssertInLoopThread();
+    if (conn->Disconnected()) {
+      return;
+    }
+    subscribers_[conn.get()] = conn;
+    updateCount();
+    // The hook may run from within Publish(), which sends, so it only
+    // queues the removal.
+    std::weak_ptr<Shard> weak_shard = shared_from_this();
+    TCPConnection *key = conn.get();
+    EventLoop *loop = loop_;
+    conn->SetCloseHook(this, [weak_shard, key, loop]() {
+      loop->QueueInLoop([weak_shard, key]() {
+        if (std::shared_ptr<Shard> shard = weak_shard.lock()) {
+          shard->dropIfClosed(key);
+        }
+      });
+    });
+  }
+
+  void Leave(const TCPConnectionPtr &conn) {
+    loop_->AssertInLoopThread();
+    conn->RemoveCloseHook(this);
+    subscribers_.erase(conn.get());
+    updateCount();
+  }
+
+  void Publish(const SharedPayload &payload) {
+    loop_->AssertInLoopThread();
+    for (auto it = subscribers_.begin(); it != subscribers_.end();) {
+      TCPConnectionPtr conn = it->second.lock();
+      if (conn && !conn->Disconnected()) {
+        conn->Send(payload);
+        ++it;
+      } else {
+        it = subscribers_.erase(it);
+      }
+    }
+    updateCount();
+  }
+
+ private:
+  // Drops the entry at 'key' unless a live connection has it, which one
+  // allocated where a closed one was may have by the time this runs.
+  void dropIfClosed(TCPConnection *key) {
+    auto it = subscribers_.find(key);
+    if (it == subscribers_.end()) {
+      return;
+    }
+    TCPConnectionPtr conn = it->second.lock();
+    if (!conn || conn->Disconnected()) {
+      subscribers_.erase(it);
+      updateCount();
+    }
+  }
+
+  void updateCount() {
+    num_subscribers_.store(subscribers_.size(), std::memory_order_relaxed);
+  }
+
+  EventLoop *const loop_;
+  // Keyed by address: a connection freed and another allocated at the same
+  // place replaces the stale entry.
+  std::unordered_map<TCPConnection *, std::weak_ptr<TCPConnection>>
+      subscribers_;
+  std::atomic<size_t> num_subscribers_;
+};
+
+BroadcastGroup::BroadcastGroup(const std::vector<EventLoop *> &loops) {
+  for (EventLoop *loop : loops) {
+    shards_.emplace(loop, std::make_shared<Shard>(loop));
+  }
+}
+
+BroadcastGroup::~BroadcastGroup() {}
+
+const std::shared_ptr<BroadcastGroup::Shard> &BroadcastGroup::shardOf(
+    const TCPConnectionPtr &conn) const {
+  auto it = shards_.find(conn->GetLoop());
+  CHECK(it != shards_.end())
+      << "Connection " << conn->Name() << " is not in a loop of the group";
+  return it->second;
+}
+
+void BroadcastGroup::Join(const TCPConnectionPtr &conn) {
+  std::shared_ptr<Shard> shard = shardOf(conn);
+  shard->loop()->RunInLoop([shard, conn]() { shard->Join(conn); });
+}
+
+void BroadcastGroup::Leave(const TCPConnectionPtr &conn) {
+  std::shared_ptr<Shard> shard = shardOf(conn);
+  // Holds 'conn' until the task runs, so that its address is not reused by
+  // a connection joining before.
+  shard->loop()->RunInLoop([shard, conn]() { shard->Leave(conn); });
+}
+
+void BroadcastGroup::Publish(const SharedPayload &payload) {
+  if (payload.empty()) {
+    return;
+  }
+  for (const auto &entry : shards_) {
+    const std::shared_ptr<Shard> &shard = entry.second;
+    shard->loop()->RunInLoop([shard, payload]() { shard->Publish(payload); });
+  }
+}
+
+void BroadcastGroup::Publish(std::string_view message) {
+  Publish(SharedPayload(message.data(), message.size()));
+}
+
+size_t BroadcastGroup::NumSubscribers() const {
+  size_t n = 0;
+  for (const auto &entry : shards_) {
+    n += entry.second->NumSubscribers();
+  }
+  return n;
+}
+
+}  // namespace raner
@@ -0,0 +1,66 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_BROADCAST_GROUP_H_
+#define RANER_NET_BROADCAST_GROUP_H_
+
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "raner/macros.h"
+#include "raner/shared_payload.h"
+#include "raner/tcp_connection.h"
+
+namespace raner {
+
+class EventLoop;
+
+// A set of connections to send the same messages to, such as the members
+// of a chat room or the subscribers of a topic.
+//
+// The subscribers are kept per loop, in a shard which only that loop
+// touches: Join() and Leave() run in the loop of the connection, and
+// Publish() queues one task per loop, which sends the payload to the
+// subscribers of that loop. None of them takes a lock, and all of them may
+// be called from any thread.
+//
+// The group holds weak references: a subscriber does not outlive its
+// connection, and a closed connection leaves the group by itself, through
+// a close hook which queues its removal to its loop.
+class BroadcastGroup {
+ public:
+  // 'loops' are those of the connections which may join, typically
+  // TCPServer::thread_pool()->GetAllLoops() after the server started.
+  explicit BroadcastGroup(const std::vector<EventLoop *> &loops);
+  ~BroadcastGroup();
+
+  void Join(const TCPConnectionPtr &conn);
+  void Leave(const TCPConnectionPtr &conn);
+
+  void Publish(const SharedPayload &payload);
+  // Copies 'message' once.
+  void Publish(std::string_view message);
+
+  // The number of subscribers, not counting the joins and leaves still
+  // queued to their loops, the removals of closed connections included.
+  size_t NumSubscribers() const;
+
+ private:
+  class Shard;
+
+  const std::shared_ptr<Shard> &shardOf(const TCPConnectionPtr &conn) const;
+
+  // Shared with the tasks queued to the loops, so that the group may go
+  // before they run.
+  std::unordered_map<EventLoop *, std::shared_ptr<Shard>> shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(BroadcastGroup);
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_BROADCAST_GROUP_H_
@@ -10,7 +10,8 @@
 namespace raner {
 ssize_t ByteBuffer::ReadFD(int fd, int* save_errno) {
   // saved an ioctl()/FIONREAD call to tell how much to read
-  char extrabuf[65536];
+  CopyBorrowed();
+  char extrabuf[kReadFDExtraBytes];
   struct iovec vec[2];
   const size_t writable = WritableBytes();
   vec[0].iov_base = begin() + writer_index_;
@@ -30,13 +30,29 @@ class ByteBuffer {
   static constexpr size_t kInitialSize = 1024;
 
   explicit ByteBuffer(size_t initial_size = kInitialSize)
-      : buffer_(initial_size), reader_index_(0), writer_index_(0) {
+      : buffer_(initial_size),
+        borrowed_(nullptr),
+        reader_index_(0),
+        writer_index_(0) {
     assert(DiscardableBytes() == 0);
     assert(ReadableBytes() == 0);
     assert(WritableBytes() == initial_size);
   }
 
+  // A copy, or a move, of a borrowed buffer has its bytes copied.
+  ByteBuffer(const ByteBuffer &rhs) : ByteBuffer(rhs.ReadableBytes()) {
+    Write(rhs.BeginRead(), rhs.ReadableBytes());
+  }
+  ByteBuffer(ByteBuffer &&rhs) noexcept : ByteBuffer(0) { Swap(rhs); }
+  ByteBuffer &operator=(ByteBuffer rhs) {
+    Swap(rhs);
+    return *this;
+  }
+
   void Swap(ByteBuffer &rhs) {
+    // The lender only waits for the buffer it lent to.
+    CopyBorrowed();
+    rhs.CopyBorrowed();
     buffer_.swap(rhs.buffer_);
     std::swap(reader_index_, rhs.reader_index_);
     std::swap(writer_index_, rhs.writer_index_);
@@ -44,7 +60,9 @@ class ByteBuffer {
 
   size_t DiscardableBytes() const { return reader_index_; }
   size_t ReadableBytes() const { return writer_index_ - reader_index_; }
-  size_t WritableBytes() const { return buffer_.size() - writer_index_; }
+  size_t WritableBytes() const {
+    return borrowed_ != nullptr ? 0 : buffer_.size() - writer_index_;
+  }
 
   const char *BeginRead() const { return begin() + reader_index_; }
   const char *BeginWrite() const { return begin() + writer_index_; }
@@ -185,7 +203,10 @@ class ByteBuffer {
 
   std::string ToString() { return ToString(ReadableBytes()); }
 
-  void SkipAll() { reader_index_ = writer_index_ = 0; }
+  void SkipAll() {
+    reader_index_ = writer_index_ = 0;
+    borrowed_ = nullptr;
+  }
 
   void Shrink() {
     ByteBuffer other;
@@ -199,13 +220,59 @@ class ByteBuffer {
     assert(WritableBytes() >= len);
   }
 
+  // Reads from fd with a single readv into the writable bytes, and into a
+  // stack buffer of kReadFDExtraBytes when those are few.
   ssize_t ReadFD(int fd, int *save_errno);
 
+  // The most one ReadFD() call can read; fewer means fd had nothing more.
+  size_t MaxReadFDBytes() const {
+    return WritableBytes() < kReadFDExtraBytes
+               ? WritableBytes() + kReadFDExtraBytes
+               : WritableBytes();
+  }
+
+  static constexpr size_t kReadFDExtraBytes = 65536;
+
+  // Makes the 'len' bytes at 'data' the readable bytes of the buffer, which
+  // must be empty, without copying them: for a poller which received them
+  // into memory of its own, and lends it for the message callback. The
+  // buffer then has no writable bytes; it copies what is left of them with
+  // CopyBorrowed(), which growing or swapping it does first, and forgets
+  // them once they are all skipped.
+  void Borrow(const char *data, size_t len) {
+    assert(ReadableBytes() == 0);
+    borrowed_ = data;
+    reader_index_ = 0;
+    writer_index_ = len;
+  }
+  bool borrowed() const { return borrowed_ != nullptr; }
+  void CopyBorrowed() {
+    if (borrowed_ == nullptr) {
+      return;
+    }
+    const char *data = BeginRead();
+    const size_t len = ReadableBytes();
+    SkipAll();
+    Write(data, len);
+  }
+
  private:
-  char *begin() { return &*buffer_.begin(); }
-  const char *begin() const { return &*buffer_.begin(); }
+  // Never written through while borrowed, with no writable bytes.
+  char *begin() {
+    return borrowed_ != nullptr ? const_cast<char *>(borrowed_)
+                                : buffer_.data();
+  }
+  const char *begin() const {
+    return borrowed_ != nullptr ? borrowed_ : buffer_.data();
+  }
 
   void expandCapacity(size_t len) {
+    if (borrowed_ != nullptr) {
+      CopyBorrowed();
+      if (WritableBytes() >= len) {
+        return;
+      }
+    }
     if (WritableBytes() + DiscardableBytes() < len) {
       buffer_.resize(writer_index_ + len);
     } else {
@@ -220,6 +287,8 @@ class ByteBuffer {
 
  private:
   std::vector<char> buffer_;
+  // The memory of the readable bytes in place of buffer_, or null.
+  const char *borrowed_;
   size_t reader_index_;
   size_t writer_index_;
 
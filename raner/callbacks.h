@@ -21,9 +21,12 @@ typedef std::shared_ptr<TCPConnection> TCPConnectionPtr;
 typedef std::function<void()> TimerCallback;
 typedef std::function<void(const TCPConnectionPtr&)> ConnectionCallback;
 typedef std::function<void(const TCPConnectionPtr&)> CloseCallback;
+typedef std::function<void()> CloseHook;
 typedef std::function<void(const TCPConnectionPtr&)> WriteCompleteCallback;
 typedef std::function<void(const TCPConnectionPtr&, size_t)>
     HighWaterMarkCallback;
+typedef std::function<void(const TCPConnectionPtr&, size_t)>
+    LowWaterMarkCallback;
 
 // the data has been read to (buf, len)
 typedef std::function<void(const TCPConnectionPtr&, ByteBuffer*)>
@@ -6,7 +6,11 @@
 
 #include <errno.h>   // for errno and strerror_r
 #include <stdlib.h>  // for abort
-#include <unistd.h>  // For read, pipe, close and write.
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>  // For read, close and write.
 #include <algorithm>
 #include <utility>
 
@@ -17,7 +21,7 @@
 // desirable properties:
 //
 // A. O(1) insertion into/removal from the list in any location.
-// B. Once the callback is found by hash lookup using the fd, the lookup of
+// B. Once the callback is found by its fd, the lookup of
 //    corresponding entry in the list is O(1).
 // C. Safe insertion into/removal from the list during list iteration. (The
 //    ready list's purpose is to enable completely event driven I/O model.
@@ -30,7 +34,7 @@
 //   insertion/removal (see man 3 queue).
 // - The forward and backward links are directly embedded inside the
 //   CBAndEventMask struct. This enables O(1) lookup in the list for a given
-//   callback. (Techincally, we could've used std::list of hash_set::iterator,
+//   callback. (Techincally, we could've used std::list of iterators,
 //   and keep a list::iterator in CBAndEventMask to achieve the same effect.
 //   However, iterators have two problems: no way to portably invalidate them,
 //   and no way to tell whether an iterator is singular or not. The only way to
@@ -41,9 +45,10 @@
 //   list, easier to check whether an CBAndEventMask is in the list, uses less
 //   memory (save 32 bytes/fd), and does not affect cache usage (we need to
 //   read in the struct to use the callback anyway).)
-// - Embed the fd directly into CBAndEventMask and switch to using hash_set.
-//   This removes the need to store hash_map::iterator in the list just so that
-//   we can get both the fd and the callback.
+// - Embed the fd directly into CBAndEventMask and keep the CBAndEventMasks in
+//   a table indexed by fd (FDToCBMap). This removes the need to store an
+//   iterator in the list just so that we can get both the fd and the
+//   callback, and the entries never move, so the links stay valid.
 // - The ready list is "one shot": each entry is removed before OnEvent is
 //   called. This removes the mutation-while-iterating problem.
 // - Use two lists to keep track of callbacks. The ready_list_ is the one used
@@ -54,25 +59,53 @@
 // The size we use for buffers passed to strerror_r
 static const int kErrorBufferSize = 256;
 
+// Number of children per node of the alarm heap. A 4-ary heap is half as deep
+// as a binary one, and the four children of a node sit in one cache line.
+static const size_t kAlarmHeapArity = 4;
+
 namespace raner {
 
-// Clears the pipe and returns.  Used for waking the epoll server up.
-class ReadPipeCallback : public EpollCallbackInterface {
+// Clears the eventfd and returns.  Used for waking the epoll server up.
+class ReadEventFDCallback : public EpollCallbackInterface {
  public:
+  explicit ReadEventFDCallback(std::atomic<bool> *wake_pending)
+      : wake_pending_(wake_pending) {}
+
   void OnEvent(int fd, EpollEvent *event) override {
     DCHECK(event->in_events == EPOLLIN);
-    int data;
-    ssize_t data_read = 1;
-    // Read until the pipe is empty.
-    while (data_read > 0) {
-      data_read = read(fd, &data, sizeof(data));
-    }
+    // A single read resets the eventfd counter, however many Wake() calls
+    // added to it.
+    uint64_t count;
+    ssize_t data_read = read(fd, &count, sizeof(count));
+    DCHECK(data_read == sizeof(count) || errno == EAGAIN);
+    // Only let the next Wake() write again once the eventfd has been
+    // drained. Clearing the flag first would let a Wake() landing between
+    // the two have its write swallowed by the read, with the flag then left
+    // set and every later Wake() skipped.
+    wake_pending_->store(false);
+  }
+  void OnShutdown(EpollServer *eps, int fd) override {}
+  void OnRegistration(EpollServer *, int, int) override {}
+  void OnModification(int, int) override {}     // COV_NF_LINE
+  void OnUnregistration(int, bool) override {}  // COV_NF_LINE
+  std::string Name() const override { return "ReadEventFDCallback"; }
+
+ private:
+  std::atomic<bool> *wake_pending_;
+};
+
+class ReadTimerFDCallback : public EpollCallbackInterface {
+ public:
+  void OnEvent(int fd, EpollEvent *event) override {
+    uint64_t expirations;
+    ssize_t data_read = read(fd, &expirations, sizeof(expirations));
+    DCHECK(data_read == sizeof(expirations) || errno == EAGAIN);
   }
   void OnShutdown(EpollServer *eps, int fd) override {}
   void OnRegistration(EpollServer *, int, int) override {}
   void OnModification(int, int) override {}     // COV_NF_LINE
   void OnUnregistration(int, bool) override {}  // COV_NF_LINE
-  std::string Name() const override { return "ReadPipeCallback"; }
+  std::string Name() const override { return "ReadTimerFDCallback"; }
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -81,64 +114,121 @@ class ReadPipeCallback : public EpollCallbackInterface {
 EpollServer::EpollServer()
     : epoll_fd_(epoll_create(1024)),
       timeout_in_us_(0),
+      high_resolution_timers_(false),
+      spin_budget_in_us_(0),
+      num_productive_polls_(0),
+      num_empty_polls_(0),
+      num_spins_fallen_asleep_(0),
+      num_epoll_ctls_saved_(0),
       recorded_now_in_us_(0),
+      loop_time_in_us_(0),
       ready_list_size_(0),
-      wake_cb_(new ReadPipeCallback),
-      read_fd_(-1),
-      write_fd_(-1),
+      events_(kMinEventsSize),
+      last_num_events_(0),
+      num_low_usage_waits_(0),
+      wake_cb_(new ReadEventFDCallback(&wake_pending_)),
+      wake_fd_(-1),
+      wake_pending_(false),
+      num_wakes_coalesced_(0),
+      use_timer_fd_(false),
+      timer_cb_(new ReadTimerFDCallback()),
+      timer_fd_(-1),
       in_wait_for_events_and_execute_callbacks_(false),
-      in_shutdown_(false) {
+      in_shutdown_(false),
+      trace_ring_(TraceRing::kDefaultCapacity) {
   // ensure that the epoll_fd_ is valid.
   CHECK_NE(epoll_fd_, -1);
   LIST_INIT(&ready_list_);
   LIST_INIT(&tmp_list_);
 
-  int pipe_fds[2];
-  if (pipe(pipe_fds) < 0) {
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
     // Unfortunately, it is impossible to test any such initialization in
     // a constructor (as virtual methods do not yet work).
     // This -could- be solved by moving initialization to an outside
     // call...
     int saved_errno = errno;
     char buf[kErrorBufferSize];
-    LOG(FATAL) << "Error " << saved_errno
-               << " in pipe(): " << strerror_r(saved_errno, buf, sizeof(buf));
+    LOG(FATAL) << "Error " << saved_errno << " in eventfd(): "
+               << strerror_r(saved_errno, buf, sizeof(buf));
   }
-  read_fd_ = pipe_fds[0];
-  write_fd_ = pipe_fds[1];
-  RegisterFD(read_fd_, wake_cb_.get(), EPOLLIN);
+  RegisterFD(wake_fd_, wake_cb_.get(), EPOLLIN);
 }
 
-void EpollServer::CleanupFDToCBMap() {
-  FDToCBMap::iterator cb_iter = cb_map_.begin();
-  while (cb_iter != cb_map_.end()) {
-    int fd = cb_iter->fd;
-    CB *cb = cb_iter->cb;
-
-    cb_iter->in_use = true;
-    if (cb) {
-      cb->OnShutdown(this, fd);
-    }
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t EpollServer::FDToCBMap::kChunkSize;
+constexpr size_t EpollServer::kCrashLogTraceRecords;
 
-    cb_map_.erase(cb_iter);
-    cb_iter = cb_map_.begin();
+EpollServer::CBAndEventMask *EpollServer::FDToCBMap::Insert(
+    EpollCallbackInterface *cb, int event_mask, int fd) {
+  CHECK_GE(fd, 0);
+  const size_t index = static_cast<size_t>(fd);
+  while (index >= capacity()) {
+    chunks_.emplace_back(new CBAndEventMask[kChunkSize]);
   }
+  CBAndEventMask *cb_and_mask =
+      &chunks_[index / kChunkSize][index % kChunkSize];
+  DCHECK_EQ(cb_and_mask->fd, -1);
+  *cb_and_mask = CBAndEventMask(cb, event_mask, fd);
+  ++size_;
+  return cb_and_mask;
 }
 
-void EpollServer::CleanupTimeToAlarmCBMap() {
-  TimeToAlarmCBMap::iterator erase_it;
+void EpollServer::FDToCBMap::Erase(CBAndEventMask *cb_and_mask) {
+  DCHECK(Find(cb_and_mask->fd) == cb_and_mask);
+  DCHECK(cb_and_mask->entry.le_prev == NULL);
+  *cb_and_mask = CBAndEventMask();
+  --size_;
+}
 
-  // Call OnShutdown() on alarms. Note that the structure of the loop
-  // is similar to the structure of loop in the function HandleAlarms()
-  for (TimeToAlarmCBMap::iterator i = alarm_map_.begin();
-       i != alarm_map_.end();) {
-    // Note that OnShutdown() can call UnregisterAlarm() on
-    // other iterators. OnShutdown() should not call UnregisterAlarm()
-    // on self because by definition the iterator is not valid any more.
-    i->second->OnShutdown(this);
-    erase_it = i;
-    ++i;
-    alarm_map_.erase(erase_it);
+EpollServer::CBAndEventMask *EpollServer::FDToCBMap::Next(int fd) const {
+  if (size_ == 0) {
+    return NULL;
+  }
+  for (size_t index = static_cast<size_t>(fd + 1); index < capacity();
+       ++index) {
+    CBAndEventMask *cb_and_mask =
+        &chunks_[index / kChunkSize][index % kChunkSize];
+    if (cb_and_mask->fd != -1) {
+      return cb_and_mask;
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EpollServer::CleanupFDToCBMap() {
+  // OnShutdown() may register or unregister other fds, so go round again
+  // until the map stays empty.
+  while (cb_map_.size() > 0) {
+    CBAndEventMask *cb_and_mask = cb_map_.Next(-1);
+    while (cb_and_mask != NULL) {
+      int fd = cb_and_mask->fd;
+      CB *cb = cb_and_mask->cb;
+
+      cb_and_mask->in_use = true;
+      if (cb) {
+        cb->OnShutdown(this, fd);
+      }
+
+      RemoveFromReadyList(cb_and_mask);
+      cb_map_.Erase(cb_and_mask);
+      cb_and_mask = cb_map_.Next(fd);
+    }
+  }
+}
+
+void EpollServer::CleanupAlarmHeap() {
+  // Call OnShutdown() on alarms. Each alarm is taken off the heap before its
+  // OnShutdown() runs, so OnShutdown() can call UnregisterAlarm() on other
+  // alarms. OnShutdown() should not call UnregisterAlarm() on self because by
+  // definition the token is not valid any more.
+  while (!alarm_heap_.empty()) {
+    AlarmCB *cb = alarm_heap_.back().cb;
+    RemoveAlarmAt(alarm_heap_.size() - 1);
+    cb->OnShutdown(this);
   }
 }
 
@@ -154,10 +244,12 @@ EpollServer::~EpollServer() {
   LIST_INIT(&ready_list_);
   LIST_INIT(&tmp_list_);
 
-  CleanupTimeToAlarmCBMap();
+  CleanupAlarmHeap();
 
-  close(read_fd_);
-  close(write_fd_);
+  close(wake_fd_);
+  if (timer_fd_ >= 0) {
+    close(timer_fd_);
+  }
   close(epoll_fd_);
 }
 
@@ -171,13 +263,13 @@ inline void EpollServer::AddToReadyList(CBAndEventMask *cb_and_mask) {
 }
 
 inline void EpollServer::RemoveFromReadyList(
-    const CBAndEventMask &cb_and_mask) {
-  if (cb_and_mask.entry.le_prev != NULL) {
-    LIST_REMOVE(&cb_and_mask, entry);
+    CBAndEventMask *cb_and_mask) {
+  if (cb_and_mask->entry.le_prev != NULL) {
+    LIST_REMOVE(cb_and_mask, entry);
     // Clean up all the ready list states. Don't bother with the other fields
     // as they are initialized when the CBAandEventMask is added to the ready
     // list. This saves a few cycles in the inner loop.
-    cb_and_mask.entry.le_prev = NULL;
+    cb_and_mask->entry.le_prev = NULL;
     --ready_list_size_;
     if (ready_list_size_ == 0) {
       DCHECK(ready_list_.lh_first == NULL);
@@ -189,8 +281,8 @@ inline void EpollServer::RemoveFromReadyList(
 void EpollServer::RegisterFD(int fd, CB *cb, int event_mask) {
   CHECK(cb);
   VLOG(3) << "RegisterFD fd=" << fd << " event_mask=" << event_mask;
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() != fd_i) {
+  CBAndEventMask *fd_i = cb_map_.Find(fd);
+  if (fd_i != NULL) {
     // do we just abort, or do we just unregister the other callback?
     // for now, lets just unregister the other callback.
 
@@ -198,7 +290,7 @@ void EpollServer::RegisterFD(int fd, CB *cb, int event_mask) {
     CB *other_cb = fd_i->cb;
     if (other_cb) {
       // Must remove from the ready list before erasing.
-      RemoveFromReadyList(*fd_i);
+      RemoveFromReadyList(fd_i);
       other_cb->OnUnregistration(fd, true);
       ModFD(fd, event_mask);
     } else {
@@ -207,10 +299,13 @@ void EpollServer::RegisterFD(int fd, CB *cb, int event_mask) {
     }
     fd_i->cb = cb;
     fd_i->event_mask = event_mask;
+    fd_i->polled_event_mask = event_mask;
     fd_i->events_to_fake = 0;
+    fd_i->dirty = false;
+    fd_i->removed_events = 0;
   } else {
     AddFD(fd, event_mask);
-    cb_map_.insert(CBAndEventMask(cb, event_mask, fd));
+    cb_map_.Insert(cb, event_mask, fd);
   }
 
   // set the FD to be non-blocking.
@@ -247,6 +342,50 @@ int EpollServer::epoll_wait_impl(int epfd, struct epoll_event *events,
   return epoll_wait(epfd, events, max_events, timeout_in_ms);
 }
 
+int EpollServer::epoll_pwait2_impl(int epfd, struct epoll_event *events,
+                                   int max_events, int64_t timeout_in_us) {
+  struct timespec ts;
+  ts.tv_sec = timeout_in_us / 1000000;
+  ts.tv_nsec = (timeout_in_us % 1000000) * 1000;
+#ifdef __NR_epoll_pwait2
+  if (!use_timer_fd_) {
+    int nfds = static_cast<int>(syscall(__NR_epoll_pwait2, epfd, events,
+                                        max_events, &ts, NULL, 0));
+    if (nfds >= 0 || errno != ENOSYS) {
+      return nfds;
+    }
+    LOG(WARNING) << "epoll_pwait2 is not supported, using a timerfd instead";
+    use_timer_fd_ = true;
+  }
+#endif
+  if (timer_fd_ < 0) {
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+      int saved_errno = errno;
+      char buf[kErrorBufferSize];
+      LOG(FATAL) << "Error " << saved_errno << " in timerfd_create(): "
+                 << strerror_r(saved_errno, buf, sizeof(buf));
+    }
+    RegisterFD(timer_fd_, timer_cb_.get(), EPOLLIN);
+  }
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value = ts;
+  timerfd_settime(timer_fd_, 0, &its, NULL);
+  // The timerfd ends the wait; the timeout rounded up to milliseconds is
+  // only there in case it does not. An expiry left over from a wait which
+  // ended early costs no more than a spurious wake-up.
+  return epoll_wait_impl(epfd, events, max_events,
+                         static_cast<int>((timeout_in_us + 999) / 1000));
+}
+
+void EpollServer::set_high_resolution_timers(bool on) {
+  high_resolution_timers_ = on;
+  if (on) {
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+  }
+}
+
 void EpollServer::RegisterFDForWrite(int fd, CB *cb) {
   RegisterFD(fd, cb, EPOLLOUT);
 }
@@ -260,8 +399,8 @@ void EpollServer::RegisterFDForRead(int fd, CB *cb) {
 }
 
 void EpollServer::UnregisterFD(int fd) {
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() == fd_i || fd_i->cb == NULL) {
+  CBAndEventMask *fd_i = cb_map_.Find(fd);
+  if (fd_i == NULL || fd_i->cb == NULL) {
     // Doesn't exist in server, or has gone through UnregisterFD once and still
     // inside the callchain of OnEvent.
     return;
@@ -271,8 +410,13 @@ void EpollServer::UnregisterFD(int fd) {
 #endif
   CB *cb = fd_i->cb;
   // Since the links are embedded within the struct, we must remove it from the
-  // list before erasing it from the hash_set.
-  RemoveFromReadyList(*fd_i);
+  // list before erasing it from the map.
+  RemoveFromReadyList(fd_i);
+  if (fd_i->dirty) {
+    fd_i->dirty = false;
+    fd_i->removed_events = 0;
+    ++num_epoll_ctls_saved_;
+  }
   DelFD(fd);
   cb->OnUnregistration(fd, false);
   // fd_i->cb is NULL if that fd is unregistered inside the callchain of
@@ -282,7 +426,7 @@ void EpollServer::UnregisterFD(int fd) {
   // condition that tells the EpollServer that this entry is unused at a later
   // point.
   if (!fd_i->in_use) {
-    cb_map_.erase(fd_i);
+    cb_map_.Erase(fd_i);
   } else {
     // Remove all trace of the registration, and just keep the node alive long
     // enough so the code that calls OnEvent doesn't have to worry about
@@ -309,16 +453,15 @@ void EpollServer::HandleEvent(int fd, int event_mask) {
 #ifdef EPOLL_SERVER_EVENT_TRACING
   event_recorder_.RecordEpollEvent(fd, event_mask);
 #endif
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (fd_i == cb_map_.end() || fd_i->cb == NULL) {
+  CBAndEventMask *cb_and_mask = cb_map_.Find(fd);
+  if (cb_and_mask == NULL || cb_and_mask->cb == NULL) {
     // Ignore the event.
     // This could occur if epoll() returns a set of events, and
     // while processing event A (earlier) we removed the callback
     // for event B (and are now processing event B).
     return;
   }
-  fd_i->events_asserted = event_mask;
-  CBAndEventMask *cb_and_mask = const_cast<CBAndEventMask *>(&*fd_i);
+  cb_and_mask->events_asserted = event_mask;
   AddToReadyList(cb_and_mask);
 }
 
@@ -333,9 +476,11 @@ void EpollServer::WaitForEventsAndExecuteCallbacks() {
   }
   AutoReset<bool> recursion_guard(&in_wait_for_events_and_execute_callbacks_,
                                   true);
-  if (alarm_map_.empty()) {
+  if (alarm_heap_.empty()) {
     // no alarms, this is business as usual.
-    WaitForEventsAndCallHandleEvents(timeout_in_us_, events_, events_size_);
+    WaitForEventsAndCallHandleEvents(timeout_in_us_, events_.data(),
+                                     static_cast<int>(events_.size()));
+    AdaptEventsSize();
     recorded_now_in_us_ = 0;
     return;
   }
@@ -347,9 +492,9 @@ void EpollServer::WaitForEventsAndExecuteCallbacks() {
   // a more reasonable amount of work is done here.
   int64_t now_in_us = NowInUsec();
 
-  // Get the first timeout from the alarm_map where it is
+  // Get the first timeout from the alarm_heap where it is
   // stored in absolute time.
-  int64_t next_alarm_time_in_us = alarm_map_.begin()->first;
+  int64_t next_alarm_time_in_us = alarm_heap_.front().timeout_time_in_us;
   VLOG(4) << "next_alarm_time = " << next_alarm_time_in_us
           << " now             = " << now_in_us
           << " timeout_in_us = " << timeout_in_us_;
@@ -370,19 +515,16 @@ void EpollServer::WaitForEventsAndExecuteCallbacks() {
 
   // wait for events.
 
-  WaitForEventsAndCallHandleEvents(wait_time_in_us, events_, events_size_);
+  WaitForEventsAndCallHandleEvents(wait_time_in_us, events_.data(),
+                                   static_cast<int>(events_.size()));
+  AdaptEventsSize();
   CallAndReregisterAlarmEvents();
   recorded_now_in_us_ = 0;
 }
 
 void EpollServer::SetFDReady(int fd, int events_to_fake) {
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() != fd_i && fd_i->cb != NULL) {
-    // This const_cast is necessary for LIST_HEAD_INSERT to work. Declaring
-    // entry mutable is insufficient because LIST_HEAD_INSERT assigns the
-    // forward pointer of the list head to the current cb_and_mask, and the
-    // compiler complains that it can't assign a const T* to a T*.
-    CBAndEventMask *cb_and_mask = const_cast<CBAndEventMask *>(&*fd_i);
+  CBAndEventMask *cb_and_mask = cb_map_.Find(fd);
+  if (cb_and_mask != NULL && cb_and_mask->cb != NULL) {
     // Note that there is no clearly correct behavior here when
     // cb_and_mask->events_to_fake != 0 and this function is called.
     // Of the two operations:
@@ -397,16 +539,16 @@ void EpollServer::SetFDReady(int fd, int events_to_fake) {
 }
 
 void EpollServer::SetFDNotReady(int fd) {
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() != fd_i) {
-    RemoveFromReadyList(*fd_i);
+  CBAndEventMask *cb_and_mask = cb_map_.Find(fd);
+  if (cb_and_mask != NULL) {
+    RemoveFromReadyList(cb_and_mask);
   }
 }
 
 bool EpollServer::IsFDReady(int fd) const {
-  FDToCBMap::const_iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  return (cb_map_.end() != fd_i && fd_i->cb != NULL &&
-          fd_i->entry.le_prev != NULL);
+  const CBAndEventMask *cb_and_mask = cb_map_.Find(fd);
+  return (cb_and_mask != NULL && cb_and_mask->cb != NULL &&
+          cb_and_mask->entry.le_prev != NULL);
 }
 
 void EpollServer::VerifyReadyList() const {
@@ -421,53 +563,167 @@ void EpollServer::VerifyReadyList() const {
   CHECK_EQ(ready_list_size_, count) << "Ready list size does not match count";
 }
 
-// Test to see if a set or map contains a particular key.
-// Returns true if the key is in the collection.
-template <typename Collection, typename Key>
-bool ContainsKey(const Collection &collection, const Key &key) {
-  return collection.find(key) != collection.end();
-}
-
 void EpollServer::RegisterAlarm(int64_t timeout_time_in_us, AlarmCB *ac) {
   CHECK(ac);
-  if (ContainsKey(all_alarms_, ac)) {
-    LOG(FATAL) << "Alarm already exists " << ac;
-  }
+  DCHECK_EQ(ac->heap_index_, AlarmCB::kNotInAlarmHeap)
+      << "Alarm already exists " << ac;
   VLOG(4) << "RegisteringAlarm at : " << timeout_time_in_us;
 
-  TimeToAlarmCBMap::iterator alarm_iter =
-      alarm_map_.insert(std::make_pair(timeout_time_in_us, ac));
+  alarm_heap_.push_back(AlarmHeapEntry{timeout_time_in_us, ac});
+  SiftAlarmUp(alarm_heap_.size() - 1);
 
-  all_alarms_.insert(ac);
-  // Pass the iterator to the EpollAlarmCallbackInterface.
-  ac->OnRegistration(alarm_iter, this);
+  // Pass the token to the EpollAlarmCallbackInterface.
+  ac->OnRegistration(ac, this);
 }
 
 // Unregister a specific alarm callback: iterator_token must be a
-//  valid iterator. The caller must ensure the validity of the iterator.
+//  valid token. The caller must ensure the validity of the token.
 void EpollServer::UnregisterAlarm(const AlarmRegToken &iterator_token) {
-  AlarmCB *cb = iterator_token->second;
-  alarm_map_.erase(iterator_token);
-  all_alarms_.erase(cb);
+  AlarmCB *cb = iterator_token;
+  DCHECK_NE(cb->heap_index_, AlarmCB::kNotInAlarmHeap);
+  RemoveAlarmAt(cb->heap_index_);
   cb->OnUnregistration();
 }
 
+void EpollServer::RescheduleAlarm(const AlarmRegToken &iterator_token,
+                                  int64_t timeout_time_in_us) {
+  AlarmCB *cb = iterator_token;
+  DCHECK_NE(cb->heap_index_, AlarmCB::kNotInAlarmHeap);
+  const size_t index = cb->heap_index_;
+  const int64_t old_timeout_time_in_us =
+      alarm_heap_[index].timeout_time_in_us;
+  alarm_heap_[index].timeout_time_in_us = timeout_time_in_us;
+  if (timeout_time_in_us < old_timeout_time_in_us) {
+    SiftAlarmUp(index);
+  } else {
+    SiftAlarmDown(index);
+  }
+}
+
+void EpollServer::SiftAlarmUp(size_t index) {
+  const AlarmHeapEntry entry = alarm_heap_[index];
+  while (index > 0) {
+    const size_t parent = (index - 1) / kAlarmHeapArity;
+    if (alarm_heap_[parent].timeout_time_in_us <= entry.timeout_time_in_us) {
+      break;
+    }
+    alarm_heap_[index] = alarm_heap_[parent];
+    alarm_heap_[index].cb->heap_index_ = index;
+    index = parent;
+  }
+  alarm_heap_[index] = entry;
+  entry.cb->heap_index_ = index;
+}
+
+void EpollServer::SiftAlarmDown(size_t index) {
+  const AlarmHeapEntry entry = alarm_heap_[index];
+  const size_t size = alarm_heap_.size();
+  while (true) {
+    const size_t first_child = index * kAlarmHeapArity + 1;
+    if (first_child >= size) {
+      break;
+    }
+    const size_t end_child = std::min(first_child + kAlarmHeapArity, size);
+    size_t min_child = first_child;
+    for (size_t child = first_child + 1; child < end_child; ++child) {
+      if (alarm_heap_[child].timeout_time_in_us <
+          alarm_heap_[min_child].timeout_time_in_us) {
+        min_child = child;
+      }
+    }
+    if (entry.timeout_time_in_us <= alarm_heap_[min_child].timeout_time_in_us) {
+      break;
+    }
+    alarm_heap_[index] = alarm_heap_[min_child];
+    alarm_heap_[index].cb->heap_index_ = index;
+    index = min_child;
+  }
+  alarm_heap_[index] = entry;
+  entry.cb->heap_index_ = index;
+}
+
+void EpollServer::RemoveAlarmAt(size_t index) {
+  DCHECK_LT(index, alarm_heap_.size());
+  alarm_heap_[index].cb->heap_index_ = AlarmCB::kNotInAlarmHeap;
+  const AlarmHeapEntry last = alarm_heap_.back();
+  alarm_heap_.pop_back();
+  if (index == alarm_heap_.size()) {
+    // The removed alarm was the last slot; nothing to fill in.
+    return;
+  }
+  const int64_t removed_timeout_time_in_us =
+      alarm_heap_[index].timeout_time_in_us;
+  alarm_heap_[index] = last;
+  if (last.timeout_time_in_us < removed_timeout_time_in_us) {
+    SiftAlarmUp(index);
+  } else {
+    SiftAlarmDown(index);
+  }
+}
+
+void EpollServer::AdaptEventsSize() {
+  const size_t num_events = static_cast<size_t>(last_num_events_);
+  if (num_events == events_.size()) {
+    // There may well have been more ready fds than fitted; make room for
+    // them so that the next iteration does not take two waits to see them.
+    num_low_usage_waits_ = 0;
+    if (events_.size() < kMaxEventsSize) {
+      events_.resize(events_.size() * 2);
+      VLOG(2) << "Grew the epoll events array to " << events_.size();
+    }
+    return;
+  }
+  if (num_events > events_.size() / 4 || events_.size() <= kMinEventsSize) {
+    num_low_usage_waits_ = 0;
+    return;
+  }
+  if (++num_low_usage_waits_ >= kShrinkEventsAfterWaits) {
+    num_low_usage_waits_ = 0;
+    events_.resize(events_.size() / 2);
+    events_.shrink_to_fit();
+    VLOG(2) << "Shrank the epoll events array to " << events_.size();
+  }
+}
+
 int EpollServer::NumFDsRegistered() const {
-  DCHECK_GE(cb_map_.size(), 1u);
-  // Omit the internal FD (read_fd_)
-  return static_cast<int>(cb_map_.size()) - 1;
+  const int num_internal_fds = timer_fd_ >= 0 ? 2 : 1;
+  DCHECK_GE(cb_map_.size(), static_cast<size_t>(num_internal_fds));
+  // Omit the internal FDs (wake_fd_ and timer_fd_)
+  return static_cast<int>(cb_map_.size()) - num_internal_fds;
 }
 
 void EpollServer::Wake() {
-  char data = 'd';  // 'd' is for data.  It's good enough for me.
-  ssize_t rv = write(write_fd_, &data, 1);
-  DCHECK_EQ(rv, 1);
+  // The plain load keeps producers that find a wake-up already pending from
+  // all writing to the same cache line.
+  if (wake_pending_.load() || wake_pending_.exchange(true)) {
+    num_wakes_coalesced_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  uint64_t one = 1;
+  ssize_t rv = write(wake_fd_, &one, sizeof(one));
+  DCHECK_EQ(rv, static_cast<ssize_t>(sizeof(one)));
 }
 
 int64_t EpollServer::NowInUsec() const {
+  if (tsc_clock_ != nullptr) {
+    return tsc_clock_->NowInUsec();
+  }
   return (Time::Now() - Time::UnixEpoch()).count();
 }
 
+void EpollServer::set_use_tsc_clock(bool use) {
+  if (!use) {
+    tsc_clock_.reset();
+    return;
+  }
+  if (tsc_clock_ == nullptr) {
+    tsc_clock_.reset(new TSCClock());
+    if (!tsc_clock_->uses_tsc()) {
+      LOG(WARNING) << "No invariant TSC, reading the system clock instead";
+    }
+  }
+}
+
 int64_t EpollServer::ApproximateNowInUsec() const {
   if (recorded_now_in_us_ != 0) {
     return recorded_now_in_us_;
@@ -498,21 +754,28 @@ void EpollServer::LogStateOnCrash() {
   LOG(ERROR) << "timeout_in_us_: " << timeout_in_us_;
 
   // Log sessions with alarms.
-  LOG(ERROR) << alarm_map_.size() << " alarms registered.";
-  for (TimeToAlarmCBMap::iterator it = alarm_map_.begin();
-       it != alarm_map_.end(); ++it) {
-    const bool skipped =
-        alarms_reregistered_and_should_be_skipped_.find(it->second) !=
-        alarms_reregistered_and_should_be_skipped_.end();
-    LOG(ERROR) << "Alarm " << it->second << " registered at time " << it->first
-               << " and should be skipped = " << skipped;
+  LOG(ERROR) << alarm_heap_.size() << " alarms registered.";
+  for (AlarmHeap::iterator it = alarm_heap_.begin(); it != alarm_heap_.end();
+       ++it) {
+    LOG(ERROR) << "Alarm " << it->cb << " registered at time "
+               << it->timeout_time_in_us;
   }
 
   LOG(ERROR) << cb_map_.size() << " fd callbacks registered.";
-  for (FDToCBMap::iterator it = cb_map_.begin(); it != cb_map_.end(); ++it) {
+  for (CBAndEventMask *it = cb_map_.Next(-1); it != NULL;
+       it = cb_map_.Next(it->fd)) {
     LOG(ERROR) << "fd: " << it->fd << " with mask " << it->event_mask
                << " registered with cb: " << it->cb;
   }
+  const std::vector<TraceRing::Record> records = trace_ring_.Snapshot();
+  const size_t first = records.size() > kCrashLogTraceRecords
+                           ? records.size() - kCrashLogTraceRecords
+                           : 0;
+  LOG(ERROR) << "Last " << records.size() - first << " of "
+             << trace_ring_.NumAdded() << " trace records:";
+  for (size_t i = first; i < records.size(); ++i) {
+    LOG(ERROR) << TraceRing::ToString(records[i]);
+  }
   LOG(ERROR) << "----------------------/Epoll Server--------------------------";
 }
 
@@ -520,6 +783,11 @@ void EpollServer::LogStateOnCrash() {
 ////////////////////////////////////////////////////////////////////////////////
 
 void EpollServer::DelFD(int fd) const {
+  if (in_shutdown_) {
+    // The epoll set is about to be closed. A subclass which polls some other
+    // way has already gone, and its fds were never in the epoll set.
+    return;
+  }
   struct epoll_event ee;
   memset(&ee, 0, sizeof(ee));
 #ifdef EPOLL_SERVER_EVENT_TRACING
@@ -573,8 +841,8 @@ void EpollServer::ModFD(int fd, int event_mask) const {
 ////////////////////////////////////////
 
 void EpollServer::ModifyFD(int fd, int remove_event, int add_event) {
-  FDToCBMap::iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() == fd_i) {
+  CBAndEventMask *fd_i = cb_map_.Find(fd);
+  if (fd_i == NULL) {
     VLOG(2) << "Didn't find the fd " << fd << "in internal structures";
     return;
   }
@@ -583,20 +851,48 @@ void EpollServer::ModifyFD(int fd, int remove_event, int add_event) {
     int &event_mask = fd_i->event_mask;
     VLOG(3) << "fd= " << fd
             << " event_mask before: " << EventMaskToString(event_mask);
+    fd_i->removed_events |= event_mask & remove_event &
+                            fd_i->polled_event_mask;
     event_mask &= ~remove_event;
     event_mask |= add_event;
 
     VLOG(3) << " event_mask after: " << EventMaskToString(event_mask);
 
-    ModFD(fd, event_mask);
+    if (!fd_i->dirty) {
+      fd_i->dirty = true;
+      dirty_fds_.push_back(fd);
+    } else {
+      // Overwrites a change which has not been handed to ModFD() yet.
+      ++num_epoll_ctls_saved_;
+    }
 
     fd_i->cb->OnModification(fd, event_mask);
   }
 }
 
+void EpollServer::FlushFDChanges() {
+  for (int fd : dirty_fds_) {
+    CBAndEventMask *fd_i = cb_map_.Find(fd);
+    if (fd_i == NULL || !fd_i->dirty) {
+      continue;
+    }
+    fd_i->dirty = false;
+    const int readded = fd_i->removed_events & fd_i->event_mask;
+    fd_i->removed_events = 0;
+    if (fd_i->event_mask == fd_i->polled_event_mask &&
+        !((fd_i->event_mask & EPOLLET) && readded)) {
+      ++num_epoll_ctls_saved_;
+      continue;
+    }
+    ModFD(fd, fd_i->event_mask);
+    fd_i->polled_event_mask = fd_i->event_mask;
+  }
+  dirty_fds_.clear();
+}
+
 bool EpollServer::HasRegisterRead(int fd) const {
-  FDToCBMap::const_iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() == fd_i) {
+  const CBAndEventMask *fd_i = cb_map_.Find(fd);
+  if (fd_i == NULL) {
     return false;
   }
 
@@ -604,17 +900,16 @@ bool EpollServer::HasRegisterRead(int fd) const {
 }
 
 bool EpollServer::HasRegisterWrite(int fd) const {
-  FDToCBMap::const_iterator fd_i = cb_map_.find(CBAndEventMask(NULL, 0, fd));
-  if (cb_map_.end() == fd_i) {
+  const CBAndEventMask *fd_i = cb_map_.Find(fd);
+  if (fd_i == NULL) {
     return false;
   }
 
   return fd_i->event_mask & EPOLLOUT;
 }
 
-void EpollServer::WaitForEventsAndCallHandleEvents(int64_t timeout_in_us,
-                                                   struct epoll_event events[],
-                                                   int events_size) {
+int EpollServer::WaitForEvents(int64_t timeout_in_us,
+                               struct epoll_event events[], int events_size) {
   if (timeout_in_us == 0 || ready_list_.lh_first != NULL) {
     // If ready list is not empty, then don't sleep at all.
     timeout_in_us = 0;
@@ -627,13 +922,46 @@ void EpollServer::WaitForEventsAndCallHandleEvents(int64_t timeout_in_us,
     timeout_in_us = -1000;
   } else {
     // If timeout is specified, and the ready list is empty.
-    if (timeout_in_us < 1000) {
+    if (timeout_in_us < 1000 && !high_resolution_timers_) {
       timeout_in_us = 1000;
     }
   }
+  if (timeout_in_us > 0 && high_resolution_timers_) {
+    return epoll_pwait2_impl(epoll_fd_, events, events_size, timeout_in_us);
+  }
   const int timeout_in_ms = static_cast<int>(timeout_in_us / 1000);
-  int nfds = epoll_wait_impl(epoll_fd_, events, events_size, timeout_in_ms);
+  return epoll_wait_impl(epoll_fd_, events, events_size, timeout_in_ms);
+}
+
+void EpollServer::WaitForEventsAndCallHandleEvents(int64_t timeout_in_us,
+                                                   struct epoll_event events[],
+                                                   int events_size) {
+  if (!dirty_fds_.empty()) {
+    FlushFDChanges();
+  }
+  const bool tracing = trace_ring_.enabled();
+  const int64_t start = tracing ? trace_ring_.Now() : 0;
+  int nfds = 0;
+  if (timeout_in_us != 0 && ready_list_.lh_first == NULL &&
+      spin_budget_in_us_ > 0) {
+    nfds = SpinForEvents(events, events_size, &timeout_in_us);
+  }
+  if (nfds == 0) {
+    nfds = WaitForEvents(timeout_in_us, events, events_size);
+  }
+  if (tracing) {
+    trace_ring_.Add(TraceRing::kWait, start, trace_ring_.Now(), -1, nfds);
+  }
   VLOG(5) << "nfds=" << nfds;
+  last_num_events_ = std::max(nfds, 0);
+  size_t bucket = 0;
+  while ((last_num_events_ >> bucket) != 0) {
+    ++bucket;
+  }
+  if (bucket >= events_per_wait_histogram_.size()) {
+    events_per_wait_histogram_.resize(bucket + 1, 0);
+  }
+  ++events_per_wait_histogram_[bucket];
 
   /*
 #ifdef EPOLL_SERVER_EVENT_TRACING
@@ -649,6 +977,7 @@ void EpollServer::WaitForEventsAndCallHandleEvents(int64_t timeout_in_us,
   // done epoll_wait, which guarantees that the maximum error is the amount of
   // time it takes to process all the events generated by epoll_wait.
   recorded_now_in_us_ = NowInUsec();
+  loop_time_in_us_ = recorded_now_in_us_;
   if (nfds > 0) {
     for (int i = 0; i < nfds; ++i) {
       int event_mask = events[i].events;
@@ -671,6 +1000,36 @@ void EpollServer::WaitForEventsAndCallHandleEvents(int64_t timeout_in_us,
   }
 }
 
+int EpollServer::SpinForEvents(struct epoll_event events[], int events_size,
+                               int64_t *timeout_in_us) {
+  const int64_t start_in_us = NowInUsec();
+  int64_t spin_in_us = spin_budget_in_us_;
+  if (*timeout_in_us >= 0) {
+    spin_in_us = std::min(spin_in_us, *timeout_in_us);
+  }
+  int64_t now_in_us = start_in_us;
+  int nfds = 0;
+  do {
+    nfds = epoll_wait_impl(epoll_fd_, events, events_size, 0);
+    if (nfds != 0) {
+      if (nfds > 0) {
+        ++num_productive_polls_;
+      }
+      return nfds;
+    }
+    ++num_empty_polls_;
+    now_in_us = NowInUsec();
+  } while (now_in_us - start_in_us < spin_in_us);
+
+  ++num_spins_fallen_asleep_;
+  if (*timeout_in_us > 0) {
+    *timeout_in_us =
+        std::max(*timeout_in_us - (now_in_us - start_in_us),
+                 static_cast<int64_t>(0));
+  }
+  return 0;
+}
+
 void EpollServer::CallReadyListCallbacks() {
   // Check pre-conditions.
   DCHECK(tmp_list_.lh_first == NULL);
@@ -680,10 +1039,14 @@ void EpollServer::CallReadyListCallbacks() {
   if (tmp_list_.lh_first) {
     tmp_list_.lh_first->entry.le_prev = &tmp_list_.lh_first;
     EpollEvent event(0);
+    // Each callback ends where the next one starts, so that tracing reads
+    // the clock once per callback.
+    const bool tracing = trace_ring_.enabled();
+    int64_t start = tracing ? trace_ring_.Now() : 0;
     while (tmp_list_.lh_first != NULL) {
       DCHECK_GT(ready_list_size_, 0);
       CBAndEventMask *cb_and_mask = tmp_list_.lh_first;
-      RemoveFromReadyList(*cb_and_mask);
+      RemoveFromReadyList(cb_and_mask);
 
       event.out_ready_mask = 0;
       event.in_events =
@@ -699,12 +1062,18 @@ void EpollServer::CallReadyListCallbacks() {
         AutoReset<bool> in_use_guard(&(cb_and_mask->in_use), true);
         cb_and_mask->cb->OnEvent(cb_and_mask->fd, &event);
       }
+      if (tracing) {
+        const int64_t end = trace_ring_.Now();
+        trace_ring_.Add(TraceRing::kEvent, start, end, cb_and_mask->fd,
+                        event.in_events);
+        start = end;
+      }
 
       // Since OnEvent may have called UnregisterFD, we must check here that
       // the callback is still valid. If it isn't, then UnregisterFD *was*
       // called, and we should now get rid of the object.
       if (cb_and_mask->cb == NULL) {
-        cb_map_.erase(*cb_and_mask);
+        cb_map_.Erase(cb_and_mask);
       } else if (event.out_ready_mask != 0) {
         cb_and_mask->events_to_fake = event.out_ready_mask;
         AddToReadyList(cb_and_mask);
@@ -718,49 +1087,34 @@ void EpollServer::CallAndReregisterAlarmEvents() {
   int64_t now_in_us = recorded_now_in_us_;
   DCHECK_NE(0, recorded_now_in_us_);
 
-  TimeToAlarmCBMap::iterator erase_it;
-
   // execute alarms.
-  for (TimeToAlarmCBMap::iterator i = alarm_map_.begin();
-       i != alarm_map_.end();) {
-    if (i->first > now_in_us) {
-      break;
-    }
-    AlarmCB *cb = i->second;
-    // Execute the OnAlarm() only if we did not register
-    // it in this loop itself.
-    const bool added_in_this_round =
-        alarms_reregistered_and_should_be_skipped_.find(cb) !=
-        alarms_reregistered_and_should_be_skipped_.end();
-    if (added_in_this_round) {
-      ++i;
-      continue;
-    }
-    all_alarms_.erase(cb);
+  while (!alarm_heap_.empty() &&
+         alarm_heap_.front().timeout_time_in_us <= now_in_us) {
+    AlarmCB *cb = alarm_heap_.front().cb;
+    // Take the alarm off the heap before OnAlarm(), which is then free to
+    // register it again itself.
+    RemoveAlarmAt(0);
+    const int64_t start = trace_ring_.enabled() ? trace_ring_.Now() : 0;
     const int64_t new_timeout_time_in_us = cb->OnAlarm();
-
-    erase_it = i;
-    ++i;
-    alarm_map_.erase(erase_it);
+    if (trace_ring_.enabled()) {
+      trace_ring_.Add(TraceRing::kAlarm, start, trace_ring_.Now(), -1, 0);
+    }
 
     if (new_timeout_time_in_us > 0) {
-      // We add to hash_set only if the new timeout is <= now_in_us.
-      // if timeout is > now_in_us then we have no fear that this alarm
-      // can be reexecuted in this loop, and hence we do not need to
-      // worry about a recursive loop.
+      // An alarm reregistered at or before now_in_us would come straight
+      // back to the top of the heap and we could go in an infinite loop.
+      // Such an alarm is due on the next call anyway, so register it just
+      // past now_in_us: it is skipped for the rest of this loop and goes
+      // off on the next one, like any other alarm that has expired by then.
       DVLOG(3) << "Reregistering alarm "
                << " " << cb << " " << new_timeout_time_in_us << " "
                << now_in_us;
-      if (new_timeout_time_in_us <= now_in_us) {
-        alarms_reregistered_and_should_be_skipped_.insert(cb);
-      }
-      RegisterAlarm(new_timeout_time_in_us, cb);
+      RegisterAlarm(std::max(new_timeout_time_in_us, now_in_us + 1), cb);
     }
   }
-  alarms_reregistered_and_should_be_skipped_.clear();
 }
 
-EpollAlarm::EpollAlarm() : eps_(NULL), registered_(false) {}
+EpollAlarm::EpollAlarm() : token_(NULL), eps_(NULL), registered_(false) {}
 
 EpollAlarm::~EpollAlarm() { UnregisterIfRegistered(); }
 
@@ -793,4 +1147,12 @@ void EpollAlarm::UnregisterIfRegistered() {
   eps_->UnregisterAlarm(token_);
 }
 
+bool EpollAlarm::RescheduleIfRegistered(int64_t timeout_time_in_us) {
+  if (!registered_) {
+    return false;
+  }
+  eps_->RescheduleAlarm(token_, timeout_time_in_us);
+  return true;
+}
+
 }  // namespace raner
@@ -12,11 +12,10 @@
 
 #include <glog/logging.h>
 
-#include <map>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 // #define EPOLL_SERVER_EVENT_TRACING 1
@@ -41,12 +40,15 @@ using namespace std;
 #include <sys/epoll.h>
 
 #include "raner/macros.h"
+#include "raner/trace_ring.h"
+#include "raner/tsc_clock.h"
 
 namespace raner {
 
 class EpollServer;
 class EpollAlarmCallbackInterface;
-class ReadPipeCallback;
+class ReadEventFDCallback;
+class ReadTimerFDCallback;
 
 struct EpollEvent {
   EpollEvent(int events) : in_events(events), out_ready_mask(0) {}
@@ -127,8 +129,9 @@ class EpollServer {
   typedef EpollAlarmCallbackInterface AlarmCB;
   typedef EpollCallbackInterface CB;
 
-  typedef std::multimap<int64_t, AlarmCB *> TimeToAlarmCBMap;
-  typedef TimeToAlarmCBMap::iterator AlarmRegToken;
+  // The alarm itself is the token: its position in the alarm heap is kept
+  // inside the AlarmCB, so a token stays cheap to copy and to look up.
+  typedef AlarmCB *AlarmRegToken;
 
   // Summary:
   //   Constructor:
@@ -408,16 +411,96 @@ class EpollServer {
 
   ////////////////////////////////////////
 
+  // Summary:
+  //   Moves the alarm referred to by iterator_token so that it goes off at
+  //   'timeout_time_in_us' instead. Unlike UnregisterAlarm() followed by
+  //   RegisterAlarm(), the alarm stays registered the whole time: neither
+  //   OnUnregistration() nor OnRegistration() is called and the token stays
+  //   valid. The same validity rules as UnregisterAlarm() apply to the token.
+  // Args:
+  //    iterator_token - iterator to the alarm callback to reschedule.
+  //    timeout_time_in_us - the new absolute time for the alarm.
+  virtual void RescheduleAlarm(const EpollServer::AlarmRegToken &iterator_token,
+                               int64_t timeout_time_in_us);
+
+  // Summary:
+  //   returns the number of alarms registered in this EpollServer.
+  size_t NumAlarmsRegistered() const { return alarm_heap_.size(); }
+
+  ////////////////////////////////////////
+
   // Summary:
   //   returns the number of file-descriptors registered in this EpollServer.
   // Returns:
-  //   number of FDs registered (discounting the internal pipe used for Wake)
+  //   number of FDs registered (discounting the internal eventfd used for
+  //   Wake)
   virtual int NumFDsRegistered() const;
 
   // Summary:
-  //   Force the epoll server to wake up (by writing to an internal pipe).
+  //   Force the epoll server to wake up (by writing to an internal eventfd).
+  //   Only the first call after the eventfd was last drained makes the
+  //   write syscall; the server is already due to wake up for any later
+  //   call, which is just counted. Safe to call from other threads.
   virtual void Wake();
 
+  // Summary:
+  //   Returns the number of Wake() calls that did not need a syscall
+  //   because a wake-up was already pending.
+  int64_t NumWakesCoalesced() const {
+    return num_wakes_coalesced_.load(std::memory_order_relaxed);
+  }
+
+  // Summary:
+  //   Returns the number of ModFD() calls, each an epoll_ctl with
+  //   EpollServer, which deferring the changes of ModifyFD() to the next
+  //   wait has saved: changes overwritten by a later one before the wait,
+  //   changes which cancelled out, such as a StartWrite() followed by a
+  //   StopWrite(), and changes to fds unregistered before the wait.
+  int64_t NumEpollCtlsSaved() const { return num_epoll_ctls_saved_; }
+
+  // Summary:
+  //   Returns how many epoll_wait calls returned how many events. Bucket 0
+  //   counts the calls which returned none, and bucket i > 0 counts those
+  //   which returned between 2^(i-1) and 2^i - 1 events. Loop thread only.
+  const std::vector<int64_t> &EventsPerWaitHistogram() const {
+    return events_per_wait_histogram_;
+  }
+
+  // Summary:
+  //   Returns the number of events the next epoll_wait can return. This
+  //   starts at kMinEventsSize, doubles whenever a wait fills it, and halves
+  //   after kShrinkEventsAfterWaits waits in a row used no more than a
+  //   quarter of it.
+  size_t EventsSize() const { return events_.size(); }
+
+  static constexpr size_t kMinEventsSize = 256;
+  static constexpr size_t kMaxEventsSize = 64 * 1024;
+  static constexpr int kShrinkEventsAfterWaits = 1024;
+
+  // Summary:
+  //   Sets how long a wait that would block first busy-polls instead, with
+  //   epoll_wait calls which return immediately, so that an event arriving
+  //   within the budget is picked up without the scheduler having to wake
+  //   the thread. The budget never extends a wait past its timeout. 0, the
+  //   default, always blocks right away. Spinning burns the core for up to
+  //   the budget on every idle wait, so it is for loops with a core of
+  //   their own.
+  void set_spin_budget_in_us(int64_t spin_budget_in_us) {
+    spin_budget_in_us_ = spin_budget_in_us;
+  }
+  int64_t spin_budget_in_us() const { return spin_budget_in_us_; }
+
+  // Summary:
+  //   Returns the number of busy-polls which found events, and the number
+  //   which did not. Their ratio tells how well the spin budget pays off.
+  int64_t NumProductivePolls() const { return num_productive_polls_; }
+  int64_t NumEmptyPolls() const { return num_empty_polls_; }
+
+  // Summary:
+  //   Returns the number of waits which found nothing within the spin
+  //   budget and went on to block.
+  int64_t NumSpinsFallenAsleep() const { return num_spins_fallen_asleep_; }
+
   // Summary:
   //   Wrapper around WallTimer's NowInUsec.  We do this so that we can test
   //   EpollServer without using the system clock (and can avoid the flakiness
@@ -449,12 +532,48 @@ class EpollServer {
   //   epoch.
   virtual int64_t ApproximateNowInUsec() const;
 
+  // Summary:
+  //   Returns the time at which the last epoll_wait returned, which is the
+  //   same for every callback, alarm and function run in one iteration of
+  //   the caller's loop, until the next wait. Unlike ApproximateNowInUsec(),
+  //   it is still cached once WaitForEventsAndExecuteCallbacks has returned,
+  //   so code running between two calls, such as the functors of an
+  //   EventLoop, does not read the clock either. Before the first wait it
+  //   is NowInUsec().
+  // Returns:
+  //   the loop time as number of microseconds since the Unix epoch.
+  int64_t LoopTimeInUsec() const {
+    return loop_time_in_us_ != 0 ? loop_time_in_us_ : NowInUsec();
+  }
+
+  // Summary:
+  //   Makes NowInUsec() read the TSC instead of the system clock, which
+  //   takes a few nanoseconds where even the vDSO takes tens; see TSCClock.
+  //   The server reads the clock at least once per wait, and on every poll
+  //   while spinning. Where the TSC is not invariant the system clock keeps
+  //   being read. Once on, NowInUsec() must only be called from the thread
+  //   running the server.
+  void set_use_tsc_clock(bool use);
+  // Returns true if NowInUsec() reads the TSC.
+  bool uses_tsc_clock() const {
+    return tsc_clock_ != nullptr && tsc_clock_->uses_tsc();
+  }
+
   static std::string EventMaskToString(int event_mask);
 
   // Summary:
-  //   Logs the state of the epoll server with LOG(ERROR).
+  //   Logs the state of the epoll server with LOG(ERROR), ending with the
+  //   last kCrashLogTraceRecords records of trace_ring().
   void LogStateOnCrash();
 
+  static constexpr size_t kCrashLogTraceRecords = 64;
+
+  // Summary:
+  //   The trace of the waits, callbacks and alarms of this server, enabled
+  //   by default. EventLoop adds its functor batches to it.
+  TraceRing *trace_ring() { return &trace_ring_; }
+  const TraceRing *trace_ring() const { return &trace_ring_; }
+
   // Summary:
   //   Set the timeout to the value specified.
   //   If the timeout is set to a negative number,
@@ -479,6 +598,20 @@ class EpollServer {
   //   Accessor for the current value of timeout_in_us.
   int64_t timeout_in_us() const { return timeout_in_us_; }
 
+  ////////////////////////////////////////
+
+  // Summary:
+  //   By default a wait is given in milliseconds, so an alarm fires up to a
+  //   millisecond late, and a wait shorter than that is rounded up to it.
+  //   With high resolution timers, the wait is given in microseconds to
+  //   epoll_pwait2(), or, on kernels before 5.11, ends with a timerfd armed
+  //   to the earliest alarm; alarms then fire within the timer slack of the
+  //   thread. Turning them on also lowers that slack from the default 50us
+  //   to 1ns for the calling thread, which should be the one running the
+  //   server.
+  void set_high_resolution_timers(bool on);
+  bool high_resolution_timers() const { return high_resolution_timers_; }
+
   // Summary:
   // Returns true when the EpollServer() is being destroyed.
   bool in_shutdown() const { return in_shutdown_; }
@@ -491,22 +624,24 @@ class EpollServer {
   virtual int epoll_wait_impl(int epfd, struct epoll_event *events,
                               int max_events, int timeout_in_ms);
 
+  // The same with a timeout in microseconds, which is positive. Used
+  // instead of epoll_wait_impl() when high_resolution_timers() is set.
+  virtual int epoll_pwait2_impl(int epfd, struct epoll_event *events,
+                                int max_events, int64_t timeout_in_us);
+
   // this struct is used internally, and is never used by anything external
-  // to this class. Some of its members are declared mutable to get around the
-  // restriction imposed by hash_set. Since hash_set knows nothing about the
-  // objects it stores, it has to assume that every bit of the object is used
-  // in the hash function and equal_to comparison. Thus hash_set::iterator is a
-  // const iterator. In this case, the only thing that must stay constant is
-  // fd. Everything else are just along for the ride and changing them doesn't
-  // compromise the hash_set integrity.
+  // to this class. An entry whose fd is -1 is an empty slot of FDToCBMap.
   struct CBAndEventMask {
     CBAndEventMask()
         : cb(NULL),
           fd(-1),
           event_mask(0),
+          polled_event_mask(0),
           events_asserted(0),
           events_to_fake(0),
-          in_use(false) {
+          in_use(false),
+          dirty(false),
+          removed_events(0) {
       entry.le_next = NULL;
       entry.le_prev = NULL;
     }
@@ -515,45 +650,88 @@ class EpollServer {
         : cb(c),
           fd(f),
           event_mask(em),
+          polled_event_mask(em),
           events_asserted(0),
           events_to_fake(0),
-          in_use(false) {
+          in_use(false),
+          dirty(false),
+          removed_events(0) {
       entry.le_next = NULL;
       entry.le_prev = NULL;
     }
 
-    // Required operator for hash_set. Normally operator== should be a free
-    // standing function. However, since CBAndEventMask is a protected type and
-    // it will never be a base class, it makes no difference.
-    bool operator==(const CBAndEventMask &cb_and_mask) const {
-      return fd == cb_and_mask.fd;
-    }
     // A callback. If the fd is unregistered inside the callchain of OnEvent,
     // the cb will be set to NULL.
-    mutable EpollCallbackInterface *cb;
+    EpollCallbackInterface *cb;
 
-    mutable LIST_ENTRY(CBAndEventMask) entry;
+    LIST_ENTRY(CBAndEventMask) entry;
     // file descriptor registered with the epoll server.
     int fd;
     // the current event_mask registered for this callback.
-    mutable int event_mask;
+    int event_mask;
+    // the event_mask last handed to AddFD() or ModFD(), which lags behind
+    // event_mask while dirty.
+    int polled_event_mask;
     // the event_mask that was returned by epoll
-    mutable int events_asserted;
+    int events_asserted;
     // the event_mask for the ready list to use to call OnEvent.
-    mutable int events_to_fake;
+    int events_to_fake;
     // toggle around calls to OnEvent to tell UnregisterFD to not erase the
-    // iterator because HandleEvent is using it.
-    mutable bool in_use;
+    // entry because HandleEvent is using it.
+    bool in_use;
+    // true while the fd is in dirty_fds_ with a change of event_mask which
+    // has not been handed to ModFD() yet.
+    bool dirty;
+    // the events of polled_event_mask removed from event_mask while dirty.
+    // An EPOLLET fd which got some of them back is handed to ModFD() even if
+    // its mask ends up unchanged, since the MOD is what re-arms its edges.
+    int removed_events;
   };
 
-  // Custom hash function to be used by hash_set.
-  struct CBAndEventMaskHash {
-    size_t operator()(const CBAndEventMask &cb_and_eventmask) const {
-      return static_cast<size_t>(cb_and_eventmask.fd);
+  // The mapping of file-descriptor to CBAndEventMask. File descriptors are
+  // small, dense integers, so the entries live in a table indexed by fd and a
+  // lookup is a single indexed load rather than a hash lookup. The table
+  // grows in chunks that are never moved or freed before the map is
+  // destroyed, so an entry keeps its address while it is registered, which
+  // the ready list links embedded in it rely on.
+  class FDToCBMap {
+   public:
+    FDToCBMap() : size_(0) {}
+
+    // Returns the entry registered for 'fd', or NULL if there is none.
+    CBAndEventMask *Find(int fd) const {
+      // A negative fd wraps round to an index past the end of the table.
+      const size_t index = static_cast<size_t>(fd);
+      if (index >= capacity()) {
+        return NULL;
+      }
+      CBAndEventMask *cb_and_mask =
+          &chunks_[index / kChunkSize][index % kChunkSize];
+      return cb_and_mask->fd == fd ? cb_and_mask : NULL;
     }
-  };
 
-  using FDToCBMap = std::unordered_set<CBAndEventMask, CBAndEventMaskHash>;
+    // Adds an entry for 'fd', which must not be in the map, and returns it.
+    CBAndEventMask *Insert(EpollCallbackInterface *cb, int event_mask, int fd);
+
+    // Removes 'cb_and_mask', which must not be on a ready list.
+    void Erase(CBAndEventMask *cb_and_mask);
+
+    // Returns the entry with the lowest fd above 'fd', or NULL if there is
+    // none. Next(-1) returns the first entry.
+    CBAndEventMask *Next(int fd) const;
+
+    size_t size() const { return size_; }
+
+   private:
+    static constexpr size_t kChunkSize = 1024;
+
+    size_t capacity() const { return chunks_.size() * kChunkSize; }
+
+    std::vector<std::unique_ptr<CBAndEventMask[]>> chunks_;
+    size_t size_;
+
+    DISALLOW_COPY_AND_ASSIGN(FDToCBMap);
+  };
 
   // the following four functions are OS-specific, and are likely
   // to be changed in a subclass if the poll/select method is changed
@@ -607,6 +785,12 @@ class EpollServer {
   //   the new event mask.
   //   If the file-descriptor specified is not registered in the
   //   epoll_server, then nothing happens as a result of this call.
+  //   The new event mask is seen by OnModification() and by HasRegisterRead()
+  //   and HasRegisterWrite() at once, but is only handed to ModFD() before
+  //   the next wait, and not at all if by then it is back to the one handed
+  //   to ModFD() last; see FlushFDChanges(). No wait can tell the
+  //   difference: an EPOLLET fd with an event removed and added back is
+  //   still handed to ModFD(), which re-arms it as an immediate MOD would.
   // Args:
   //   fd - the file descriptor whose event mask is to be modified
   //   remove_event - the events which are to be removed from the current
@@ -616,6 +800,12 @@ class EpollServer {
   //
   virtual void ModifyFD(int fd, int remove_event, int add_event);
 
+  // Summary:
+  //   Hands the net change of event mask of every fd in dirty_fds_ to
+  //   ModFD(), and the unchanged mask of an EPOLLET fd which had an event
+  //   removed and added back, to re-arm it. Called before each wait.
+  void FlushFDChanges();
+
   ////////////////////////////////////////
 
   // Summary:
@@ -646,7 +836,7 @@ class EpollServer {
   //   An internal function for implementing the ready list. It remove a fd's
   //   CBAndEventMask from the ready list. If the fd is not on the ready list,
   //   it is a no-op.
-  void RemoveFromReadyList(const CBAndEventMask &cb_and_mask);
+  void RemoveFromReadyList(CBAndEventMask *cb_and_mask);
 
   // Summary:
   // Calls any pending alarms that should go off and reregisters them if they
@@ -659,21 +849,23 @@ class EpollServer {
   // The mapping of file-descriptor to CBAndEventMasks
   FDToCBMap cb_map_;
 
-  // Custom hash function to be used by hash_set.
-  struct AlarmCBHash {
-    size_t operator()(AlarmCB *const &p) const {
-      return reinterpret_cast<size_t>(p);
-    }
+  // One slot of the alarm heap. The deadline is stored next to the callback
+  // so that sifting compares keys without touching the AlarmCB itself; the
+  // AlarmCB only learns its new position.
+  struct AlarmHeapEntry {
+    int64_t timeout_time_in_us;
+    AlarmCB *cb;
   };
 
-  // TODO(sushantj): Having this hash_set is avoidable. We currently have it
-  // only so that we can enforce stringent checks that a caller can not register
-  // the same alarm twice. One option is to have an implementation in which
-  // this hash_set is used only in the debug mode.
-  using AlarmCBMap = std::unordered_set<AlarmCB *, AlarmCBHash>;
-  AlarmCBMap all_alarms_;
-
-  TimeToAlarmCBMap alarm_map_;
+  // A 4-ary min-heap ordered by timeout_time_in_us. Each registered AlarmCB
+  // records its own index in the heap (see EpollAlarmCallbackInterface), so
+  // unregistering or rescheduling finds the slot without a search, and a
+  // register/unregister pair does not allocate once the vector has grown to
+  // the number of concurrently registered alarms. Whether an alarm is already
+  // registered is also read off that index, which replaces the hash_set
+  // that used to exist only to catch double registration.
+  using AlarmHeap = std::vector<AlarmHeapEntry>;
+  AlarmHeap alarm_heap_;
 
   // The amount of time in microseconds that we'll wait before returning
   // from the WaitForEventsAndExecuteCallbacks() function.
@@ -682,6 +874,18 @@ class EpollServer {
   // If this is zero, never wait for an event.
   int64_t timeout_in_us_;
 
+  bool high_resolution_timers_;
+
+  int64_t spin_budget_in_us_;
+  int64_t num_productive_polls_;
+  int64_t num_empty_polls_;
+  int64_t num_spins_fallen_asleep_;
+
+  // fds whose event mask ModifyFD() has changed since the last wait; an fd
+  // may be listed after it has been unregistered, or more than once.
+  std::vector<int> dirty_fds_;
+  int64_t num_epoll_ctls_saved_;
+
   // This is nonzero only after the invocation of epoll_wait_impl within
   // WaitForEventsAndCallHandleEvents and before the function
   // WaitForEventsAndExecuteCallbacks returns.  At all other times, this is
@@ -689,21 +893,22 @@ class EpollServer {
   // ApproximateNowInUs() function. See that function for more details.
   int64_t recorded_now_in_us_;
 
-  // This is used to implement CallAndReregisterAlarmEvents. This stores
-  // all alarms that were reregistered because OnAlarm() returned a
-  // value > 0 and the time at which they should be executed is less that
-  // the current time.  By storing such alarms in this map we ensure
-  // that while calling CallAndReregisterAlarmEvents we do not call
-  // OnAlarm on any alarm in this set. This ensures that we do not
-  // go in an infinite loop.
-  AlarmCBMap alarms_reregistered_and_should_be_skipped_;
+  // Set along with recorded_now_in_us_, but never reset; see
+  // LoopTimeInUsec().
+  int64_t loop_time_in_us_;
+
+  std::unique_ptr<TSCClock> tsc_clock_;
 
   LIST_HEAD(ReadyList, CBAndEventMask) ready_list_;
   LIST_HEAD(TmpList, CBAndEventMask) tmp_list_;
   int ready_list_size_;
-  // TODO(alyssar): make this into something that scales up.
-  static const int events_size_ = 256;
-  struct epoll_event events_[256];
+  // The array handed to epoll_wait; see EventsSize().
+  std::vector<struct epoll_event> events_;
+  // The number of events returned by the last epoll_wait.
+  int last_num_events_;
+  // The number of waits in a row which used at most a quarter of events_.
+  int num_low_usage_waits_;
+  std::vector<int64_t> events_per_wait_histogram_;
 
 #ifdef EPOLL_SERVER_EVENT_TRACING
   struct EventRecorder {
@@ -931,17 +1136,48 @@ class EpollServer {
  private:
   // Helper functions used in the destructor.
   void CleanupFDToCBMap();
-  void CleanupTimeToAlarmCBMap();
-
-  // The callback registered to the fds below.  As the purpose of their
-  // registration is to wake the epoll server it just clears the pipe and
-  // returns.
-  std::unique_ptr<ReadPipeCallback> wake_cb_;
-
-  // A pipe owned by the epoll server.  The server will be registered to listen
-  // on read_fd_ and can be woken by Wake() which writes to write_fd_.
-  int read_fd_;
-  int write_fd_;
+  void CleanupAlarmHeap();
+
+  // Grows or shrinks events_ according to last_num_events_.
+  void AdaptEventsSize();
+
+  // Waits for up to timeout_in_us, rounded as described at
+  // set_high_resolution_timers(), and returns what epoll_wait returned.
+  int WaitForEvents(int64_t timeout_in_us, struct epoll_event events[],
+                    int events_size);
+
+  // Busy-polls for up to spin_budget_in_us_, or *timeout_in_us if that is
+  // not negative and is shorter, and returns what the last poll returned.
+  // Takes the time spent off *timeout_in_us.
+  int SpinForEvents(struct epoll_event events[], int events_size,
+                    int64_t *timeout_in_us);
+
+  // Helper functions maintaining the heap property of alarm_heap_ around the
+  // slot at 'index', keeping every AlarmCB's heap index up to date.
+  void SiftAlarmUp(size_t index);
+  void SiftAlarmDown(size_t index);
+  void RemoveAlarmAt(size_t index);
+
+  // The callback registered to the fd below.  As the purpose of its
+  // registration is to wake the epoll server it just clears the eventfd and
+  // wake_pending_, and returns.
+  std::unique_ptr<ReadEventFDCallback> wake_cb_;
+
+  // An eventfd owned by the epoll server.  The server will be registered to
+  // listen on wake_fd_ and can be woken by Wake() which writes to it.
+  int wake_fd_;
+
+  // Set by the Wake() that writes to wake_fd_, and cleared once the eventfd
+  // has been drained, so that concurrent Wake() calls make one syscall.
+  std::atomic<bool> wake_pending_;
+  std::atomic<int64_t> num_wakes_coalesced_;
+
+  // Set once epoll_pwait2() has failed with ENOSYS. High resolution waits
+  // are then ended by timer_fd_ instead, which is created and registered,
+  // with timer_cb_ draining it, on the first such wait.
+  bool use_timer_fd_;
+  std::unique_ptr<ReadTimerFDCallback> timer_cb_;
+  int timer_fd_;
 
   // This boolean is checked to see if it is false at the top of the
   // WaitForEventsAndExecuteCallbacks function. If not, then it either returns
@@ -953,6 +1189,8 @@ class EpollServer {
   // Returns true when the EpollServer() is being destroyed.
   bool in_shutdown_;
 
+  TraceRing trace_ring_;
+
   DISALLOW_COPY_AND_ASSIGN(EpollServer);
 };
 
@@ -970,7 +1208,7 @@ class EpollAlarmCallbackInterface {
   // Summary:
   //   Called when the an alarm is registered. Invalidates an AlarmRegToken.
   // Args:
-  //   token: the iterator to the the alarm registered in the alarm map.
+  //   token: the iterator to the the alarm registered in the alarm heap.
   //   WARNING: this token becomes invalid when the alarm fires, is
   //   unregistered, or OnShutdown is called on that alarm.
   //   eps: the epoll server the alarm is registered with.
@@ -992,7 +1230,16 @@ class EpollAlarmCallbackInterface {
   virtual ~EpollAlarmCallbackInterface() {}
 
  protected:
-  EpollAlarmCallbackInterface() {}
+  EpollAlarmCallbackInterface() : heap_index_(kNotInAlarmHeap) {}
+
+ private:
+  friend class EpollServer;
+
+  static constexpr size_t kNotInAlarmHeap = static_cast<size_t>(-1);
+
+  // The slot this alarm occupies in the alarm heap of the EpollServer it is
+  // registered with, or kNotInAlarmHeap. Only EpollServer touches this.
+  size_t heap_index_;
 };
 
 // A simple alarm which unregisters itself on destruction.
@@ -1024,6 +1271,10 @@ class EpollAlarm : public EpollAlarmCallbackInterface {
   // If the alarm was registered, unregister it.
   void UnregisterIfRegistered();
 
+  // If the alarm was registered, move it to go off at 'timeout_time_in_us'
+  // without unregistering it. Returns false if it was not registered.
+  bool RescheduleIfRegistered(int64_t timeout_time_in_us);
+
   bool registered() const { return registered_; }
 
   const EpollServer *eps() const { return eps_; }
@@ -65,15 +65,13 @@ void EpollTimer::fire() {
 }
 
 void EpollTimer::updateImpl() {
-  // cancelImpl and setImpl take the new deadline by way of the deadline_
-  // member, so save and restore deadline_ before canceling.
-  const Time new_deadline = deadline_;
-
-  deadline_ = Time::UnixEpoch();
-  cancelImpl();
-
-  deadline_ = new_deadline;
-  setImpl();
+  DCHECK(deadline().IsInitialized());
+  // Move the registered alarm within the alarm heap rather than taking it
+  // out and putting it back.
+  if (!epoll_timer_impl_.RescheduleIfRegistered(
+          (deadline() - Time::UnixEpoch()).count())) {
+    setImpl();
+  }
 }
 
 void EpollTimer::setImpl() {
@@ -5,15 +5,24 @@
 #include "raner/event_loop.h"
 
 #include <glog/logging.h>
+#include "raner/io_uring_server.h"
 #include "raner/socket.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 namespace {
 __thread raner::EventLoop *t_loopInThisThread = nullptr;
-const int kPollTimeMs = 10000;
+const int64_t kPollTimeUs = 10 * 1000 * 1000;
+// 512 slots of 100ms: one revolution of the coarse timing wheel is 51.2s.
+const size_t kCoarseTimerSlots = 512;
 
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 class IgnoreSigPipe {
@@ -26,6 +35,83 @@ class IgnoreSigPipe {
 #pragma GCC diagnostic error "-Wold-style-cast"
 
 IgnoreSigPipe initObj;
+
+struct PendingFunctor : public raner::MPSCQueueNode {
+  raner::EventLoop::Functor functor;
+  // The functor_batch_ of the loop when the functor was queued.
+  uint64_t batch;
+};
+
+// The nodes of queued functors are never freed, but kept for the next ones:
+// a loop puts the nodes of the functors it has run back on its free list, a
+// thread queueing functors takes them all off whenever it runs out, and the
+// nodes of loops and threads which are gone are spare. New nodes are
+// allocated as many at once as there are already, as a vector grows, so
+// that even a burst of functors larger than any before costs only a few
+// allocations, and QueueInLoop() then none at all.
+//
+// The nodes this thread has taken; a plain __thread pointer, which unlike a
+// thread_local object costs no initialization check to read.
+__thread raner::MPSCQueueNode *t_free_functors = nullptr;
+
+raner::MPSCNodeStack g_spare_functors;
+
+std::mutex g_functor_chunks_mutex;
+size_t g_num_functors = 0;
+
+const size_t kMinFunctorChunk = 64;
+
+// Makes the nodes from 'first' on, linked through their 'next', spare.
+void spareFunctors(raner::MPSCQueueNode *first) {
+  if (first == nullptr) {
+    return;
+  }
+  raner::MPSCQueueNode *last = first;
+  while (raner::MPSCQueueNode *next =
+             last->next.load(std::memory_order_relaxed)) {
+    last = next;
+  }
+  g_spare_functors.Push(first, last);
+}
+
+// Makes the nodes left in t_free_functors spare when the thread exits.
+struct FreeFunctorsReleaser {
+  ~FreeFunctorsReleaser() {
+    spareFunctors(t_free_functors);
+    t_free_functors = nullptr;
+  }
+};
+
+raner::MPSCQueueNode *allocateFunctors() {
+  // Leaked, as nodes may still be in use while the process exits.
+  static std::vector<std::unique_ptr<PendingFunctor[]>> *chunks =
+      new std::vector<std::unique_ptr<PendingFunctor[]>>;
+  std::lock_guard<std::mutex> guard(g_functor_chunks_mutex);
+  const size_t size = std::max(kMinFunctorChunk, g_num_functors);
+  PendingFunctor *chunk = new PendingFunctor[size];
+  chunks->emplace_back(chunk);
+  g_num_functors += size;
+  for (size_t i = 0; i + 1 < size; ++i) {
+    chunk[i].next.store(&chunk[i + 1], std::memory_order_relaxed);
+  }
+  return chunk;
+}
+
+PendingFunctor *getFreeFunctor(raner::MPSCNodeStack *loop_free_functors) {
+  raner::MPSCQueueNode *node = t_free_functors;
+  if (node == nullptr) {
+    node = loop_free_functors->TakeAll();
+    if (node == nullptr) {
+      node = g_spare_functors.TakeAll();
+    }
+    if (node == nullptr) {
+      node = allocateFunctors();
+    }
+    thread_local FreeFunctorsReleaser releaser;
+  }
+  t_free_functors = node->next.load(std::memory_order_relaxed);
+  return static_cast<PendingFunctor *>(node);
+}
 }  // namespace
 
 namespace raner {
@@ -35,13 +121,28 @@ EventLoop *EventLoop::GetEventLoopOfCurrentThread() {
   return t_loopInThisThread;
 }
 
-EventLoop::EventLoop()
+EventLoop::EventLoop(Poller poller)
     : looping_(false),
       quit_(false),
       calling_pending_functors_(false),
       iteration_(0),
-      thread_id_(std::this_thread::get_id()) {
+      thread_id_(std::this_thread::get_id()),
+      poller_(poller == kIOUring && IOUringServer::IsSupported() ? kIOUring
+                                                                : kEpoll),
+      epoll_server_(poller_ == kIOUring ? new IOUringServer()
+                                        : new EpollServer()),
+      timing_wheel_(kCoarseTimerTickUs, kCoarseTimerSlots),
+      timing_wheel_alarm_time_in_us_(0),
+      functor_batch_(0),
+      held_functor_(nullptr),
+      num_connections_(0),
+      load_stats_(0),
+      busy_time_in_us_(0),
+      last_cpu_(-1) {
   LOG(INFO) << "EventLoop created " << this << " in thread " << thread_id_;
+  if (poller != poller_) {
+    LOG(WARNING) << "io_uring is not supported, using epoll instead";
+  }
   if (t_loopInThisThread) {
     LOG(FATAL) << "Another EventLoop " << t_loopInThisThread
                << " exists in this thread " << thread_id_;
@@ -49,39 +150,78 @@ EventLoop::EventLoop()
     t_loopInThisThread = this;
   }
 
-  epoll_server_.set_timeout_in_us(kPollTimeMs);
+  epoll_server_->set_timeout_in_us(kPollTimeUs);
 }
 
 EventLoop::~EventLoop() {
   LOG(INFO) << "EventLoop " << this << " of thread " << thread_id_
             << " destructs in thread " << std::this_thread::get_id();
   t_loopInThisThread = nullptr;
+  if (held_functor_ != nullptr) {
+    static_cast<PendingFunctor *>(held_functor_)->functor = nullptr;
+    held_functor_->next.store(nullptr, std::memory_order_relaxed);
+    spareFunctors(held_functor_);
+  }
+  while (MPSCQueueNode *node = pending_functors_.Pop()) {
+    static_cast<PendingFunctor *>(node)->functor = nullptr;
+    node->next.store(nullptr, std::memory_order_relaxed);
+    spareFunctors(node);
+  }
+  spareFunctors(free_functors_.TakeAll());
+}
+
+IOUringServer *EventLoop::io_uring_server() {
+  return poller_ == kIOUring ? static_cast<IOUringServer *>(epoll_server_.get())
+                             : nullptr;
 }
 
 void EventLoop::Loop() {
   assert(!looping_);
   AssertInLoopThread();
   looping_ = true;
-  quit_ = false;  // FIXME: what if someone calls quit() before loop() ?
   LOG(INFO) << "EventLoop " << this << " start looping";
 
   while (!quit_) {
-    epoll_server_.WaitForEventsAndExecuteCallbacks();
+    epoll_server_->WaitForEventsAndExecuteCallbacks();
     ++iteration_;
+    advanceTimingWheel();
     doPendingFunctors();
+    armTimingWheelAlarm();
+    updateLoadStats();
   }
 
   LOG(INFO) << "EventLoop " << this << " stop looping";
+  // Reset here rather than on entry, so that a Quit() from another thread
+  // before Loop() is not lost.
+  quit_ = false;
   looping_ = false;
 }
 
+void EventLoop::updateLoadStats() {
+  const int stats = load_stats_.load(std::memory_order_relaxed);
+  if (stats & kBusyTime) {
+    // From the end of the wait to now; a clock stepped back counts as idle.
+    const int64_t busy_us =
+        epoll_server_->NowInUsec() - epoll_server_->LoopTimeInUsec();
+    if (busy_us > 0) {
+      // Only this thread writes it.
+      busy_time_in_us_.store(
+          busy_time_in_us_.load(std::memory_order_relaxed) + busy_us,
+          std::memory_order_relaxed);
+    }
+  }
+  if (stats & kLastCPU) {
+    last_cpu_.store(sched_getcpu(), std::memory_order_relaxed);
+  }
+}
+
 void EventLoop::Quit() {
   quit_ = true;
   // There is a chance that loop() just executes while(!quit_) and exits,
   // then EventLoop destructs, then we are accessing an invalid object.
   // Can be fixed using mutex_ in both places.
   if (!IsInLoopThread()) {
-    epoll_server_.Wake();
+    epoll_server_->Wake();
   }
 }
 
@@ -94,19 +234,23 @@ void EventLoop::RunInLoop(Functor cb) {
 }
 
 void EventLoop::QueueInLoop(Functor cb) {
-  {
-    std::lock_guard<std::mutex> guard(mutex_);
-    pending_functors_.push_back(std::move(cb));
-  }
+  PendingFunctor *pending = getFreeFunctor(&free_functors_);
+  pending->functor = std::move(cb);
+  pending->batch = functor_batch_.load(std::memory_order_relaxed);
+  // Pairs with the fence in doPendingFunctors(): either that call finds the
+  // queue not empty, or Wake() sees that the wake-up pending before it has
+  // been consumed, and wakes the loop again. The exchange in Push() orders
+  // the two, so no fence is needed here.
+  pending_functors_.Push(pending);
 
   if (!IsInLoopThread() || calling_pending_functors_) {
-    epoll_server_.Wake();
+    epoll_server_->Wake();
   }
 }
 
 size_t EventLoop::QueueSize() const {
-  std::lock_guard<std::mutex> guard(mutex_);
-  return pending_functors_.size();
+  CHECK(IsInLoopThread()) << "QueueSize() called outside the loop thread";
+  return pending_functors_.Size() + (held_functor_ != nullptr ? 1 : 0);
 }
 
 void EventLoop::abortNotInLoopThread() {
@@ -116,24 +260,119 @@ void EventLoop::abortNotInLoopThread() {
 }
 
 void EventLoop::doPendingFunctors() {
-  std::vector<Functor> functors;
+  // Only run what was queued before this point. Functors queued by the
+  // functors themselves wait for the next iteration, as they did when the
+  // whole queue was swapped out at once.
+  const uint64_t batch = functor_batch_.load(std::memory_order_relaxed) + 1;
+  functor_batch_.store(batch, std::memory_order_relaxed);
   calling_pending_functors_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
 
-  {
-    std::lock_guard<std::mutex> guard(mutex_);
-    functors.swap(pending_functors_);
+  TraceRing *trace_ring = epoll_server_->trace_ring();
+  int64_t start = 0;
+  int num_done = 0;
+  // The nodes run, to be put back on free_functors_ all at once.
+  MPSCQueueNode *done_first = nullptr;
+  MPSCQueueNode *done_last = nullptr;
+  for (;;) {
+    MPSCQueueNode *node = held_functor_;
+    held_functor_ = nullptr;
+    if (node == nullptr) {
+      node = pending_functors_.Pop();
+    }
+    if (node == nullptr) {
+      if (pending_functors_.Empty()) {
+        break;
+      }
+      // A producer is between the two steps of Push(), and its node is
+      // next. It may already have found the wake-up pending, so wait for it.
+      std::this_thread::yield();
+      continue;
+    }
+    PendingFunctor *pending = static_cast<PendingFunctor *>(node);
+    if (pending->batch >= batch) {
+      // Queued since this call began: runs in the next iteration, which
+      // the wake-up makes sure there is.
+      held_functor_ = node;
+      epoll_server_->Wake();
+      break;
+    }
+    if (num_done++ == 0 && trace_ring->enabled()) {
+      start = trace_ring->Now();
+    }
+    pending->functor();
+    // Releases what the functor holds now, not when the node is reused.
+    pending->functor = nullptr;
+    if (done_last == nullptr) {
+      done_first = node;
+    } else {
+      done_last->next.store(node, std::memory_order_relaxed);
+    }
+    done_last = node;
   }
-
-  for (size_t i = 0; i < functors.size(); ++i) {
-    functors[i]();
+  if (done_first != nullptr) {
+    free_functors_.Push(done_first, done_last);
+  }
+  if (start != 0) {
+    trace_ring->Add(TraceRing::kFunctors, start, trace_ring->Now(), -1,
+                    num_done);
   }
   calling_pending_functors_ = false;
 }
 
+void EventLoop::SetHighResolutionTimers(bool on) {
+  AssertInLoopThread();
+  epoll_server_->set_high_resolution_timers(on);
+}
+
+void EventLoop::SetSpinBudget(Duration budget) {
+  AssertInLoopThread();
+  epoll_server_->set_spin_budget_in_us(budget.count());
+}
+
+void EventLoop::SetTSCClock(bool on) {
+  AssertInLoopThread();
+  epoll_server_->set_use_tsc_clock(on);
+}
+
 std::unique_ptr<EpollTimer> EventLoop::CreateTimer(TimerCallback timer_cb) {
-  std::unique_ptr<EpollTimer> epoll_timer(new EpollTimer(&epoll_server_));
+  std::unique_ptr<EpollTimer> epoll_timer(
+      new EpollTimer(epoll_server_.get()));
   epoll_timer->SetTimerCallback(std::move(timer_cb));
   return epoll_timer;
 }
 
+void EventLoop::RunAfterCoarse(Duration delay, CoarseTimer *timer) {
+  AssertInLoopThread();
+  timing_wheel_.Schedule(timer, epoll_server_->LoopTimeInUsec(),
+                         delay.count());
+  // Outside Loop(), such as before it starts, nothing else would arm it.
+  armTimingWheelAlarm();
+}
+
+void EventLoop::advanceTimingWheel() {
+  if (timing_wheel_.size() > 0) {
+    timing_wheel_.Advance(epoll_server_->NowInUsec());
+  }
+}
+
+// Runs at the end of every iteration, after anything that may have touched
+// the wheel, so that the alarm always matches the earliest non-empty slot
+// before the loop goes back to sleep.
+void EventLoop::armTimingWheelAlarm() {
+  const int64_t next_slot_time_in_us = timing_wheel_.NextSlotTimeInUs();
+  if (next_slot_time_in_us < 0) {
+    timing_wheel_alarm_.UnregisterIfRegistered();
+    return;
+  }
+  if (timing_wheel_alarm_.registered()) {
+    if (next_slot_time_in_us != timing_wheel_alarm_time_in_us_) {
+      timing_wheel_alarm_.RescheduleIfRegistered(next_slot_time_in_us);
+    }
+  } else {
+    epoll_server_->RegisterAlarm(next_slot_time_in_us, &timing_wheel_alarm_);
+  }
+  timing_wheel_alarm_time_in_us_ = next_slot_time_in_us;
+}
+
 }  // namespace raner
@@ -8,6 +8,7 @@
 #include <any>
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -15,10 +16,14 @@
 #include "raner/callbacks.h"
 #include "raner/epoll_server.h"
 #include "raner/epoll_timer.h"
+#include "raner/mpsc_queue.h"
+#include "raner/task.h"
+#include "raner/timing_wheel.h"
 
 namespace raner {
 
 class EpollServer;
+class IOUringServer;
 
 ///
 /// Reactor, at most one per thread.
@@ -26,11 +31,53 @@ class EpollServer;
 /// This is an interface class, so don't expose too much details.
 class EventLoop {
  public:
-  typedef std::function<void()> Functor;
-
-  EventLoop();
+  // Move-only, and stores small callables (such as a std::bind of a member
+  // function and a shared_ptr) without allocating.
+  typedef Task Functor;
+
+  /// How the loop waits for fd events.
+  enum Poller {
+    /// epoll_wait(), and an epoll_ctl() for every net change of event mask
+    /// between two waits.
+    kEpoll,
+    /// io_uring, which batches event mask changes into the wait, and has
+    /// the ring itself receive and accept for the connections and servers
+    /// of the loop. Falls back to kEpoll if the kernel does not support it;
+    /// see IOUringServer.
+    kIOUring,
+  };
+
+  explicit EventLoop(Poller poller = kEpoll);
   ~EventLoop();
 
+  /// The poller actually in use, which may differ from the one asked for.
+  Poller poller() const { return poller_; }
+
+  /// Lets timers fire within microseconds of their deadline instead of up
+  /// to a millisecond late; see EpollServer::set_high_resolution_timers().
+  /// Must be called in the loop thread.
+  void SetHighResolutionTimers(bool on);
+
+  /// Busy-polls for up to 'budget' before each blocking wait, trading a
+  /// core for the scheduler wake-up latency; see
+  /// EpollServer::set_spin_budget_in_us(), which also counts how many polls
+  /// paid off. Zero turns it off. Must be called in the loop thread.
+  void SetSpinBudget(Duration budget);
+
+  /// Reads the clock of the loop with rdtsc instead of the system clock;
+  /// see EpollServer::set_use_tsc_clock(). Must be called in the loop
+  /// thread.
+  void SetTSCClock(bool on);
+
+  /// The time at which the current iteration woke up, which is cached, so
+  /// reading it costs no clock read. Meant for timestamping messages and
+  /// re-arming timeouts from callbacks and functors, which all see the same
+  /// loop time; see EpollServer::LoopTimeInUsec(). Must be called in the
+  /// loop thread.
+  Time LoopTime() const {
+    return Time::UnixEpoch() + Duration(epoll_server_->LoopTimeInUsec());
+  }
+
   ///
   /// Loops forever.
   ///
@@ -46,6 +93,41 @@ class EventLoop {
 
   int64_t iteration() const { return iteration_; }
 
+  /// Number of TCPConnections on this loop, counted from their creation,
+  /// which may be in another thread, until they are disconnected.
+  /// Safe to call from other threads.
+  int NumConnections() const {
+    return num_connections_.load(std::memory_order_relaxed);
+  }
+  /// The load statistics below which a loop only keeps once asked to,
+  /// since each costs a clock read or a sched_getcpu() per iteration.
+  enum LoadStat {
+    kBusyTime = 1 << 0,
+    kLastCPU = 1 << 1,
+  };
+  /// Starts keeping 'stats', a mask of LoadStat, on top of those kept
+  /// already. EventLoopThreadPool::Start() enables those its placement
+  /// policy reads. Safe to call from other threads.
+  void EnableLoadStats(int stats) {
+    load_stats_.fetch_or(stats, std::memory_order_relaxed);
+  }
+  /// Total time the loop has spent running callbacks, alarms and functors,
+  /// as opposed to waiting for them, since kBusyTime was enabled; the
+  /// difference between two reads over the time between them is how busy
+  /// the loop was. Safe to call from other threads.
+  int64_t BusyTimeInUs() const {
+    return busy_time_in_us_.load(std::memory_order_relaxed);
+  }
+  /// The CPU the loop thread was on at the end of its last iteration, or -1
+  /// before the first with kLastCPU enabled. Safe to call from other
+  /// threads.
+  int LastCPU() const { return last_cpu_.load(std::memory_order_relaxed); }
+
+  /// Internal use only, by TCPConnection.
+  void AddConnections(int delta) {
+    num_connections_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
   /// Runs callback immediately in the loop thread.
   /// It wakes up the loop, and run the cb.
   /// If in the same loop thread, cb is run within the function.
@@ -53,11 +135,24 @@ class EventLoop {
   void RunInLoop(Functor cb);
   /// Queues callback in the loop thread.
   /// Runs after finish pooling.
-  /// Safe to call from other threads.
+  /// Safe to call from other threads, and never blocks: callbacks queued
+  /// from one thread run in the order they were queued.
+  /// The queue keeps its nodes for reuse, and grows their number
+  /// geometrically, so that queueing a callback which Task keeps inline
+  /// practically never allocates.
   void QueueInLoop(Functor cb);
 
+  /// Number of queued callbacks which have not run yet. Walks the queue,
+  /// and must be called in the loop thread.
   size_t QueueSize() const;
 
+  /// Number of wake-ups from QueueInLoop() or Quit() that did not need a
+  /// syscall because the loop was already due to wake up.
+  /// Safe to call from other threads.
+  int64_t NumWakeupsCoalesced() const {
+    return epoll_server_->NumWakesCoalesced();
+  }
+
   // pid_t threadId() const { return thread_id_; }
   void AssertInLoopThread() {
     if (!IsInLoopThread()) {
@@ -74,15 +169,33 @@ class EventLoop {
 
   std::any *GetMutableContext() { return &context_; }
 
-  EpollServer *epoll_server() { return &epoll_server_; }
+  EpollServer *epoll_server() { return epoll_server_.get(); }
+  /// The same as epoll_server() with kIOUring, or nullptr.
+  IOUringServer *io_uring_server();
 
   std::unique_ptr<EpollTimer> CreateTimer(TimerCallback timer_cb);
 
+  /// Runs timer's callback once, roughly delay from now.
+  ///
+  /// Meant for large numbers of timeouts (idle connections, request
+  /// deadlines) which tolerate kCoarseTimerTickUs of lateness: the timer is
+  /// kept on a timing wheel advanced once per loop iteration, instead of in
+  /// the exact alarm heap of the EpollServer. Scheduling a timer that is
+  /// already scheduled moves it; use CoarseTimer::Cancel() to cancel.
+  /// Neither allocates. Must be called in the loop thread.
+  void RunAfterCoarse(Duration delay, CoarseTimer *timer);
+
+  /// Precision of RunAfterCoarse().
+  static constexpr int64_t kCoarseTimerTickUs = 100 * 1000;
+
   static EventLoop *GetEventLoopOfCurrentThread();
 
  private:
   void abortNotInLoopThread();
   void doPendingFunctors();
+  void advanceTimingWheel();
+  void armTimingWheelAlarm();
+  void updateLoadStats();
 
   bool looping_; /* atomic */
   std::atomic<bool> quit_;
@@ -90,11 +203,31 @@ class EventLoop {
   bool callingPendingFunctors_; /* atomic */
   int64_t iteration_;
   const std::thread::id thread_id_;
-  EpollServer epoll_server_;
+  Poller poller_;
+  std::unique_ptr<EpollServer> epoll_server_;
   std::any context_;
 
-  mutable std::mutex mutex_;
-  std::vector<Functor> pending_functors_;  // @GuardedBy mutex_
+  TimingWheel timing_wheel_;
+  // Wakes the loop up when the earliest non-empty slot of timing_wheel_ is
+  // due; the wheel itself is advanced by Loop().
+  EpollAlarm timing_wheel_alarm_;
+  int64_t timing_wheel_alarm_time_in_us_;
+
+  MPSCQueue pending_functors_;
+  // Bumped by each doPendingFunctors(), which leaves the functors queued
+  // since it began to the next one: the first it pops is held_functor_.
+  std::atomic<uint64_t> functor_batch_;
+  MPSCQueueNode *held_functor_;
+  // The nodes of the functors run, for QueueInLoop() to reuse.
+  MPSCNodeStack free_functors_;
+
+  // Load statistics, written by the loop thread and read by placement
+  // policies in other threads.
+  std::atomic<int> num_connections_;
+  // A mask of LoadStat.
+  std::atomic<int> load_stats_;
+  std::atomic<int64_t> busy_time_in_us_;
+  std::atomic<int> last_cpu_;
 
   DISALLOW_COPY_AND_ASSIGN(EventLoop);
 };
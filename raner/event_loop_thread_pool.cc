@@ -18,7 +18,8 @@ EventLoopThreadPool::EventLoopThreadPool(EventLoop* base_loop,
       name_(name_arg),
       started_(false),
       num_threads_(0),
-      next_(0) {}
+      next_(0),
+      policy_(new RoundRobinPlacement()) {}
 
 EventLoopThreadPool::~EventLoopThreadPool() {
   // Don't delete loop, it's stack variable
@@ -36,6 +37,7 @@ void EventLoopThreadPool::Start(const ThreadInitCallback& cb) {
     EventLoopThread* t = new EventLoopThread(cb, buf);
     threads_.push_back(std::unique_ptr<EventLoopThread>(t));
     loops_.push_back(t->StartLoop());
+    loops_.back()->EnableLoadStats(policy_->LoadStats());
   }
   if (num_threads_ == 0 && cb) {
     cb(base_loop_);
@@ -58,6 +60,18 @@ EventLoop* EventLoopThreadPool::GetNextLoop() {
   return loop;
 }
 
+EventLoop* EventLoopThreadPool::GetLoopForConnection(int fd) {
+  base_loop_->AssertInLoopThread();
+  assert(started_);
+  if (loops_.empty()) {
+    return base_loop_;
+  }
+  if (loops_.size() == 1) {
+    return loops_[0];
+  }
+  return policy_->Pick(loops_, fd);
+}
+
 EventLoop* EventLoopThreadPool::GetLoopForHash(size_t hashCode) {
   base_loop_->AssertInLoopThread();
   EventLoop* loop = base_loop_;
@@ -78,4 +92,17 @@ std::vector<EventLoop*> EventLoopThreadPool::GetAllLoops() {
   }
 }
 
+std::vector<EventLoopThreadPool::LoopStats> EventLoopThreadPool::GetLoopStats()
+    const {
+  assert(started_);
+  const std::vector<EventLoop*> loops =
+      loops_.empty() ? std::vector<EventLoop*>(1, base_loop_) : loops_;
+  std::vector<LoopStats> stats;
+  for (EventLoop* loop : loops) {
+    stats.push_back(LoopStats{loop, loop->NumConnections(),
+                              loop->BusyTimeInUs(), loop->LastCPU()});
+  }
+  return stats;
+}
+
 }  // namespace raner
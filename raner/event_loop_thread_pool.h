@@ -5,11 +5,14 @@
 #ifndef RANER_NET_EVENT_LOOP_THREAD_POOL_H_
 #define RANER_NET_EVENT_LOOP_THREAD_POOL_H_
 
+#include <stdint.h>
+
 #include <functional>
 #include <memory>
 #include <string_view>
 #include <vector>
 
+#include "raner/loop_placement.h"
 #include "raner/macros.h"
 
 namespace raner {
@@ -24,18 +27,43 @@ class EventLoopThreadPool {
   EventLoopThreadPool(EventLoop *base_loop, std::string_view name_arg);
   ~EventLoopThreadPool();
 
+  /// Load statistics of one loop, see GetLoopStats().
+  struct LoopStats {
+    EventLoop *loop;
+    int num_connections;
+    int64_t busy_time_in_us;
+    int last_cpu;
+  };
+
   void SetThreadNum(int num_threads) { num_threads_ = num_threads; }
   void Start(const ThreadInitCallback &cb = ThreadInitCallback());
 
+  /// Sets how GetLoopForConnection() picks loops; RoundRobinPlacement by
+  /// default. Must be called before @c start
+  void SetPlacementPolicy(std::unique_ptr<LoopPlacementPolicy> policy) {
+    policy_ = std::move(policy);
+  }
+
   // valid after calling start()
   /// round-robin
   EventLoop *GetNextLoop();
 
+  /// The loop, picked by the placement policy, for the new connection on
+  /// socket 'fd'. Must be called in the base loop thread.
+  EventLoop *GetLoopForConnection(int fd);
+
   /// with the same hash code, it will always return the same EventLoop
   EventLoop *GetLoopForHash(size_t hash_code);
 
   std::vector<EventLoop *> GetAllLoops();
 
+  /// A snapshot of the load of every loop, to check how balanced they are;
+  /// busy_time_in_us grows by how long the loop was busy between two calls.
+  /// Only the statistics the placement policy reads are kept, unless
+  /// enabled with EventLoop::EnableLoadStats().
+  /// Valid after calling start(), and thread safe then.
+  std::vector<LoopStats> GetLoopStats() const;
+
   bool Started() const { return started_; }
 
   const std::string &Name() const { return name_; }
@@ -48,6 +76,7 @@ class EventLoopThreadPool {
   int next_;
   std::vector<std::unique_ptr<EventLoopThread>> threads_;
   std::vector<EventLoop *> loops_;
+  std::unique_ptr<LoopPlacementPolicy> policy_;
 
   DISALLOW_COPY_AND_ASSIGN(EventLoopThreadPool);
 };
@@ -0,0 +1,973 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/io_uring_server.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>  // IOV_MAX
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include "raner/byte_buffer.h"
+#include "raner/output_queue.h"
+#include "raner/safe_strerror.h"
+
+namespace raner {
+
+namespace {
+
+const unsigned kSubmissionQueueEntries = 1024;
+const unsigned kCompletionQueueEntries = 4 * kSubmissionQueueEntries;
+
+// The buffers provided for multishot recvs: a recv completes with at most
+// one of them, and a socket holds those it got until they are taken.
+const unsigned kNumBuffers = 256;
+const unsigned kBufferSize = 16 * 1024;
+const uint16_t kBufferGroup = 0;
+
+// The user_data of a request is its fd, a generation, and the kind of the
+// request in the two high bits.
+const uint32_t kGenerationMask = (1U << 29) - 1;
+
+// Set in the user_data of a request removing another, along with the
+// user_data of the latter.
+const uint64_t kRemovalBit = 1ULL << 61;
+
+// Bits of an epoll event mask which mean something to epoll_ctl only.
+const int kEpollOnlyFlags = EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE;
+
+// Linux 5.13 added both multishot poll and IORING_FEAT_RSRC_TAGS, and no
+// feature bit of its own for the former.
+const unsigned kRequiredFeatures =
+    IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+
+int SetupRing(unsigned entries, struct io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int RegisterRing(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+uint64_t UserDataOf(int fd, uint32_t generation, unsigned kind) {
+  return (static_cast<uint64_t>(kind) << 62) |
+         (static_cast<uint64_t>(generation & kGenerationMask) << 32) |
+         static_cast<uint32_t>(fd);
+}
+
+template <typename T>
+T LoadAcquire(const T *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+void StoreRelease(T *p, T value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+}  // namespace
+
+IOUringServer::IOUringServer()
+    : ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      sqes_(nullptr),
+      sqes_size_(0),
+      sq_head_(nullptr),
+      sq_tail_(nullptr),
+      sq_mask_(0),
+      sq_entries_(0),
+      sq_array_(nullptr),
+      cq_head_(nullptr),
+      cq_tail_(nullptr),
+      cq_mask_(0),
+      cqes_(nullptr),
+      buf_ring_(nullptr),
+      buffers_(nullptr),
+      buf_ring_tail_(0),
+      multishot_recv_supported_(false),
+      multishot_accept_supported_(true),
+      sqe_tail_(0),
+      num_waits_(0),
+      num_enters_(0),
+      num_submitted_(0),
+      num_transfers_(0) {
+  CHECK(SetupRings(kSubmissionQueueEntries))
+      << "io_uring is not usable, check IOUringServer::IsSupported() first";
+  multishot_recv_supported_ = SetupBufferRing();
+  // The EpollServer constructor has registered the wake-up eventfd through
+  // its own AddFD(), as virtual calls do not reach this class from there.
+  for (CBAndEventMask *cb_and_mask = cb_map_.Next(-1); cb_and_mask != NULL;
+       cb_and_mask = cb_map_.Next(cb_and_mask->fd)) {
+    AddFD(cb_and_mask->fd, cb_and_mask->event_mask);
+  }
+}
+
+IOUringServer::~IOUringServer() {
+  for (FDState &state : fd_states_) {
+    DropCompletions(&state);
+  }
+  UnmapRings();
+  if (ring_fd_ >= 0) {
+    // Ends the requests in flight, before their buffers go.
+    close(ring_fd_);
+  }
+  UnmapBufferRing();
+}
+
+// static
+bool IOUringServer::IsSupported() {
+  static const bool supported = [] {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = SetupRing(2, &params);
+    if (fd < 0) {
+      LOG(INFO) << "io_uring_setup failed: " << safe_strerror(errno);
+      return false;
+    }
+    close(fd);
+    if ((params.features & kRequiredFeatures) != kRequiredFeatures) {
+      LOG(INFO) << "io_uring lacks features, has 0x" << std::hex
+                << params.features;
+      return false;
+    }
+    return true;
+  }();
+  return supported;
+}
+
+bool IOUringServer::SetupRings(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kCompletionQueueEntries;
+  ring_fd_ = SetupRing(entries, &params);
+  if (ring_fd_ < 0) {
+    LOG(ERROR) << "io_uring_setup failed: " << safe_strerror(errno);
+    return false;
+  }
+  if ((params.features & kRequiredFeatures) != kRequiredFeatures) {
+    LOG(ERROR) << "io_uring lacks features, has 0x" << std::hex
+               << params.features;
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = sq_ring_size_;
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    LOG(ERROR) << "mmap of the submission ring failed: "
+               << safe_strerror(errno);
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      LOG(ERROR) << "mmap of the completion ring failed: "
+                 << safe_strerror(errno);
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    LOG(ERROR) << "mmap of the submission entries failed: "
+               << safe_strerror(errno);
+    return false;
+  }
+  sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+  char *sq = static_cast<char *>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  char *cq = static_cast<char *>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  sqe_tail_ = *sq_tail_;
+  return true;
+}
+
+void IOUringServer::UnmapRings() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = MAP_FAILED;
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = MAP_FAILED;
+  }
+}
+
+bool IOUringServer::SetupBufferRing() {
+  const size_t ring_size = kNumBuffers * sizeof(struct io_uring_buf);
+  void *ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    LOG(ERROR) << "mmap of the buffer ring failed: " << safe_strerror(errno);
+    return false;
+  }
+  // Only touched as the kernel fills the buffers.
+  void *buffers =
+      mmap(nullptr, static_cast<size_t>(kNumBuffers) * kBufferSize,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    LOG(ERROR) << "mmap of the buffers failed: " << safe_strerror(errno);
+    munmap(ring, ring_size);
+    return false;
+  }
+  buf_ring_ = static_cast<struct io_uring_buf_ring *>(ring);
+  buffers_ = static_cast<char *>(buffers);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+  reg.ring_entries = kNumBuffers;
+  reg.bgid = kBufferGroup;
+  if (RegisterRing(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    LOG(INFO) << "io_uring has no provided buffer rings, multishot recv "
+                 "is off: "
+              << safe_strerror(errno);
+    UnmapBufferRing();
+    return false;
+  }
+  for (unsigned i = 0; i < kNumBuffers; ++i) {
+    ProvideBuffer(static_cast<uint16_t>(i));
+  }
+  PublishBuffers();
+  return true;
+}
+
+void IOUringServer::UnmapBufferRing() {
+  if (buf_ring_ != nullptr) {
+    munmap(buf_ring_, kNumBuffers * sizeof(struct io_uring_buf));
+    buf_ring_ = nullptr;
+  }
+  if (buffers_ != nullptr) {
+    munmap(buffers_, static_cast<size_t>(kNumBuffers) * kBufferSize);
+    buffers_ = nullptr;
+  }
+}
+
+IOUringServer::FDState *IOUringServer::StateOf(int fd) const {
+  const size_t index = static_cast<size_t>(fd);
+  return index < fd_states_.size() ? &fd_states_[index] : nullptr;
+}
+
+void IOUringServer::DelFD(int fd) const {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || !state->registered) {
+    LOG(FATAL) << "io_uring removal of unregistered fd " << fd;
+  }
+  if (state->armed) {
+    QueuePollRemove(fd, *state);
+  }
+  if (state->transfer_armed && !state->transfer_cancelled) {
+    QueueRemoval(UserDataOf(fd, state->registration, state->transfer));
+  }
+  if (state->send != nullptr) {
+    if (state->send_completed) {
+      free_sends_.push_back(std::move(state->send));
+    } else {
+      // Kept, with what it sends, until its completion comes.
+      QueueRemoval(state->send->user_data);
+      orphaned_sends_.push_back(std::move(state->send));
+    }
+    state->send_completed = false;
+  }
+  DropCompletions(state);
+  PublishBuffers();
+  // Drops any completion of the old requests which is already on its way.
+  ++state->generation;
+  ++state->registration;
+  state->event_mask = 0;
+  state->registered = false;
+  state->armed = false;
+  state->transfer = kNoTransfer;
+  state->transfer_armed = false;
+  state->transfer_cancelled = false;
+  state->transfer_ended = false;
+  state->fresh = false;
+}
+
+void IOUringServer::AddFD(int fd, int event_mask) const {
+  CHECK_GE(fd, 0);
+  if (static_cast<size_t>(fd) >= fd_states_.size()) {
+    fd_states_.resize(static_cast<size_t>(fd) + 1);
+  }
+  FDState *state = &fd_states_[static_cast<size_t>(fd)];
+  if (state->registered) {
+    LOG(FATAL) << "io_uring insertion of registered fd " << fd;
+  }
+  ++state->generation;
+  state->event_mask = event_mask;
+  state->registered = true;
+  QueuePollAdd(fd, state);
+}
+
+void IOUringServer::ModFD(int fd, int event_mask) const {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || !state->registered) {
+    LOG(FATAL) << "io_uring modification of unregistered fd " << fd;
+  }
+  VLOG(3) << "modifying fd= " << fd << " " << EventMaskToString(event_mask);
+  // As with epoll_ctl(), modifying an EPOLLET fd, even to the same mask,
+  // reports the readiness it has.
+  const bool rearm = (event_mask & EPOLLET) != 0;
+  if (state->event_mask == event_mask && !rearm) {
+    return;
+  }
+  const int old_poll_mask = PollMaskOf(*state);
+  const bool was_reading = (state->event_mask & EPOLLIN) != 0;
+  state->event_mask = event_mask;
+  UpdatePoll(fd, state, old_poll_mask, rearm);
+  if (state->transfer == kNoTransfer) {
+    return;
+  }
+  UpdateTransfer(fd, state);
+  if ((event_mask & EPOLLIN) && (rearm || !was_reading) &&
+      HasInput(*state)) {
+    state->fresh = true;
+  }
+}
+
+int IOUringServer::PollMaskOf(const FDState &state) {
+  int poll_mask = state.event_mask;
+  if (state.transfer != kNoTransfer) {
+    poll_mask &= ~EPOLLIN;
+  }
+  // The completion of the send stands for it. An edge-triggered socket
+  // keeps its multishot poll, whose edges only come when it has room.
+  if (state.send != nullptr && !(state.event_mask & EPOLLET)) {
+    poll_mask &= ~EPOLLOUT;
+  }
+  return poll_mask;
+}
+
+void IOUringServer::UpdatePoll(int fd, FDState *state, int old_poll_mask,
+                               bool rearm) const {
+  if (!state->armed) {
+    // Re-armed with the new mask before the next wait.
+    return;
+  }
+  if (PollMaskOf(*state) == old_poll_mask && !rearm) {
+    return;
+  }
+  QueuePollRemove(fd, *state);
+  ++state->generation;
+  QueuePollAdd(fd, state);
+}
+
+void IOUringServer::UpdateTransfer(int fd, FDState *state) const {
+  const bool wanted = state->registered && state->transfer != kNoTransfer &&
+                      !state->transfer_ended &&
+                      (state->event_mask & EPOLLIN) != 0;
+  if (wanted && !state->transfer_armed) {
+    struct io_uring_sqe *sqe = GetSQE();
+    sqe->fd = fd;
+    if (state->transfer == kRecv) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = kBufferGroup;
+    } else {
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    sqe->user_data = UserDataOf(fd, state->registration, state->transfer);
+    state->transfer_armed = true;
+  } else if (!wanted && state->transfer_armed &&
+             !state->transfer_cancelled) {
+    QueueRemoval(UserDataOf(fd, state->registration, state->transfer));
+    state->transfer_cancelled = true;
+    if (state->transfer == kRecv) {
+      ParkInput(state);
+    }
+  }
+}
+
+bool IOUringServer::SetMultishotRecv(int fd) {
+  if (!multishot_recv_supported_) {
+    return false;
+  }
+  SetTransfer(fd, kRecv);
+  return true;
+}
+
+bool IOUringServer::SetMultishotAccept(int fd) {
+  if (!multishot_accept_supported_) {
+    return false;
+  }
+  SetTransfer(fd, kAccept);
+  return true;
+}
+
+void IOUringServer::SetTransfer(int fd, Transfer transfer) {
+  FDState *state = StateOf(fd);
+  CHECK(state != nullptr && state->registered)
+      << "io_uring transfer of unregistered fd " << fd;
+  if (state->transfer != kNoTransfer) {
+    return;
+  }
+  const int old_poll_mask = PollMaskOf(*state);
+  state->transfer = transfer;
+  state->transfer_ended = false;
+  UpdatePoll(fd, state, old_poll_mask, false);
+  UpdateTransfer(fd, state);
+}
+
+void IOUringServer::EndTransfer(int fd, FDState *state) {
+  const int old_poll_mask = PollMaskOf(*state);
+  state->transfer = kNoTransfer;
+  state->transfer_ended = false;
+  UpdatePoll(fd, state, old_poll_mask, false);
+}
+
+ssize_t IOUringServer::Receive(int fd, ByteBuffer *buf, int *saved_errno) {
+  Reclaim(fd, buf);
+  FDState *state = StateOf(fd);
+  if (state == nullptr || state->transfer != kRecv) {
+    return buf->ReadFD(fd, saved_errno);
+  }
+  if (buf->ReadableBytes() == 0 && state->parked.ReadableBytes() == 0 &&
+      state->completions.size() == 1) {
+    // The whole input, which the caller reads in place.
+    const Completion &completion = state->completions.front();
+    const size_t len = static_cast<size_t>(completion.res);
+    buf->Borrow(BufferOf(completion.buffer_id), len);
+    state->lent = true;
+    state->lent_buffer_id = completion.buffer_id;
+    state->completions.pop_front();
+    if (state->transfer_ended) {
+      state->fresh = true;
+    }
+    return static_cast<ssize_t>(len);
+  }
+  // No more than ReadFD() would read: a level-triggered callback gets the
+  // rest with the next wait, and an edge-triggered one reads on, so that
+  // pausing it takes effect as it would with read().
+  const size_t max_bytes = buf->MaxReadFDBytes();
+  size_t n = std::min(state->parked.ReadableBytes(), max_bytes);
+  if (n > 0) {
+    buf->Write(state->parked.BeginRead(), n);
+    state->parked.SkipReadBytes(n);
+  }
+  while (!state->completions.empty() && n < max_bytes) {
+    const Completion &completion = state->completions.front();
+    const size_t len = static_cast<size_t>(completion.res);
+    buf->Write(BufferOf(completion.buffer_id), len);
+    ProvideBuffer(completion.buffer_id);
+    state->completions.pop_front();
+    n += len;
+  }
+  PublishBuffers();
+  if (n > 0) {
+    // An edge-triggered caller takes a short read for a drained socket, so
+    // report the end of the stream, or the error, on its own, and what is
+    // left of the input again.
+    if (HasInput(*state)) {
+      state->fresh = true;
+    }
+    return static_cast<ssize_t>(n);
+  }
+  if (state->transfer_ended) {
+    // The socket has the end of the stream, or the error, for read() too.
+    EndTransfer(fd, state);
+    return buf->ReadFD(fd, saved_errno);
+  }
+  *saved_errno = EAGAIN;
+  return -1;
+}
+
+void IOUringServer::Reclaim(int fd, ByteBuffer *buf) {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || !state->lent) {
+    return;
+  }
+  buf->CopyBorrowed();
+  state->lent = false;
+  ProvideBuffer(state->lent_buffer_id);
+  PublishBuffers();
+}
+
+bool IOUringServer::Send(int fd, const OutputQueue &queue) {
+  FDState *state = StateOf(fd);
+  CHECK(state != nullptr && state->registered)
+      << "io_uring send of unregistered fd " << fd;
+  if (state->send != nullptr) {
+    return false;
+  }
+  std::unique_ptr<SendRequest> send;
+  if (free_sends_.empty()) {
+    send.reset(new SendRequest);
+  } else {
+    send = std::move(free_sends_.back());
+    free_sends_.pop_back();
+  }
+  send->iov.resize(std::min<size_t>(queue.NumChunks(), IOV_MAX));
+  size_t bytes = 0;
+  const size_t iovcnt =
+      queue.Gather(send->iov.data(), send->iov.size(), &bytes, &send->owners);
+  if (iovcnt == 0 || (queue.zerocopy_threshold() > 0 &&
+                      bytes >= queue.zerocopy_threshold())) {
+    send->owners.clear();
+    free_sends_.push_back(std::move(send));
+    return false;
+  }
+  send->user_data = UserDataOf(fd, state->registration, kSend);
+  struct io_uring_sqe *sqe = GetSQE();
+  sqe->fd = fd;
+  if (iovcnt == 1) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = reinterpret_cast<uint64_t>(send->iov[0].iov_base);
+    sqe->len = static_cast<uint32_t>(send->iov[0].iov_len);
+  } else {
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov.data();
+    send->msg.msg_iovlen = iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = reinterpret_cast<uint64_t>(&send->msg);
+    sqe->len = 1;
+  }
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = send->user_data;
+  const int old_poll_mask = PollMaskOf(*state);
+  state->send = std::move(send);
+  state->send_completed = false;
+  UpdatePoll(fd, state, old_poll_mask, false);
+  return true;
+}
+
+bool IOUringServer::IsSending(int fd) const {
+  const FDState *state = StateOf(fd);
+  return state != nullptr && state->send != nullptr;
+}
+
+ssize_t IOUringServer::TakeSent(int fd, int *saved_errno) {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || state->send == nullptr || !state->send_completed) {
+    *saved_errno = EAGAIN;
+    return -1;
+  }
+  const int old_poll_mask = PollMaskOf(*state);
+  free_sends_.push_back(std::move(state->send));
+  state->send_completed = false;
+  UpdatePoll(fd, state, old_poll_mask, false);
+  if (state->send_res < 0) {
+    *saved_errno = -state->send_res;
+    return -1;
+  }
+  return state->send_res;
+}
+
+int IOUringServer::Accept(int fd) {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || state->transfer != kAccept) {
+    int ret;
+    do {
+      ret = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+  }
+  if (state->completions.empty()) {
+    if (state->transfer_ended) {
+      EndTransfer(fd, state);
+      return Accept(fd);
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+  const int res = state->completions.front().res;
+  state->completions.pop_front();
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+void IOUringServer::ParkInput(FDState *state) const {
+  for (const Completion &completion : state->completions) {
+    state->parked.Write(BufferOf(completion.buffer_id),
+                        static_cast<size_t>(completion.res));
+    ProvideBuffer(completion.buffer_id);
+  }
+  state->completions.clear();
+  PublishBuffers();
+}
+
+void IOUringServer::DropCompletions(FDState *state) const {
+  for (const Completion &completion : state->completions) {
+    if (state->transfer == kRecv) {
+      ProvideBuffer(completion.buffer_id);
+    } else if (completion.res >= 0) {
+      close(completion.res);
+    }
+  }
+  state->completions.clear();
+  state->parked.SkipAll();
+}
+
+bool IOUringServer::HasInput(const FDState &state) const {
+  return !state.completions.empty() || state.parked.ReadableBytes() > 0 ||
+         state.transfer_ended;
+}
+
+bool IOUringServer::IsInputReportable(const FDState &state) const {
+  return state.registered && state.transfer != kNoTransfer &&
+         (state.event_mask & EPOLLIN) && HasInput(state) &&
+         (state.fresh || !(state.event_mask & EPOLLET));
+}
+
+void IOUringServer::ProvideBuffer(uint16_t buffer_id) const {
+  // Not buf_ring_->bufs, which C++ puts past the empty struct that
+  // __DECLARE_FLEX_ARRAY() declares before it, rather than at offset 0.
+  struct io_uring_buf *buf =
+      reinterpret_cast<struct io_uring_buf *>(buf_ring_) +
+      (buf_ring_tail_ & (kNumBuffers - 1));
+  buf->addr = reinterpret_cast<uint64_t>(buffers_ +
+                                         static_cast<size_t>(buffer_id) *
+                                             kBufferSize);
+  buf->len = kBufferSize;
+  buf->bid = buffer_id;
+  ++buf_ring_tail_;
+}
+
+void IOUringServer::PublishBuffers() const {
+  if (buf_ring_ != nullptr) {
+    StoreRelease(&buf_ring_->tail, buf_ring_tail_);
+  }
+}
+
+const char *IOUringServer::BufferOf(uint16_t buffer_id) const {
+  return buffers_ + static_cast<size_t>(buffer_id) * kBufferSize;
+}
+
+void IOUringServer::Recycle(const struct io_uring_cqe &cqe) const {
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    ProvideBuffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+  }
+}
+
+void IOUringServer::HandleTransfer(int fd, Transfer kind,
+                                   uint32_t registration,
+                                   const struct io_uring_cqe &cqe) {
+  FDState *state = StateOf(fd);
+  if (state == nullptr || !state->registered || state->transfer != kind ||
+      (state->registration & kGenerationMask) != registration) {
+    // Of an earlier registration of the fd number.
+    if (kind == kRecv) {
+      Recycle(cqe);
+    } else if (cqe.res >= 0) {
+      close(cqe.res);
+    }
+    return;
+  }
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    // Re-armed before the next wait if EPOLLIN is still wanted.
+    state->transfer_armed = false;
+    state->transfer_cancelled = false;
+    disarmed_fds_.push_back(fd);
+  }
+  const int res = cqe.res;
+  if (res == -ECANCELED) {
+    return;
+  }
+  if (kind == kRecv) {
+    if (res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+      Completion completion;
+      completion.res = res;
+      completion.buffer_id =
+          static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      state->completions.push_back(completion);
+      if (state->transfer_cancelled) {
+        ParkInput(state);
+      }
+      ++num_transfers_;
+    } else if (res == -ENOBUFS) {
+      // The ring ran dry; re-armed once taken buffers come back.
+      Recycle(cqe);
+      return;
+    } else {
+      Recycle(cqe);
+      if (res == -EINVAL) {
+        LOG(INFO) << "io_uring has no multishot recv, polling instead";
+        multishot_recv_supported_ = false;
+      }
+      state->transfer_ended = true;
+    }
+  } else if (res == -EINVAL) {
+    LOG(INFO) << "io_uring has no multishot accept, polling instead";
+    multishot_accept_supported_ = false;
+    state->transfer_ended = true;
+  } else {
+    Completion completion;
+    completion.res = res;
+    completion.buffer_id = 0;
+    state->completions.push_back(completion);
+    if (res >= 0) {
+      ++num_transfers_;
+    }
+  }
+  state->fresh = true;
+  if (!state->listed) {
+    state->listed = true;
+    transfer_fds_.push_back(fd);
+  }
+}
+
+void IOUringServer::HandleSend(int fd, const struct io_uring_cqe &cqe,
+                                struct epoll_event *events,
+                                int *num_events) {
+  FDState *state = StateOf(fd);
+  if (state != nullptr && state->send != nullptr && !state->send_completed &&
+      state->send->user_data == cqe.user_data) {
+    state->send_completed = true;
+    state->send_res = cqe.res;
+    state->send->owners.clear();
+    AddEvent(events, num_events, fd, state, EPOLLOUT);
+    return;
+  }
+  for (size_t i = 0; i < orphaned_sends_.size(); ++i) {
+    if (orphaned_sends_[i]->user_data == cqe.user_data) {
+      orphaned_sends_[i]->owners.clear();
+      free_sends_.push_back(std::move(orphaned_sends_[i]));
+      orphaned_sends_[i] = std::move(orphaned_sends_.back());
+      orphaned_sends_.pop_back();
+      return;
+    }
+  }
+}
+
+void IOUringServer::AddEvent(struct epoll_event *events, int *num_events,
+                             int fd, FDState *state, uint32_t event_mask) {
+  if (state->wait_index == num_waits_) {
+    // HandleEvent() takes one event per fd.
+    events[state->event_index].events |= event_mask;
+    return;
+  }
+  state->wait_index = num_waits_;
+  state->event_index = *num_events;
+  events[*num_events].events = event_mask;
+  events[*num_events].data.fd = fd;
+  ++*num_events;
+}
+
+void IOUringServer::QueuePollAdd(int fd, FDState *state) const {
+  uint32_t poll_mask = static_cast<uint32_t>(
+      (PollMaskOf(*state) & ~kEpollOnlyFlags) | EPOLLERR | EPOLLHUP);
+#if __BYTE_ORDER == __BIG_ENDIAN
+  // The kernel reads poll32_events as two swapped 16-bit halves.
+  poll_mask = (poll_mask << 16) | (poll_mask >> 16);
+#endif
+  struct io_uring_sqe *sqe = GetSQE();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = poll_mask;
+  sqe->len = (state->event_mask & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = UserDataOf(fd, state->generation, kNoTransfer);
+  state->armed = true;
+}
+
+void IOUringServer::QueuePollRemove(int fd, const FDState &state) const {
+  QueueRemoval(UserDataOf(fd, state.generation, kNoTransfer));
+}
+
+void IOUringServer::QueueRemoval(uint64_t user_data) const {
+  struct io_uring_sqe *sqe = GetSQE();
+  sqe->opcode = (user_data >> 62) == kNoTransfer ? IORING_OP_POLL_REMOVE
+                                                 : IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = user_data | kRemovalBit;
+}
+
+struct io_uring_sqe *IOUringServer::GetSQE() const {
+  if (sqe_tail_ - LoadAcquire(sq_head_) >= sq_entries_) {
+    if (Enter(0, 0, nullptr, 0) < 0 && errno != EINTR) {
+      LOG(ERROR) << "io_uring_enter failed: " << safe_strerror(errno);
+    }
+    CHECK_LT(sqe_tail_ - LoadAcquire(sq_head_), sq_entries_)
+        << "io_uring submission queue is stuck";
+  }
+  const unsigned index = sqe_tail_ & sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  ++sqe_tail_;
+  return sqe;
+}
+
+int IOUringServer::Enter(unsigned min_complete, unsigned flags, void *arg,
+                         size_t arg_size) const {
+  StoreRelease(sq_tail_, sqe_tail_);
+  const unsigned to_submit = sqe_tail_ - LoadAcquire(sq_head_);
+  ++num_enters_;
+  num_submitted_ += to_submit;
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                                  min_complete, flags, arg, arg_size));
+}
+
+int IOUringServer::epoll_wait_impl(int /*epfd*/, struct epoll_event *events,
+                                   int max_events, int timeout_in_ms) {
+  return Wait(events, max_events,
+              timeout_in_ms < 0 ? -1 : static_cast<int64_t>(timeout_in_ms) *
+                                           1000);
+}
+
+int IOUringServer::epoll_pwait2_impl(int /*epfd*/, struct epoll_event *events,
+                                     int max_events, int64_t timeout_in_us) {
+  return Wait(events, max_events, timeout_in_us);
+}
+
+int IOUringServer::Wait(struct epoll_event *events, int max_events,
+                        int64_t timeout_in_us) {
+  // The callbacks of the one-shot polls which completed last time have run,
+  // so poll the fds again; those still ready complete right away. The
+  // transfer requests which ended are re-armed too.
+  for (size_t i = 0; i < disarmed_fds_.size(); ++i) {
+    const int fd = disarmed_fds_[i];
+    FDState *state = StateOf(fd);
+    if (state->registered && !state->armed) {
+      QueuePollAdd(fd, state);
+    }
+    UpdateTransfer(fd, state);
+  }
+  disarmed_fds_.clear();
+
+  bool has_input = false;
+  for (int fd : transfer_fds_) {
+    if (IsInputReportable(*StateOf(fd))) {
+      has_input = true;
+      break;
+    }
+  }
+  const bool has_completions =
+      has_input || *cq_head_ != LoadAcquire(cq_tail_);
+  const bool has_submissions = sqe_tail_ != LoadAcquire(sq_head_);
+  if (has_submissions || (!has_completions && timeout_in_us != 0)) {
+    int ret;
+    if (has_completions || timeout_in_us == 0) {
+      ret = Enter(0, 0, nullptr, 0);
+    } else {
+      struct __kernel_timespec ts;
+      struct io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      if (timeout_in_us > 0) {
+        ts.tv_sec = timeout_in_us / 1000000;
+        ts.tv_nsec = (timeout_in_us % 1000000) * 1000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+      }
+      ret = Enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg));
+    }
+    // ETIME is the timeout expiring; EBUSY and EAGAIN mean the kernel wants
+    // completions reaped before it takes more submissions.
+    if (ret < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+      return -1;
+    }
+  }
+
+  ++num_waits_;
+  unsigned head = *cq_head_;
+  const unsigned tail = LoadAcquire(cq_tail_);
+  int num_events = 0;
+  while (head != tail && num_events < max_events) {
+    const struct io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+    ++head;
+    if (cqe->user_data & kRemovalBit) {
+      if (cqe->res == -EALREADY) {
+        // The request was completing and may go on, a multishot one
+        // holding its file open after close(). Try again.
+        QueueRemoval(cqe->user_data & ~kRemovalBit);
+      }
+      continue;
+    }
+    const int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+    const uint32_t generation =
+        static_cast<uint32_t>(cqe->user_data >> 32) & kGenerationMask;
+    const Transfer kind = static_cast<Transfer>(cqe->user_data >> 62);
+    if (kind == kSend) {
+      HandleSend(fd, *cqe, events, &num_events);
+      continue;
+    }
+    if (kind != kNoTransfer) {
+      HandleTransfer(fd, kind, generation, *cqe);
+      continue;
+    }
+    FDState *state = StateOf(fd);
+    if (state == nullptr || !state->registered ||
+        (state->generation & kGenerationMask) != generation) {
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      // One-shot, or a multishot poll the kernel has ended.
+      state->armed = false;
+      disarmed_fds_.push_back(fd);
+    }
+    if (cqe->res == -ECANCELED) {
+      continue;
+    }
+    AddEvent(events, &num_events, fd, state,
+             cqe->res < 0 ? EPOLLERR : static_cast<uint32_t>(cqe->res));
+  }
+  StoreRelease(cq_head_, head);
+  PublishBuffers();
+
+  // The sockets whose transfers got something, or which still have some
+  // for a level-triggered callback. Those left out for want of room in
+  // 'events' are reported by the next wait.
+  size_t num_listed = 0;
+  for (size_t i = 0; i < transfer_fds_.size(); ++i) {
+    const int fd = transfer_fds_[i];
+    FDState *state = StateOf(fd);
+    if (!state->registered || state->transfer == kNoTransfer ||
+        !HasInput(*state)) {
+      state->listed = false;
+      continue;
+    }
+    transfer_fds_[num_listed++] = fd;
+    if (IsInputReportable(*state) &&
+        (num_events < max_events || state->wait_index == num_waits_)) {
+      AddEvent(events, &num_events, fd, state, EPOLLIN);
+      state->fresh = false;
+    }
+  }
+  transfer_fds_.resize(num_listed);
+  return num_events;
+}
+
+}  // namespace raner
+
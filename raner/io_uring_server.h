@@ -0,0 +1,351 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_IO_URING_SERVER_H_
+#define RANER_NET_IO_URING_SERVER_H_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "raner/byte_buffer.h"
+#include "raner/epoll_server.h"
+
+namespace raner {
+
+class OutputQueue;
+
+// An EpollServer which waits on an io_uring instead of an epoll set.
+//
+// Every registered fd has an IORING_OP_POLL_ADD request in flight, and the
+// completions are handed to HandleEvent() exactly like the events returned
+// by epoll_wait, so callbacks see the same semantics as with EpollServer:
+// a level-triggered fd is polled one shot at a time and re-armed once its
+// callback has run, so it is reported again for as long as it is ready; an
+// EPOLLET fd gets a multishot poll which only reports new readiness.
+//
+// What this saves is syscalls. AddFD(), ModFD() and DelFD() only queue
+// submission entries, and the re-arming polls are queued too; all of them
+// go to the kernel in the single io_uring_enter() which also waits for the
+// next completions. A connection that adds and removes EPOLLOUT around a
+// partial write costs no syscall at all for it, where EpollServer makes two
+// epoll_ctl calls unless both changes fall between the same two waits.
+//
+// Sockets can go further and have the ring do their input too. After
+// SetMultishotRecv(), a socket is not polled for EPOLLIN: a multishot
+// IORING_OP_RECV receives its data into buffers of a ring provided to the
+// kernel, and its callback gets EPOLLIN when some came, to take it with
+// Receive() instead of read(); Receive() hands a buffer over in place when
+// it can, and Reclaim() gives it back. After SetMultishotAccept(), a multishot
+// IORING_OP_ACCEPT does the same for the connections of a listening socket,
+// taken with Accept(). Either way, the reads or accepts of all sockets cost
+// no syscall of their own: their completions come with the wait. The
+// request runs while EPOLLIN is in the event mask, and what it got stays
+// until taken; the end of the stream, an error, or a kernel without the
+// request hands the socket back to polling, so that Receive() and Accept()
+// then return what read() and accept4() do.
+//
+// Output goes the same way: Send() queues an IORING_OP_SEND, or SENDMSG,
+// of the bytes at the front of an OutputQueue, which the next wait submits
+// along with everything else, and the callback gets EPOLLOUT once it has
+// completed, to take the result with TakeSent(). A level-triggered socket
+// is not polled for EPOLLOUT meanwhile.
+//
+// Requires Linux 5.13 or later (multishot poll and a timeout passed to
+// io_uring_enter); use IsSupported() before constructing one. Multishot
+// accept needs 5.19, multishot recv 6.0.
+class IOUringServer : public EpollServer {
+ public:
+  IOUringServer();
+  ~IOUringServer() override;
+
+  // Summary:
+  //   Returns true if the running kernel lets this process create an
+  //   io_uring with everything IOUringServer needs. The answer is
+  //   computed once and cached.
+  static bool IsSupported();
+
+  // Summary:
+  //   Returns the number of io_uring_enter() calls made so far, and the
+  //   number of submission queue entries they carried.
+  int64_t NumEnters() const { return num_enters_; }
+  int64_t NumSubmitted() const { return num_submitted_; }
+
+  // Summary:
+  //   Has the input of 'fd', a registered stream socket, received by a
+  //   multishot recv rather than polled for; see the class comment.
+  //   Returns false, leaving it polled, if the kernel does not have
+  //   provided buffer rings.
+  bool SetMultishotRecv(int fd);
+  // Summary:
+  //   Moves what was received for 'fd' into 'buf', like buf->ReadFD(),
+  //   which it calls if 'fd' is polled. Returns the number of bytes moved,
+  //   0 at the end of the stream, or -1 with *saved_errno set, to EAGAIN
+  //   if nothing came.
+  ssize_t Receive(int fd, ByteBuffer *buf, int *saved_errno);
+
+  // Summary:
+  //   Ends the loan of the data which Receive() made 'buf' borrow from the
+  //   ring buffer it came in: copies what is left of it into 'buf', see
+  //   ByteBuffer::Borrow(), and gives the buffer back to the kernel. To be
+  //   called once the data has been looked at; Receive() calls it first.
+  void Reclaim(int fd, ByteBuffer *buf);
+
+  // Summary:
+  //   Queues a send of the bytes in memory at the front of 'queue' by 'fd',
+  //   a registered stream socket, for the next wait to submit. The request
+  //   holds their buffers until it completes, and the callback of 'fd' is
+  //   then given EPOLLOUT. Returns false, queuing nothing, if 'fd' has a
+  //   send already, or if the front of 'queue' is for WriteFD() to send: a
+  //   file, or bytes enough for MSG_ZEROCOPY.
+  bool Send(int fd, const OutputQueue &queue);
+  // Summary:
+  //   True from Send() until TakeSent() has taken the result.
+  bool IsSending(int fd) const;
+  // Summary:
+  //   Returns the number of bytes the send of 'fd' wrote, for the caller to
+  //   drop from its queue, or -1 with *saved_errno set, to EAGAIN if it has
+  //   not completed.
+  ssize_t TakeSent(int fd, int *saved_errno);
+
+  // Summary:
+  //   Has the connections of 'fd', a registered listening socket, accepted
+  //   by a multishot accept rather than polled for; see the class comment.
+  //   Returns false, leaving it polled, if the kernel turned one down.
+  bool SetMultishotAccept(int fd);
+  // Summary:
+  //   Returns the next connection accepted on 'fd', non-blocking and
+  //   close-on-exec, like accept4(), which it calls if 'fd' is polled.
+  //   Returns -1 with errno set on failure, to EAGAIN if none came.
+  int Accept(int fd);
+
+  // Summary:
+  //   Returns the number of completions of multishot recvs and accepts
+  //   which carried data or a connection.
+  int64_t NumTransfers() const { return num_transfers_; }
+
+ protected:
+  void DelFD(int fd) const override;
+  void AddFD(int fd, int event_mask) const override;
+  void ModFD(int fd, int event_mask) const override;
+
+  // Both call Wait(); 'epfd' is not used. The ring takes a timeout in
+  // nanoseconds, so high resolution timers need nothing else.
+  int epoll_wait_impl(int epfd, struct epoll_event *events, int max_events,
+                      int timeout_in_ms) override;
+  int epoll_pwait2_impl(int epfd, struct epoll_event *events, int max_events,
+                        int64_t timeout_in_us) override;
+
+ private:
+  // The request moving the input of an fd, if any. Also the kind of the
+  // requests in their user_data, poll requests being of kind kNoTransfer,
+  // and sends of kind kSend.
+  enum Transfer { kNoTransfer, kRecv, kAccept, kSend };
+
+  // What a multishot recv or accept got: 'res' bytes in buffer
+  // 'buffer_id' of the ring, or an accepted fd, or -errno.
+  struct Completion {
+    int32_t res;
+    uint16_t buffer_id;
+  };
+
+  // A send, which keeps what it sends until it completes.
+  struct SendRequest {
+    uint64_t user_data;
+    struct msghdr msg;
+    std::vector<struct iovec> iov;
+    std::vector<std::shared_ptr<const void>> owners;
+  };
+
+  // The requests of one fd.
+  struct FDState {
+    FDState()
+        : generation(0),
+          event_mask(0),
+          registered(false),
+          armed(false),
+          transfer(kNoTransfer),
+          registration(0),
+          transfer_armed(false),
+          transfer_cancelled(false),
+          transfer_ended(false),
+          listed(false),
+          fresh(false),
+          parked(0),
+          lent(false),
+          lent_buffer_id(0),
+          send_completed(false),
+          send_res(0),
+          wait_index(0),
+          event_index(0) {}
+
+    // Bumped whenever a new poll request replaces the last one, and part of
+    // the user_data of the request, so that completions of a request which
+    // has been cancelled, or of an earlier registration of the same fd
+    // number, are recognised and dropped.
+    uint32_t generation;
+    int event_mask;
+    bool registered;
+    // True while a poll request is in flight; false from the completion
+    // which ended it until it is re-armed.
+    bool armed;
+
+    Transfer transfer;
+    // Bumped by each registration, and part of the user_data of the
+    // transfer requests, which are never dropped otherwise: what they got
+    // was taken from the socket.
+    uint32_t registration;
+    // True while a transfer request is in flight, and cancelled if it was,
+    // which leaves the next one to its last completion.
+    bool transfer_armed;
+    bool transfer_cancelled;
+    // The transfer request got the end of the stream, an error, or
+    // EINVAL for a kernel which lacks it; the fd goes back to polling once
+    // 'completions' have been taken.
+    bool transfer_ended;
+    // In transfer_fds_.
+    bool listed;
+    // Got completions since its callback was last given EPOLLIN.
+    bool fresh;
+    std::deque<Completion> completions;
+    // Received data taken out of the ring buffers when reading stopped.
+    ByteBuffer parked;
+    // A buffer handed over by Receive(), out of the ring until Reclaim().
+    bool lent;
+    uint16_t lent_buffer_id;
+    // The send from Send() to TakeSent(), and its result once completed.
+    std::unique_ptr<SendRequest> send;
+    bool send_completed;
+    int32_t send_res;
+    // The wait, and the index in its events, of the last event of the fd.
+    int64_t wait_index;
+    int event_index;
+  };
+
+  // Maps the rings shared with the kernel. Returns false on failure.
+  bool SetupRings(unsigned entries);
+  void UnmapRings();
+
+  // Maps and registers the ring of buffers for multishot recvs. Returns
+  // false on failure.
+  bool SetupBufferRing();
+  void UnmapBufferRing();
+
+  FDState *StateOf(int fd) const;
+
+  // The events polled for 'state', which leave EPOLLIN to its transfer.
+  static int PollMaskOf(const FDState &state);
+  // Queues a poll request for 'fd' with its current generation and mask.
+  void QueuePollAdd(int fd, FDState *state) const;
+  // Queues the cancellation of the request in flight for 'fd'.
+  void QueuePollRemove(int fd, const FDState &state) const;
+  // Queues the removal of the poll or transfer request with 'user_data'.
+  // One the kernel finds already completing is retried.
+  void QueueRemoval(uint64_t user_data) const;
+  // Replaces the poll request in flight for 'fd' if its mask is no longer
+  // 'old_poll_mask', or 'rearm' is true.
+  void UpdatePoll(int fd, FDState *state, int old_poll_mask,
+                  bool rearm) const;
+  // Arms the transfer request of 'fd' if EPOLLIN is in its mask, and
+  // cancels it otherwise.
+  void UpdateTransfer(int fd, FDState *state) const;
+  void SetTransfer(int fd, Transfer transfer);
+  // Hands 'fd' back to polling once its transfer has ended.
+  void EndTransfer(int fd, FDState *state);
+  // Copies the received data of 'state' out of the ring buffers, so that
+  // the buffers go back to the kernel while the fd is not read.
+  void ParkInput(FDState *state) const;
+  // Releases what the completions of 'fd' hold.
+  void DropCompletions(FDState *state) const;
+  // Queues a completion of the transfer request of 'fd'.
+  void HandleTransfer(int fd, Transfer kind, uint32_t registration,
+                      const struct io_uring_cqe &cqe);
+  // Records the completion of a send, and reports EPOLLOUT for it, or
+  // frees it if it was left by an earlier registration of the fd number.
+  void HandleSend(int fd, const struct io_uring_cqe &cqe,
+                  struct epoll_event *events, int *num_events);
+  bool HasInput(const FDState &state) const;
+  // True if the callback of 'state' is to be given EPOLLIN for its
+  // transfer.
+  bool IsInputReportable(const FDState &state) const;
+  // Adds 'event_mask' for 'fd' to the events of this wait, merged with
+  // any event the fd already has there.
+  void AddEvent(struct epoll_event *events, int *num_events, int fd,
+                FDState *state, uint32_t event_mask);
+  // Gives a buffer back to the kernel, which sees it once published.
+  void ProvideBuffer(uint16_t buffer_id) const;
+  void PublishBuffers() const;
+  const char *BufferOf(uint16_t buffer_id) const;
+  void Recycle(const struct io_uring_cqe &cqe) const;
+  // Returns the next free submission queue entry, submitting what is queued
+  // first if the queue is full.
+  struct io_uring_sqe *GetSQE() const;
+  // Submits whatever has been queued, waits for up to timeout_in_us (for
+  // ever if negative) for at least one completion, and turns the
+  // completions into epoll_events.
+  int Wait(struct epoll_event *events, int max_events, int64_t timeout_in_us);
+  // Calls io_uring_enter() with everything queued so far.
+  int Enter(unsigned min_complete, unsigned flags, void *arg,
+            size_t arg_size) const;
+
+  int ring_fd_;
+
+  // The submission and completion rings, mmap()ed from ring_fd_.
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe *sqes_;
+  size_t sqes_size_;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe *cqes_;
+
+  // The ring of buffers provided for multishot recvs, and the buffers;
+  // null if the kernel has none.
+  struct io_uring_buf_ring *buf_ring_;
+  char *buffers_;
+  mutable uint16_t buf_ring_tail_;
+  bool multishot_recv_supported_;
+  bool multishot_accept_supported_;
+
+  // The ring is only changed from the const AddFD(), ModFD() and DelFD()
+  // hooks of EpollServer, whence mutable.
+  mutable unsigned sqe_tail_;
+  mutable std::vector<FDState> fd_states_;
+  // fds whose one-shot poll, or transfer request, has completed, to be
+  // re-armed before the next wait; an fd may be listed after it has been
+  // unregistered or re-armed.
+  mutable std::vector<int> disarmed_fds_;
+  // fds with completions of transfer requests, or listed before and then
+  // unregistered or taken.
+  std::vector<int> transfer_fds_;
+  // Sends of fds unregistered before they completed, waiting for it, and
+  // sends to reuse.
+  mutable std::vector<std::unique_ptr<SendRequest>> orphaned_sends_;
+  mutable std::vector<std::unique_ptr<SendRequest>> free_sends_;
+  int64_t num_waits_;
+
+  mutable int64_t num_enters_;
+  mutable int64_t num_submitted_;
+  int64_t num_transfers_;
+
+  DISALLOW_COPY_AND_ASSIGN(IOUringServer);
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_IO_URING_SERVER_H_
@@ -0,0 +1,135 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/loop_placement.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "raner/event_loop.h"
+#include "raner/socket.h"
+#include "raner/time.h"
+
+namespace raner {
+
+EventLoop *RoundRobinPlacement::Pick(const std::vector<EventLoop *> &loops,
+                                     int fd) {
+  if (next_ >= loops.size()) {
+    next_ = 0;
+  }
+  return loops[next_++];
+}
+
+EventLoop *LeastConnectionsPlacement::Pick(
+    const std::vector<EventLoop *> &loops, int fd) {
+  EventLoop *least = loops[0];
+  int least_connections = least->NumConnections();
+  for (size_t i = 1; i < loops.size(); ++i) {
+    const int num_connections = loops[i]->NumConnections();
+    if (num_connections < least_connections) {
+      least = loops[i];
+      least_connections = num_connections;
+    }
+  }
+  return least;
+}
+
+constexpr int64_t LeastBusyPlacement::kSampleIntervalUs;
+constexpr double LeastBusyPlacement::kTolerance;
+
+LeastBusyPlacement::LeastBusyPlacement() : sample_time_in_us_(0) {}
+
+int LeastBusyPlacement::LoadStats() const { return EventLoop::kBusyTime; }
+
+void LeastBusyPlacement::sample(const std::vector<EventLoop *> &loops) {
+  const int64_t now_us = (Time::Now() - Time::UnixEpoch()).count();
+  if (busy_time_in_us_.size() != loops.size()) {
+    busy_time_in_us_.assign(loops.size(), 0);
+    busy_fraction_.assign(loops.size(), 0);
+    for (size_t i = 0; i < loops.size(); ++i) {
+      busy_time_in_us_[i] = loops[i]->BusyTimeInUs();
+    }
+    sample_time_in_us_ = now_us;
+    return;
+  }
+  const int64_t elapsed_us = now_us - sample_time_in_us_;
+  if (elapsed_us < kSampleIntervalUs) {
+    return;
+  }
+  for (size_t i = 0; i < loops.size(); ++i) {
+    const int64_t busy_time_in_us = loops[i]->BusyTimeInUs();
+    busy_fraction_[i] =
+        std::min(1.0, static_cast<double>(busy_time_in_us -
+                                          busy_time_in_us_[i]) /
+                          static_cast<double>(elapsed_us));
+    busy_time_in_us_[i] = busy_time_in_us;
+  }
+  sample_time_in_us_ = now_us;
+}
+
+EventLoop *LeastBusyPlacement::Pick(const std::vector<EventLoop *> &loops,
+                                    int fd) {
+  sample(loops);
+  const double least_busy =
+      *std::min_element(busy_fraction_.begin(), busy_fraction_.end());
+  EventLoop *least = nullptr;
+  int least_connections = 0;
+  for (size_t i = 0; i < loops.size(); ++i) {
+    if (busy_fraction_[i] > least_busy + kTolerance) {
+      continue;
+    }
+    const int num_connections = loops[i]->NumConnections();
+    if (least == nullptr || num_connections < least_connections) {
+      least = loops[i];
+      least_connections = num_connections;
+    }
+  }
+  return least;
+}
+
+EventLoop *PowerOfTwoChoicesPlacement::Pick(
+    const std::vector<EventLoop *> &loops, int fd) {
+  const size_t n = loops.size();
+  const size_t i = random_() % n;
+  // Any other loop, with the same odds.
+  size_t j = random_() % (n - 1);
+  if (j >= i) {
+    ++j;
+  }
+  return loops[j]->NumConnections() < loops[i]->NumConnections() ? loops[j]
+                                                                 : loops[i];
+}
+
+IncomingCPUPlacement::IncomingCPUPlacement(
+    std::unique_ptr<LoopPlacementPolicy> fallback)
+    : fallback_(std::move(fallback)) {
+  assert(fallback_);
+}
+
+int IncomingCPUPlacement::LoadStats() const {
+  return EventLoop::kLastCPU | fallback_->LoadStats();
+}
+
+EventLoop *IncomingCPUPlacement::Pick(const std::vector<EventLoop *> &loops,
+                                      int fd) {
+  const int cpu = Socket::GetIncomingCPU(fd);
+  EventLoop *least = nullptr;
+  int least_connections = 0;
+  if (cpu >= 0) {
+    for (EventLoop *loop : loops) {
+      if (loop->LastCPU() != cpu) {
+        continue;
+      }
+      const int num_connections = loop->NumConnections();
+      if (least == nullptr || num_connections < least_connections) {
+        least = loop;
+        least_connections = num_connections;
+      }
+    }
+  }
+  return least != nullptr ? least : fallback_->Pick(loops, fd);
+}
+
+}  // namespace raner
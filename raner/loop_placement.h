@@ -0,0 +1,131 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_LOOP_PLACEMENT_H_
+#define RANER_NET_LOOP_PLACEMENT_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "raner/macros.h"
+
+namespace raner {
+
+class EventLoop;
+
+// Decides which loop of an EventLoopThreadPool a new connection goes to;
+// see EventLoopThreadPool::SetPlacementPolicy(). Placement is final: a
+// connection stays on its loop for its lifetime.
+//
+// The built-in policies read the load statistics of the loops,
+// EventLoop::NumConnections(), BusyTimeInUs() and LastCPU(), which are
+// kept by the loops themselves.
+class LoopPlacementPolicy {
+ public:
+  virtual ~LoopPlacementPolicy() {}
+
+  // The EventLoop::LoadStat mask of the statistics Pick() reads, which the
+  // pool has its loops keep. NumConnections() is always kept.
+  virtual int LoadStats() const { return 0; }
+
+  // Returns one of 'loops', which holds at least two, for the new
+  // connection on socket 'fd'. Called in the base loop thread of the pool
+  // only, always with the same loops.
+  virtual EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) = 0;
+};
+
+// Each loop in turn; the default.
+class RoundRobinPlacement : public LoopPlacementPolicy {
+ public:
+  RoundRobinPlacement() : next_(0) {}
+
+  EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) override;
+
+ private:
+  size_t next_;
+
+  DISALLOW_COPY_AND_ASSIGN(RoundRobinPlacement);
+};
+
+// The loop with the fewest connections, the first one on a tie. Balances
+// connection counts, whatever the connections cost.
+class LeastConnectionsPlacement : public LoopPlacementPolicy {
+ public:
+  LeastConnectionsPlacement() {}
+
+  EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) override;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(LeastConnectionsPlacement);
+};
+
+// The loop which spent the least time busy, as opposed to waiting, over
+// the last kSampleIntervalUs or more. Loops within kTolerance of the least
+// busy fraction are taken as equally busy, and the one with the fewest
+// connections among them is picked, so that a burst of connections arriving
+// between two samples is not all put on the same loop.
+class LeastBusyPlacement : public LoopPlacementPolicy {
+ public:
+  LeastBusyPlacement();
+
+  static constexpr int64_t kSampleIntervalUs = 10 * 1000;
+  static constexpr double kTolerance = 0.05;
+
+  int LoadStats() const override;
+  EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) override;
+
+ private:
+  void sample(const std::vector<EventLoop *> &loops);
+
+  // Indexed like the loops.
+  std::vector<int64_t> busy_time_in_us_;
+  std::vector<double> busy_fraction_;
+  int64_t sample_time_in_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(LeastBusyPlacement);
+};
+
+// The one with fewer connections of two loops picked at random. Nearly as
+// balanced as LeastConnectionsPlacement, reading two loops instead of all
+// of them, and less prone to herding when the counts lag behind.
+class PowerOfTwoChoicesPlacement : public LoopPlacementPolicy {
+ public:
+  explicit PowerOfTwoChoicesPlacement(uint32_t seed = 1) : random_(seed) {}
+
+  EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) override;
+
+ private:
+  std::minstd_rand random_;
+
+  DISALLOW_COPY_AND_ASSIGN(PowerOfTwoChoicesPlacement);
+};
+
+// A loop whose thread runs on the CPU which received the packets of the
+// connection, from SO_INCOMING_CPU, so that the softirq and the loop share
+// the caches; with RSS or RPS steering each flow to a CPU, and the loop
+// threads pinned one per CPU, typically from the ThreadInitCallback. The
+// one with the fewest connections if several loops are on that CPU, and
+// 'fallback' decides if none is, or the CPU is not known.
+class IncomingCPUPlacement : public LoopPlacementPolicy {
+ public:
+  explicit IncomingCPUPlacement(
+      std::unique_ptr<LoopPlacementPolicy> fallback =
+          std::unique_ptr<LoopPlacementPolicy>(
+              new LeastConnectionsPlacement()));
+
+  int LoadStats() const override;
+  EventLoop *Pick(const std::vector<EventLoop *> &loops, int fd) override;
+
+ private:
+  std::unique_ptr<LoopPlacementPolicy> fallback_;
+
+  DISALLOW_COPY_AND_ASSIGN(IncomingCPUPlacement);
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_LOOP_PLACEMENT_H_
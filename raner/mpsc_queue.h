@@ -0,0 +1,152 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_BASE_MPSC_QUEUE_H_
+#define RANER_BASE_MPSC_QUEUE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "raner/macros.h"
+
+namespace raner {
+
+// Embed (or derive from) this in anything that is put on an MPSCQueue.
+struct MPSCQueueNode {
+  MPSCQueueNode() : next(nullptr) {}
+
+  std::atomic<MPSCQueueNode *> next;
+};
+
+// An intrusive, unbounded, lock-free multi-producer single-consumer queue
+// (Dmitry Vyukov's design).
+//
+// Push() is a single atomic exchange plus a store and is safe to call from
+// any number of threads; it never blocks and never allocates, since the
+// nodes are owned by the caller. Pop() must only be called from one thread
+// at a time. Nodes come out in the order of their exchanges, so the pushes
+// of any one thread keep their order.
+//
+// A producer that has been preempted between its exchange and its store
+// hides the nodes pushed after its own until it resumes; Pop() returns
+// nullptr in the meantime, as if the queue were empty. The consumer must
+// therefore be told about every Push() (the EventLoop is woken up after each
+// one) instead of relying on the queue to look non-empty, or wait for such
+// a node while the queue is not Empty().
+class MPSCQueue {
+ public:
+  MPSCQueue() : head_(&stub_), tail_(&stub_) {}
+
+  // The exchange is sequentially consistent, which costs no more than
+  // acq_rel, so that callers can tell the consumer about the push without a
+  // fence of their own: a consumer which has cleared a flag and issued a
+  // seq_cst fence either finds the node not Empty(), or the producer reads
+  // the flag as cleared after Push().
+  void Push(MPSCQueueNode *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MPSCQueueNode *prev = head_.exchange(node, std::memory_order_seq_cst);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Returns the oldest node, or nullptr if there is none (or none yet
+  // linked in, see above). Consumer only.
+  MPSCQueueNode *Pop() {
+    MPSCQueueNode *tail = tail_;
+    MPSCQueueNode *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail_ = next;
+      return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire)) {
+      // A producer is in the middle of Push().
+      return nullptr;
+    }
+    // 'tail' is the last node. Put the stub back behind it so that it can be
+    // handed out without leaving the queue without a node.
+    Push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail_ = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+  // Returns true if every node pushed has been popped. Unlike Pop()
+  // returning nullptr, false includes a node whose producer is in the
+  // middle of Push(). Consumer only.
+  bool Empty() const {
+    return tail_ == &stub_ && head_.load(std::memory_order_acquire) == &stub_;
+  }
+
+  // Counts the nodes pushed, and linked in, which have not been popped.
+  // Consumer only.
+  size_t Size() const {
+    size_t size = 0;
+    for (const MPSCQueueNode *node = tail_; node != nullptr;
+         node = node->next.load(std::memory_order_acquire)) {
+      if (node != &stub_) {
+        ++size;
+      }
+    }
+    return size;
+  }
+
+ private:
+  // Producers append at head_, the consumer takes from tail_. They sit on
+  // separate cache lines so that pushes do not keep stealing the line the
+  // consumer is reading.
+  alignas(64) std::atomic<MPSCQueueNode *> head_;
+  alignas(64) MPSCQueueNode *tail_;
+  MPSCQueueNode stub_;
+
+  DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+// A lock-free stack of MPSCQueueNodes, for keeping the nodes which have been
+// popped off an MPSCQueue to push them again.
+//
+// Push() and TakeAll() are both safe to call from any number of threads.
+// Nodes are only ever taken off all at once, with a single exchange, so a
+// node which comes back to the stack cannot be mistaken for the one that was
+// on top before, which is what makes popping nodes one at a time off a
+// lock-free stack unsafe (the ABA problem).
+class MPSCNodeStack {
+ public:
+  constexpr MPSCNodeStack() : top_(nullptr) {}
+
+  // Pushes the nodes from 'first' to 'last', already linked through their
+  // 'next'.
+  void Push(MPSCQueueNode *first, MPSCQueueNode *last) {
+    MPSCQueueNode *top = top_.load(std::memory_order_relaxed);
+    do {
+      last->next.store(top, std::memory_order_relaxed);
+    } while (!top_.compare_exchange_weak(
+        top, first, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // Returns the nodes linked through their 'next', the last pushed first,
+  // or nullptr if there is none, and leaves the stack empty.
+  MPSCQueueNode *TakeAll() {
+    return top_.exchange(nullptr, std::memory_order_acquire);
+  }
+
+ private:
+  std::atomic<MPSCQueueNode *> top_;
+
+  DISALLOW_COPY_AND_ASSIGN(MPSCNodeStack);
+};
+
+}  // namespace raner
+
+#endif  // RANER_BASE_MPSC_QUEUE_H_
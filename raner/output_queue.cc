@@ -0,0 +1,321 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/output_queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>  // IOV_MAX
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+#include "raner/byte_buffer.h"
+#include "raner/shared_file.h"
+#include "raner/shared_payload.h"
+
+namespace raner {
+
+constexpr size_t OutputQueue::kBlockSize;
+constexpr size_t OutputQueue::kMinMoveSize;
+constexpr size_t OutputQueue::kMaxSendFileBytes;
+
+OutputQueue::OutputQueue()
+    : spare_capacity_(0),
+      readable_bytes_(0),
+      num_file_chunks_(0),
+      zerocopy_threshold_(0),
+      next_zerocopy_id_(0),
+      pinned_bytes_(0) {}
+
+OutputQueue::~OutputQueue() {}
+
+void OutputQueue::Append(const void *data, size_t len) {
+  const char *p = static_cast<const char *>(data);
+  if (len > 0 && !chunks_.empty() && chunks_.back().room > 0) {
+    Chunk &tail = chunks_.back();
+    const size_t n = std::min(len, tail.room);
+    // A block of the queue's own, allocated writable.
+    memcpy(const_cast<char *>(tail.data) + tail.size, p, n);
+    tail.size += n;
+    tail.room -= n;
+    readable_bytes_ += n;
+    p += n;
+    len -= n;
+  }
+  if (len == 0) {
+    return;
+  }
+  if (spare_block_ != nullptr && spare_capacity_ >= len) {
+    // Allocated writable, as below.
+    char *block = static_cast<char *>(const_cast<void *>(spare_block_.get()));
+    memcpy(block, p, len);
+    chunks_.push_back(Chunk{std::move(spare_block_), block, len,
+                            spare_capacity_ - len, -1, 0});
+    readable_bytes_ += len;
+    return;
+  }
+  const size_t capacity = std::max(len, kBlockSize);
+  std::shared_ptr<char[]> block(new char[capacity]);
+  memcpy(block.get(), p, len);
+  chunks_.push_back(Chunk{block, block.get(), len, capacity - len, -1, 0});
+  readable_bytes_ += len;
+}
+
+void OutputQueue::Append(std::string &&data, size_t offset) {
+  assert(offset <= data.size());
+  const size_t len = data.size() - offset;
+  if (len < kMinMoveSize) {
+    Append(data.data() + offset, len);
+    return;
+  }
+  std::shared_ptr<std::string> owner =
+      std::make_shared<std::string>(std::move(data));
+  appendChunk(owner, owner->data() + offset, len);
+}
+
+void OutputQueue::Append(ByteBuffer *buf) {
+  const size_t len = buf->ReadableBytes();
+  if (len < kMinMoveSize) {
+    Append(buf->BeginRead(), len);
+    buf->SkipAll();
+    return;
+  }
+  std::shared_ptr<ByteBuffer> owner = std::make_shared<ByteBuffer>();
+  owner->Swap(*buf);
+  appendChunk(owner, owner->BeginRead(), len);
+}
+
+void OutputQueue::Append(const SharedPayload &payload, size_t offset) {
+  assert(offset <= payload.size());
+  if (offset < payload.size()) {
+    appendChunk(payload.owner_, payload.data() + offset,
+                payload.size() - offset);
+  }
+}
+
+void OutputQueue::AppendFile(const SharedFile &file, off_t offset,
+                             size_t len) {
+  assert(file.valid());
+  if (len > 0) {
+    chunks_.push_back(Chunk{file.owner_, nullptr, len, 0, file.fd(), offset});
+    readable_bytes_ += len;
+    ++num_file_chunks_;
+  }
+}
+
+void OutputQueue::appendChunk(std::shared_ptr<const void> owner,
+                              const char *data, size_t size) {
+  chunks_.push_back(Chunk{std::move(owner), data, size, 0, -1, 0});
+  readable_bytes_ += size;
+}
+
+size_t OutputQueue::MaxWriteFDBytes() const {
+  if (chunks_.size() <= IOV_MAX && num_file_chunks_ == 0) {
+    return readable_bytes_;
+  }
+  if (!chunks_.empty() && chunks_.front().fd >= 0) {
+    return std::min(chunks_.front().size, kMaxSendFileBytes);
+  }
+  size_t max_bytes = 0;
+  for (size_t i = 0; i < chunks_.size() && i < IOV_MAX; ++i) {
+    if (chunks_[i].fd >= 0) {
+      break;
+    }
+    max_bytes += chunks_[i].size;
+  }
+  return max_bytes;
+}
+
+ssize_t OutputQueue::WriteFD(int fd, int *saved_errno) {
+  if (!chunks_.empty() && chunks_.front().fd >= 0) {
+    return sendFile(fd, saved_errno);
+  }
+  struct iovec iov[IOV_MAX];
+  size_t bytes = 0;
+  const size_t iovcnt = Gather(iov, IOV_MAX, &bytes, nullptr);
+  if (iovcnt == 0) {
+    return 0;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  bool zerocopy = zerocopy_threshold_ > 0 && bytes >= zerocopy_threshold_;
+  ssize_t n = HANDLE_EINTR(
+      ::sendmsg(fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0)));
+  if (n < 0 && zerocopy && errno == ENOBUFS) {
+    // Out of the socket's option memory, which notifications use; copy.
+    zerocopy = false;
+    n = HANDLE_EINTR(::sendmsg(fd, &msg, MSG_NOSIGNAL));
+  }
+  if (n < 0) {
+    *saved_errno = errno;
+  } else {
+    if (zerocopy) {
+      pin(static_cast<size_t>(n));
+    }
+    Skip(static_cast<size_t>(n));
+  }
+  return n;
+}
+
+size_t OutputQueue::Gather(
+    struct iovec *iov, size_t max_iov, size_t *bytes,
+    std::vector<std::shared_ptr<const void>> *owners) const {
+  size_t iovcnt = 0;
+  *bytes = 0;
+  for (const Chunk &chunk : chunks_) {
+    // A file waits for the bytes before it, and is sent on its own.
+    if (iovcnt == max_iov || chunk.fd >= 0) {
+      break;
+    }
+    // Not written through, sendmsg() only reads it.
+    iov[iovcnt].iov_base = const_cast<char *>(chunk.data);
+    iov[iovcnt].iov_len = chunk.size;
+    ++iovcnt;
+    *bytes += chunk.size;
+    if (owners != nullptr) {
+      owners->push_back(chunk.owner);
+    }
+  }
+  return iovcnt;
+}
+
+ssize_t OutputQueue::sendFile(int fd, int *saved_errno) {
+  const Chunk &front = chunks_.front();
+  const size_t len = std::min(front.size, kMaxSendFileBytes);
+  off_t offset = front.offset;
+  // One call moves no more than the pipe sendfile() splices through holds,
+  // 64KB or so, however much room the socket has: goes on until the socket
+  // takes less, for a short write to mean a full socket buffer.
+  size_t total = 0;
+  while (total < len) {
+    const ssize_t n =
+        HANDLE_EINTR(::sendfile(fd, front.fd, &offset, len - total));
+    if (n <= 0) {
+      if (total > 0) {
+        // The next call reports what stopped this one.
+        break;
+      }
+      // Nothing left at 'offset' when 0: the file shrank.
+      *saved_errno = n < 0 ? errno : ENODATA;
+      return -1;
+    }
+    total += static_cast<size_t>(n);
+  }
+  Skip(total);
+  return static_cast<ssize_t>(total);
+}
+
+void OutputQueue::pin(size_t len) {
+  PinnedSend send{next_zerocopy_id_++, len, {}};
+  for (const Chunk &chunk : chunks_) {
+    if (len == 0) {
+      break;
+    }
+    send.owners.push_back(chunk.owner);
+    len -= std::min(len, chunk.size);
+  }
+  pinned_bytes_ += send.size;
+  pinned_.push_back(std::move(send));
+}
+
+int OutputQueue::ReadZeroCopyCompletions(int fd, int *saved_errno) {
+  int num_notifications = 0;
+  while (true) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (HANDLE_EINTR(::recvmsg(fd, &msg, MSG_ERRQUEUE)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return num_notifications;
+      }
+      *saved_errno = errno;
+      return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cm), sizeof(err));
+      if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+        continue;
+      }
+      ++num_notifications;
+      // The range of sends, by id, it completes.
+      release(err.ee_info, err.ee_data);
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zerocopy_threshold_ = 0;
+      }
+    }
+  }
+}
+
+void OutputQueue::release(uint32_t first_id, uint32_t last_id) {
+  const uint32_t range = last_id - first_id;
+  // Completions come in order, ranges of the oldest sends first, though
+  // nothing promises it.
+  for (auto it = pinned_.begin(); it != pinned_.end();) {
+    if (static_cast<uint32_t>(it->id - first_id) <= range) {
+      pinned_bytes_ -= it->size;
+      it = pinned_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void OutputQueue::Clear() {
+  chunks_.clear();
+  readable_bytes_ = 0;
+  num_file_chunks_ = 0;
+}
+
+void OutputQueue::keepBlock(Chunk *chunk) {
+  // Only the queue's own blocks have room left, and their owner points at
+  // their start.
+  if (chunk->room == 0 || chunk->owner.use_count() != 1) {
+    return;
+  }
+  const char *block = static_cast<const char *>(chunk->owner.get());
+  spare_capacity_ = static_cast<size_t>(chunk->data + chunk->size +
+                                        chunk->room - block);
+  spare_block_ = std::move(chunk->owner);
+}
+
+void OutputQueue::Skip(size_t len) {
+  assert(len <= readable_bytes_);
+  readable_bytes_ -= len;
+  while (len > 0) {
+    Chunk &front = chunks_.front();
+    if (len < front.size) {
+      if (front.fd >= 0) {
+        front.offset += static_cast<off_t>(len);
+      } else {
+        front.data += len;
+      }
+      front.size -= len;
+      return;
+    }
+    len -= front.size;
+    if (front.fd >= 0) {
+      --num_file_chunks_;
+    }
+    keepBlock(&front);
+    chunks_.pop_front();
+  }
+}
+
+}  // namespace raner
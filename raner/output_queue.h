@@ -0,0 +1,175 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_OUTPUT_QUEUE_H_
+#define RANER_NET_OUTPUT_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "raner/macros.h"
+
+struct iovec;
+
+namespace raner {
+
+class ByteBuffer;
+class SharedFile;
+class SharedPayload;
+
+// The bytes a TCPConnection has yet to write, as a queue of refcounted
+// chunks instead of one contiguous buffer.
+//
+// Appending a buffer the caller gives up, a std::string&& or a ByteBuffer,
+// moves it in as a chunk of its own, without copying it, and a
+// SharedPayload is queued by reference. Other bytes are copied into blocks
+// of at least kBlockSize owned by the queue, small ones packed together; a
+// large one gets a block of its size, so it is copied once and never moved
+// again, where a single buffer would grow and move its content at every
+// doubling. WriteFD() hands up to IOV_MAX chunks to the kernel with one
+// gather write. The last block written out is kept for the next bytes, if
+// nothing else holds it.
+//
+// A range of a file is queued as a chunk of its own too, holding the file
+// open, and WriteFD() sends it with sendfile(2) once the bytes queued
+// before it are written, so that it never goes through user space.
+//
+// With a zerocopy threshold set, a gather write of at least that many bytes
+// is sent with MSG_ZEROCOPY: the kernel reads the chunks in place rather
+// than copying them, and the queue keeps their buffers, though written,
+// until the completions read from the error queue of the socket release
+// them. Destroying the queue releases them all, which only a connection
+// closed without flushing should do.
+//
+// Not thread safe.
+class OutputQueue {
+ public:
+  OutputQueue();
+  ~OutputQueue();
+
+  static constexpr size_t kBlockSize = 16 * 1024;
+  // Owned buffers smaller than this are copied rather than moved in: a
+  // chunk of their own would cost more than the copy.
+  static constexpr size_t kMinMoveSize = 1024;
+  // The most one sendfile() call transfers on Linux.
+  static constexpr size_t kMaxSendFileBytes = 0x7ffff000;
+
+  // The number of bytes queued, exactly, counting those still in files.
+  size_t ReadableBytes() const { return readable_bytes_; }
+  bool Empty() const { return readable_bytes_ == 0; }
+  size_t NumChunks() const { return chunks_.size(); }
+
+  void Append(const void *data, size_t len);
+  void Append(std::string_view data) { Append(data.data(), data.size()); }
+  // Moves in 'data' starting at 'offset'.
+  void Append(std::string &&data, size_t offset = 0);
+  // Moves in the readable bytes of 'buf', which is left empty.
+  void Append(ByteBuffer *buf);
+  // Queues a reference to the bytes of 'payload' starting at 'offset',
+  // whatever their size.
+  void Append(const SharedPayload &payload, size_t offset = 0);
+  // Queues 'len' bytes of 'file' starting at 'offset', left in the file
+  // until they are written.
+  void AppendFile(const SharedFile &file, off_t offset, size_t len);
+
+  // Writes as much as one sendmsg() takes of the bytes in memory at the
+  // front, or as much of the file at the front as sendfile() calls take
+  // until the socket takes less, and drops what it took. Returns the bytes
+  // written; on error, with errno in *saved_errno. A file that ends before
+  // the bytes queued from it fails with ENODATA.
+  ssize_t WriteFD(int fd, int *saved_errno);
+
+  // The most one WriteFD() call can write; fewer means the socket buffer
+  // is full.
+  size_t MaxWriteFDBytes() const;
+
+  // Fills 'iov' with up to 'max_iov' of the chunks in memory at the front,
+  // those WriteFD() would send, for a write made by other means, and adds
+  // the owners of their buffers to 'owners'. Returns the number of entries
+  // filled, and the bytes they hold in *bytes.
+  size_t Gather(struct iovec *iov, size_t max_iov, size_t *bytes,
+                std::vector<std::shared_ptr<const void>> *owners) const;
+  // Drops the first 'len' bytes, written by other means than WriteFD().
+  void Skip(size_t len);
+
+  // Sends with MSG_ZEROCOPY each gather write of at least 'threshold'
+  // bytes; 0 never does. The socket needs SO_ZEROCOPY.
+  void SetZeroCopyThreshold(size_t threshold) {
+    zerocopy_threshold_ = threshold;
+  }
+  // Set back to 0 once the kernel reports having copied a zerocopy send
+  // anyway, as it does over loopback, where the pinning only costs.
+  size_t zerocopy_threshold() const { return zerocopy_threshold_; }
+
+  // Reads the zerocopy completions waiting on the error queue of 'fd' and
+  // releases the buffers of the sends they cover. Returns the number of
+  // notifications read, or -1 on an error other than the queue being
+  // empty, with errno in *saved_errno.
+  int ReadZeroCopyCompletions(int fd, int *saved_errno);
+
+  // Zerocopy sends not completed yet, and the bytes they were of.
+  size_t NumPinnedSends() const { return pinned_.size(); }
+  size_t PinnedBytes() const { return pinned_bytes_; }
+
+  void Clear();
+
+ private:
+  struct Chunk {
+    // Keeps 'data' alive; shared with whoever else holds the buffer.
+    std::shared_ptr<const void> owner;
+    const char *data;
+    size_t size;
+    // Room after 'data + size' in a block owned by the queue, which later
+    // appends fill; 0 for moved-in buffers and files.
+    size_t room;
+    // For a range of a file, 'size' bytes at 'offset' in 'fd'; -1 and
+    // 'data' otherwise.
+    int fd;
+    off_t offset;
+  };
+
+  // The buffers of a zerocopy send, numbered as the kernel does: one more
+  // for each successful send with MSG_ZEROCOPY on the socket.
+  struct PinnedSend {
+    uint32_t id;
+    size_t size;
+    std::vector<std::shared_ptr<const void>> owners;
+  };
+
+  void appendChunk(std::shared_ptr<const void> owner, const char *data,
+                   size_t size);
+  ssize_t sendFile(int fd, int *saved_errno);
+  // Keeps the buffers of the first 'len' bytes until the send gets its
+  // completion.
+  void pin(size_t len);
+  void release(uint32_t first_id, uint32_t last_id);
+  // Keeps the block of 'chunk', written out, if it is the queue's own and
+  // nobody else holds it.
+  void keepBlock(Chunk *chunk);
+
+  std::deque<Chunk> chunks_;
+  // A block written out, and its size, for the next bytes.
+  std::shared_ptr<const void> spare_block_;
+  size_t spare_capacity_;
+  size_t readable_bytes_;
+  size_t num_file_chunks_;
+
+  size_t zerocopy_threshold_;
+  uint32_t next_zerocopy_id_;
+  std::deque<PinnedSend> pinned_;
+  size_t pinned_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(OutputQueue);
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_OUTPUT_QUEUE_H_
@@ -0,0 +1,58 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_SHARED_FILE_H_
+#define RANER_NET_SHARED_FILE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "raner/macros.h"
+
+namespace raner {
+
+// An open file descriptor, closed along with the last SharedFile referring
+// to it, so that sends queued from a file by TCPConnection::SendFile() keep
+// it open until they are written.
+class SharedFile {
+ public:
+  SharedFile() : fd_(-1) {}
+
+  // Takes 'fd' over.
+  explicit SharedFile(int fd)
+      : owner_(fd >= 0 ? std::make_shared<const Closer>(fd) : nullptr),
+        fd_(fd) {}
+
+  // Refers to a duplicate of 'fd', which the caller keeps. Invalid if the
+  // duplication fails, with errno set.
+  static SharedFile Dup(int fd) {
+    return SharedFile(::fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  }
+
+  int fd() const { return fd_; }
+  bool valid() const { return fd_ >= 0; }
+
+ private:
+  friend class OutputQueue;
+
+  class Closer {
+   public:
+    explicit Closer(int fd) : fd_(fd) {}
+    ~Closer() { ::close(fd_); }
+
+   private:
+    const int fd_;
+
+    DISALLOW_COPY_AND_ASSIGN(Closer);
+  };
+
+  std::shared_ptr<const void> owner_;
+  int fd_;
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_SHARED_FILE_H_
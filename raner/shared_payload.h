@@ -0,0 +1,72 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_SHARED_PAYLOAD_H_
+#define RANER_NET_SHARED_PAYLOAD_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "raner/byte_buffer.h"
+
+namespace raner {
+
+// An immutable, refcounted byte string, typically a message already
+// framed for the wire, meant to be sent as is to many connections.
+//
+// TCPConnection::Send() queues a reference to the bytes rather than a
+// copy, so that sending one payload to N connections encodes and allocates
+// it once, and each socket is written from the same memory. Copying a
+// SharedPayload copies a reference, and it may be sent from any thread.
+class SharedPayload {
+ public:
+  SharedPayload() : data_(nullptr), size_(0) {}
+
+  // Takes 'bytes' over without copying them.
+  explicit SharedPayload(std::string &&bytes) {
+    std::shared_ptr<std::string> owner =
+        std::make_shared<std::string>(std::move(bytes));
+    data_ = owner->data();
+    size_ = owner->size();
+    owner_ = std::move(owner);
+  }
+
+  // Takes the readable bytes of 'buf' over without copying them, and
+  // leaves it empty.
+  explicit SharedPayload(ByteBuffer *buf) {
+    std::shared_ptr<ByteBuffer> owner = std::make_shared<ByteBuffer>();
+    owner->Swap(*buf);
+    data_ = owner->BeginRead();
+    size_ = owner->ReadableBytes();
+    owner_ = std::move(owner);
+  }
+
+  // Copies the 'len' bytes at 'data'.
+  SharedPayload(const void *data, size_t len)
+      : SharedPayload(std::string(static_cast<const char *>(data), len)) {}
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::string_view ToStringView() const {
+    return std::string_view(data_, size_);
+  }
+
+  // The number of SharedPayloads, and of queued sends, sharing the bytes.
+  long use_count() const { return owner_.use_count(); }
+
+ private:
+  friend class OutputQueue;
+
+  std::shared_ptr<const void> owner_;
+  const char *data_;
+  size_t size_;
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_SHARED_PAYLOAD_H_
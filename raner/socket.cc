@@ -43,6 +43,19 @@ int Socket::DisableNagle(int fd) {
   return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 }
 
+int Socket::GetIncomingCPU(int fd) {
+#ifdef SO_INCOMING_CPU
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+    return -1;
+  }
+  return cpu;
+#else
+  return -1;
+#endif
+}
+
 Socket::Socket()
     : fd_(-1),
       port_(0),
@@ -55,9 +68,11 @@ Socket::Socket()
 
 Socket::~Socket() { Close(); }
 
-bool Socket::BindAndListen(const std::string &host, int port) {
+bool Socket::BindAndListen(const std::string &host, int port,
+                           bool reuse_port) {
   errno = 0;
-  if (!init(host, port) || !bindAndListen()) {
+  if (!init(host, port) || (reuse_port && SetReusePort(true) != 0) ||
+      !bindAndListen()) {
     Close();
     return false;
   }
@@ -126,11 +141,40 @@ int Socket::SetReuseAddr(bool reuse) {
                     sizeof(reuse_addr));
 }
 
+int Socket::SetReusePort(bool reuse) {
+  int reuse_port = reuse ? 1 : 0;
+  return setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &reuse_port,
+                    sizeof(reuse_port));
+}
+
 int Socket::SetKeepAlive(bool enable) {
   int on = enable ? 1 : 0;
   return setsockopt(fd_, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
 }
 
+int Socket::SetBusyPoll(int busy_poll_us) {
+  int ret = setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us,
+                       sizeof(busy_poll_us));
+#ifdef SO_PREFER_BUSY_POLL
+  if (ret == 0) {
+    int prefer = busy_poll_us > 0 ? 1 : 0;
+    ret = setsockopt(fd_, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                     sizeof(prefer));
+  }
+#endif
+  return ret;
+}
+
+int Socket::SetZeroCopy(bool enable) {
+#ifdef SO_ZEROCOPY
+  int on = enable ? 1 : 0;
+  return setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
 bool Socket::init(const std::string &host, int port) {
   port_ = port;
   if (host.empty()) {
@@ -190,32 +234,69 @@ bool Socket::bindAndListen() {
 
 bool Socket::Accept(Socket *new_socket) {
   DCHECK(new_socket != NULL);
-  errno = 0;
   SockAddr addr;
-  struct sockaddr *addr_ptr = reinterpret_cast<struct sockaddr *>(&addr);
-  socklen_t addr_len = static_cast<socklen_t>(sizeof(addr));
-  int new_fd = HANDLE_EINTR(accept(fd_, addr_ptr, &addr_len));
+  socklen_t addr_len;
+  int new_fd = acceptFD(&addr, &addr_len);
   if (new_fd < 0) {
-    setSocketError();
     return false;
   }
-  // DisableNagle(new_fd);
+  new_socket->setAccepted(new_fd, addr, addr_len);
+  return true;
+}
 
-  new_socket->fd_ = new_fd;
-  new_socket->addr_ = addr;
-  new_socket->addr_len_ = addr_len;
+std::unique_ptr<Socket> Socket::Accept() {
+  SockAddr addr;
+  socklen_t addr_len;
+  int new_fd = acceptFD(&addr, &addr_len);
+  if (new_fd < 0) {
+    return nullptr;
+  }
+  std::unique_ptr<Socket> new_socket(new Socket());
+  new_socket->setAccepted(new_fd, addr, addr_len);
+  return new_socket;
+}
+
+// static
+std::unique_ptr<Socket> Socket::Adopt(int fd) {
+  if (fd < 0) {
+    return nullptr;
+  }
+  SockAddr addr;
+  memset(&addr, 0, sizeof(addr));
+  socklen_t addr_len = static_cast<socklen_t>(sizeof(addr));
+  if (getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &addr_len) != 0) {
+    LOG(ERROR) << "getpeername " << safe_strerror(errno);
+  }
+  std::unique_ptr<Socket> new_socket(new Socket());
+  new_socket->setAccepted(fd, addr, addr_len);
+  return new_socket;
+}
+
+int Socket::acceptFD(SockAddr *addr, socklen_t *addr_len) {
+  errno = 0;
+  *addr_len = static_cast<socklen_t>(sizeof(*addr));
+  // Non-blocking from the start, which saves the two fcntl() calls of
+  // SetNonBlocking().
+  // The errors of accept() are those of the connection being accepted, or
+  // transient ones such as EMFILE, so unlike the other calls, a failure
+  // leaves the listening socket open.
+  return HANDLE_EINTR(accept4(fd_, reinterpret_cast<sockaddr *>(addr),
+                              addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC));
+}
+
+void Socket::setAccepted(int fd, const SockAddr &addr, socklen_t addr_len) {
+  fd_ = fd;
+  addr_ = addr;
+  addr_len_ = addr_len;
   if (addr_len == sizeof(addr.addr4)) {
-    new_socket->addr_ptr_ = reinterpret_cast<sockaddr *>(&addr_.addr4);
-    new_socket->port_ = ntohs(addr.addr4.sin_port);
-    new_socket->family_ = AF_INET;
+    addr_ptr_ = reinterpret_cast<sockaddr *>(&addr_.addr4);
+    port_ = ntohs(addr.addr4.sin_port);
+    family_ = AF_INET;
   } else if (addr_len == sizeof(addr.addr6)) {
-    new_socket->addr_ptr_ = reinterpret_cast<sockaddr *>(&addr_.addr6);
-    new_socket->port_ = ntohs(addr.addr6.sin6_port);
-    new_socket->family_ = AF_INET6;
+    addr_ptr_ = reinterpret_cast<sockaddr *>(&addr_.addr6);
+    port_ = ntohs(addr.addr6.sin6_port);
+    family_ = AF_INET6;
   }
-
-  if (!new_socket->SetNonBlocking()) return false;
-  return true;
 }
 
 bool Socket::connect() {
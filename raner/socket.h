@@ -11,6 +11,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -25,7 +26,10 @@ class Socket {
   Socket();
   ~Socket();
 
-  bool BindAndListen(const std::string &host, int port);
+  // With 'reuse_port', sets SO_REUSEPORT before binding, so that several
+  // sockets can listen on the same address and share its connections.
+  bool BindAndListen(const std::string &host, int port,
+                     bool reuse_port = false);
   bool Connect(const std::string &host, int port);
 
   void Shutdown();
@@ -36,7 +40,15 @@ class Socket {
 
   int fd() const { return fd_; }
 
+  // Accepts a connection, non-blocking and close-on-exec. Returns false, or
+  // nullptr, with errno set on failure, which includes EAGAIN when there is
+  // no connection to accept.
   bool Accept(Socket *new_socket);
+  std::unique_ptr<Socket> Accept();
+  // Takes over 'fd', a connection accepted elsewhere, such as by
+  // IOUringServer::Accept(). Returns nullptr, leaving errno alone, if 'fd'
+  // is negative.
+  static std::unique_ptr<Socket> Adopt(int fd);
 
   // Returns the port allocated to this socket or zero on error.
   int GetPort();
@@ -73,7 +85,15 @@ class Socket {
   bool SetNonBlocking();
   int SetTCPNoDelay();
   int SetReuseAddr(bool reuse);
+  int SetReusePort(bool reuse);
   int SetKeepAlive(bool enable);
+  // Sets SO_BUSY_POLL, and SO_PREFER_BUSY_POLL where the kernel has it, so
+  // that reads and epoll waits poll the device queue for up to busy_poll_us
+  // before sleeping. Values above net.core.busy_read need CAP_NET_ADMIN.
+  int SetBusyPoll(int busy_poll_us);
+  // Sets SO_ZEROCOPY, which sends with MSG_ZEROCOPY need. Fails with
+  // ENOPROTOOPT where the kernel or the headers lack it.
+  int SetZeroCopy(bool enable);
 
   std::string GetLocalAddr();
   std::string GetPeerAddr();
@@ -83,6 +103,9 @@ class Socket {
 
   static void CloseFD(int fd);
   static int DisableNagle(int socket);
+  // Returns the CPU that processed the last packets received on 'socket',
+  // from SO_INCOMING_CPU, or -1 if it is not known.
+  static int GetIncomingCPU(int socket);
 
  private:
   union SockAddr {
@@ -97,6 +120,10 @@ class Socket {
   bool bindAndListen();
   bool connect();
 
+  // Returns the accepted fd, or -1.
+  int acceptFD(SockAddr *addr, socklen_t *addr_len);
+  void setAccepted(int fd, const SockAddr &addr, socklen_t addr_len);
+
   bool resolve(const std::string &host);
   bool initInternal();
   void setSocketError();
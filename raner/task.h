@@ -0,0 +1,145 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_BASE_TASK_H_
+#define RANER_BASE_TASK_H_
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "raner/macros.h"
+
+namespace raner {
+
+// A move-only std::function<void()>, for callbacks which are run once and
+// never copied, such as those handed to EventLoop::QueueInLoop().
+//
+// std::function has to be copyable, and libstdc++ only stores callables of
+// up to 16 bytes in place, so binding a member function pointer and a
+// shared_ptr already costs an allocation. Task stores any nothrow-movable
+// callable of up to kInlineSize bytes in place instead, which is enough for
+// std::bind of a member function pointer, a shared_ptr and a std::string, and
+// only puts bigger callables on the heap.
+class Task {
+ public:
+  static constexpr size_t kInlineSize = 64;
+
+  Task() noexcept : ops_(nullptr) {}
+  Task(std::nullptr_t) noexcept : ops_(nullptr) {}  // NOLINT
+
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<F>::type, Task>::value>::type>
+  Task(F &&f) {  // NOLINT
+    typedef typename std::decay<F>::type Callable;
+    if constexpr (storedInline<Callable>()) {
+      new (storage()) Callable(std::forward<F>(f));
+      ops_ = &InlineOps<Callable>::kOps;
+    } else {
+      *static_cast<Callable **>(storage()) = new Callable(std::forward<F>(f));
+      ops_ = &HeapOps<Callable>::kOps;
+    }
+  }
+
+  Task(Task &&other) noexcept : ops_(other.ops_) {
+    if (ops_ != nullptr) {
+      ops_->relocate(storage(), other.storage());
+      other.ops_ = nullptr;
+    }
+  }
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.ops_ != nullptr) {
+        ops_ = other.ops_;
+        ops_->relocate(storage(), other.storage());
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Task &operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  ~Task() { reset(); }
+
+  void operator()() {
+    assert(ops_ != nullptr);
+    ops_->invoke(storage());
+  }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+  // Returns true if the callable lives inside the Task rather than on the
+  // heap.
+  bool is_inline() const { return ops_ != nullptr && ops_->is_inline; }
+
+ private:
+  struct Ops {
+    void (*invoke)(void *storage);
+    // Moves the callable from 'src' to 'dst', leaving 'src' empty.
+    void (*relocate)(void *dst, void *src);
+    void (*destroy)(void *storage);
+    bool is_inline;
+  };
+
+  // Callables with a stricter alignment (long double, SIMD types) go on the
+  // heap, which keeps sizeof(Task) at kInlineSize plus one pointer.
+  static constexpr size_t kInlineAlignment = alignof(void *);
+
+  template <typename F>
+  static constexpr bool storedInline() {
+    return sizeof(F) <= kInlineSize &&
+           alignof(F) <= kInlineAlignment &&
+           std::is_nothrow_move_constructible<F>::value;
+  }
+
+  template <typename F>
+  struct InlineOps {
+    static void Invoke(void *storage) { (*static_cast<F *>(storage))(); }
+    static void Relocate(void *dst, void *src) {
+      F *from = static_cast<F *>(src);
+      new (dst) F(std::move(*from));
+      from->~F();
+    }
+    static void Destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy, true};
+  };
+
+  template <typename F>
+  struct HeapOps {
+    static void Invoke(void *storage) { (**static_cast<F **>(storage))(); }
+    static void Relocate(void *dst, void *src) {
+      *static_cast<F **>(dst) = *static_cast<F **>(src);
+    }
+    static void Destroy(void *storage) { delete *static_cast<F **>(storage); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy, false};
+  };
+
+  void *storage() { return static_cast<void *>(storage_); }
+
+  void reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage());
+      ops_ = nullptr;
+    }
+  }
+
+  alignas(kInlineAlignment) unsigned char storage_[kInlineSize];
+  const Ops *ops_;
+
+  DISALLOW_COPY_AND_ASSIGN(Task);
+};
+
+}  // namespace raner
+
+#endif  // RANER_BASE_TASK_H_
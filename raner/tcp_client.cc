@@ -6,11 +6,12 @@
 
 #include <glog/logging.h>
 #include "raner/event_loop.h"
+#include "raner/event_loop_thread_pool.h"
 #include "raner/safe_strerror.h"
 #include "raner/socket.h"
 
-#include <stdio.h>  // snprintf
 #include <functional>
+#include <string>
 
 namespace {
 const int kEpollFlags = EPOLLOUT;
@@ -28,9 +29,12 @@ void removeConnection(EventLoop *loop, const TCPConnectionPtr &conn) {
 TCPClient::TCPClient(EventLoop *loop, std::string_view host, int port,
                      std::string_view name)
     : loop_(CHECK_NOTNULL(loop)),
+      thread_pool_(nullptr),
       host_(host),
       port_(port),
       name_(name),
+      conn_name_prefix_(std::make_shared<const std::string>(
+          name_ + ":" + host_ + ":" + std::to_string(port_))),
       connect_(false),
       state_(kDisconnected),
       retry_interval_ms_(kInitRetryIntervalMs),
@@ -51,10 +55,10 @@ TCPClient::~TCPClient() {
     conn = connection_;
   }
   if (conn) {
-    assert(loop_ == conn->GetLoop());
+    EventLoop* io_loop = conn->GetLoop();
     // FIXME: not 100% safe, if we are in different thread
-    CloseCallback cb = std::bind(&detail::removeConnection, loop_, _1);
-    loop_->RunInLoop(std::bind(&TCPConnection::SetCloseCallback, conn, cb));
+    CloseCallback cb = std::bind(&detail::removeConnection, io_loop, _1);
+    io_loop->RunInLoop(std::bind(&TCPConnection::SetCloseCallback, conn, cb));
     if (unique) {
       conn->ForceClose();
     }
@@ -142,7 +146,8 @@ void TCPClient::retry() {
       reconnect_timer_ =
           loop_->CreateTimer(std::bind(&TCPClient::Connect, this));
     }
-    reconnect_timer_->Update(Time::Now() + Duration(retry_interval_ms_ * 1000));
+    reconnect_timer_->Update(loop_->LoopTime() +
+                             Duration(retry_interval_ms_ * 1000));
     retry_interval_ms_ = std::min(retry_interval_ms_ * 2, kMaxRetryIntervalMs);
   } else {
     LOG(INFO) << "do not connect";
@@ -152,13 +157,12 @@ void TCPClient::retry() {
 void TCPClient::newConnection() {
   loop_->AssertInLoopThread();
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), ":%s:%u#%d", host_.c_str(), port_, next_conn_id_);
-  ++next_conn_id_;
-  std::string conn_name = name_ + buf;
-
-  TCPConnectionPtr conn(
-      new TCPConnection(loop_, conn_name, std::move(socket_)));
+  EventLoop* io_loop = thread_pool_ != nullptr
+                          ? thread_pool_->GetLoopForConnection(socket_->fd())
+                          : loop_;
+  TCPConnectionPtr conn(new TCPConnection(io_loop, next_conn_id_++,
+                                          conn_name_prefix_,
+                                          std::move(socket_)));
 
   conn->SetConnectionCallback(connection_callback_);
   conn->SetMessageCallback(message_callback_);
@@ -169,12 +173,12 @@ void TCPClient::newConnection() {
     std::lock_guard<std::mutex> lock(mutex_);
     connection_ = conn;
   }
-  conn->ConnectEstablished();
+  io_loop->RunInLoop(std::bind(&TCPConnection::ConnectEstablished, conn));
 }
 
 void TCPClient::removeConnection(const TCPConnectionPtr &conn) {
-  loop_->AssertInLoopThread();
-  assert(loop_ == conn->GetLoop());
+  EventLoop *io_loop = conn->GetLoop();
+  io_loop->AssertInLoopThread();
 
   {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -184,11 +188,11 @@ void TCPClient::removeConnection(const TCPConnectionPtr &conn) {
 
   LOG(INFO) << "TCPClient::removeConnection " << name_;
 
-  loop_->QueueInLoop(std::bind(&TCPConnection::ConnectDestroyed, conn));
+  io_loop->QueueInLoop(std::bind(&TCPConnection::ConnectDestroyed, conn));
   if (retry_ && connect_) {
     LOG(INFO) << "TCPClient::connect[" << name_ << "] - Reconnecting to "
               << host_ << ":" << port_;
-    restart();
+    loop_->RunInLoop(std::bind(&TCPClient::restart, this));  // FIXME: unsafe
   }
 }
 
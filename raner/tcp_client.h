@@ -10,11 +10,13 @@
 #include <mutex>
 #include <string_view>
 #include "raner/epoll_server.h"
+#include "raner/epoll_timer.h"
 #include "raner/tcp_connection.h"
 
 namespace raner {
 
 class EventLoop;
+class EventLoopThreadPool;
 
 class TCPClient : public std::enable_shared_from_this<TCPClient>,  // FIXME
                   public EpollCallbackInterface {
@@ -35,6 +37,11 @@ class TCPClient : public std::enable_shared_from_this<TCPClient>,  // FIXME
   }
 
   EventLoop* GetLoop() const { return loop_; }
+  /// Runs the I/O of each connection on a loop of 'pool', picked by its
+  /// placement policy once connected, instead of on the loop the client
+  /// connects from. 'pool' must be started on that loop, and outlive the
+  /// client. Not thread safe.
+  void SetThreadPool(EventLoopThreadPool* pool) { thread_pool_ = pool; }
   bool retry() const { return retry_; }
   void EnableRetry() { retry_ = true; }
 
@@ -75,7 +82,7 @@ class TCPClient : public std::enable_shared_from_this<TCPClient>,  // FIXME
 
   /// Not thread safe, but in loop
   void newConnection();
-  /// Not thread safe, but in loop
+  /// Not thread safe, but in the loop of the connection
   void removeConnection(const TCPConnectionPtr& conn);
 
   void setState(State s) { state_ = s; }
@@ -89,10 +96,13 @@ class TCPClient : public std::enable_shared_from_this<TCPClient>,  // FIXME
   void retry();
 
   EventLoop* loop_;  // not owned
+  EventLoopThreadPool* thread_pool_;  // not owned, may be null
 
   const std::string host_;
   int port_;
   const std::string name_;
+  // "<name>:<host>:<port>", shared by the connections for their Name().
+  const std::shared_ptr<const std::string> conn_name_prefix_;
   bool connect_;  // atomic
   State state_;
   int retry_interval_ms_;
@@ -105,7 +115,7 @@ class TCPClient : public std::enable_shared_from_this<TCPClient>,  // FIXME
   WriteCompleteCallback write_complete_callback_;
   bool retry_;  // atomic
   // always in loop thread
-  int next_conn_id_;
+  uint64_t next_conn_id_;
   mutable std::mutex mutex_;
   TCPConnectionPtr connection_;  // @GuardedBy mutex_
 
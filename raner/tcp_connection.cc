@@ -6,6 +6,7 @@
 
 #include <glog/logging.h>
 #include "raner/event_loop.h"
+#include "raner/io_uring_server.h"
 #include "raner/safe_strerror.h"
 #include "raner/socket.h"
 
@@ -13,6 +14,7 @@
 
 namespace {
 const int kEpollFlags = EPOLLIN;
+const int kEdgeTriggeredEpollFlags = EPOLLIN | EPOLLOUT | EPOLLET;
 }  // namespace
 
 namespace raner {
@@ -28,25 +30,52 @@ void defaultMessageCallback(const TCPConnectionPtr &, ByteBuffer *buf) {
   buf->SkipAll();
 }
 
-TCPConnection::TCPConnection(EventLoop *loop, const std::string &name,
+TCPConnection::TCPConnection(EventLoop *loop, uint64_t id,
+                             std::shared_ptr<const std::string> name_prefix,
                              std::unique_ptr<Socket> socket)
     : loop_(CHECK_NOTNULL(loop)),
-      name_(name),
+      id_(id),
+      name_prefix_(std::move(name_prefix)),
       state_(kConnecting),
       reading_(true),
+      edge_triggered_(false),
+      io_uring_(nullptr),
       socket_(std::move(socket)),
-      high_water_mark_(64 * 1024 * 1024) {
-  LOG(INFO) << "TCPConnection::ctor[" << name_ << "] at " << this
-            << " fd=" << socket_->fd();
+      high_water_mark_(64 * 1024 * 1024),
+      low_water_mark_(0),
+      above_high_water_mark_(false),
+      read_pauses_(0),
+      num_high_water_marks_(0),
+      num_low_water_marks_(0),
+      num_read_pauses_(0),
+      max_output_backlog_(0),
+      force_close_delay_timer_(std::bind(&TCPConnection::ForceClose, this)) {
+  VLOG(1) << "TCPConnection::ctor[" << Name() << "] at " << this
+          << " fd=" << socket_->fd();
   socket_->SetKeepAlive(true);
+  loop_->AddConnections(1);
 }
 
 TCPConnection::~TCPConnection() {
-  LOG(INFO) << "TCPConnection::dtor[" << name_ << "] at " << this
-            << " fd=" << socket_->fd() << " state=" << stateToString();
+  VLOG(1) << "TCPConnection::dtor[" << Name() << "] at " << this
+          << " fd=" << socket_->fd() << " state=" << stateToString();
   assert(state_ == kDisconnected);
 }
 
+bool TCPConnection::SetZeroCopyThreshold(size_t threshold) {
+  if (threshold > 0 && socket_->SetZeroCopy(true) != 0) {
+    LOG(WARNING) << "TCPConnection::SetZeroCopyThreshold [" << Name()
+                 << "] - SO_ZEROCOPY failed: " << safe_strerror(errno);
+    return false;
+  }
+  output_queue_.SetZeroCopyThreshold(threshold);
+  return true;
+}
+
+std::string TCPConnection::Name() const {
+  return *name_prefix_ + "#" + std::to_string(id_);
+}
+
 bool TCPConnection::GetTCPInfo(struct tcp_info *tcpi) const {
   return socket_->GetTCPInfo(tcpi);
 }
@@ -59,7 +88,16 @@ std::string TCPConnection::GetTCPInfoString() const {
 }
 
 void TCPConnection::Send(std::string &&message) {
-  Send(message.data(), static_cast<int>(message.size()));
+  if (state_ == kConnected) {
+    if (loop_->IsInLoopThread()) {
+      sendInLoop(std::move(message));
+    } else {
+      loop_->RunInLoop(
+          [self = shared_from_this(), message = std::move(message)]() mutable {
+            self->sendInLoop(std::move(message));
+          });
+    }
+  }
 }
 
 void TCPConnection::Send(const void *data, int len) {
@@ -71,30 +109,87 @@ void TCPConnection::Send(std::string_view message) {
     if (loop_->IsInLoopThread()) {
       sendInLoop(message);
     } else {
-      void (TCPConnection::*fp)(std::string_view message) =
-          &TCPConnection::sendInLoop;
-      loop_->RunInLoop(std::bind(fp,
-                                 this,  // FIXME
-                                 std::string(message)));
-      // std::forward<string>(message)));
+      // The one copy a borrowed message needs, to outlive the call.
+      Send(std::string(message));
     }
   }
 }
 
-// FIXME efficiency!!!
 void TCPConnection::Send(ByteBuffer *buf) {
   if (state_ == kConnected) {
     if (loop_->IsInLoopThread()) {
-      sendInLoop(buf->BeginRead(), buf->ReadableBytes());
-      buf->SkipAll();
+      sendInLoop(buf);
+    } else {
+      ByteBuffer message;
+      message.Swap(*buf);
+      loop_->RunInLoop(
+          [self = shared_from_this(), message = std::move(message)]() mutable {
+            self->sendInLoop(&message);
+          });
+    }
+  }
+}
+
+void TCPConnection::Send(const SharedPayload &message) {
+  if (state_ == kConnected) {
+    if (loop_->IsInLoopThread()) {
+      sendInLoop(message);
     } else {
-      void (TCPConnection::*fp)(std::string_view message) =
-          &TCPConnection::sendInLoop;
-      loop_->RunInLoop(std::bind(fp,
-                                 this,  // FIXME
-                                 buf->SkipAllAsString()));
-      // std::forward<std::string>(message)));
+      loop_->RunInLoop([self = shared_from_this(), message]() {
+        self->sendInLoop(message);
+      });
+    }
+  }
+}
+
+void TCPConnection::SendFile(int fd, off_t offset, size_t length) {
+  if (state_ == kConnected) {
+    SharedFile file = SharedFile::Dup(fd);
+    if (!file.valid()) {
+      LOG(ERROR) << "TCPConnection::SendFile errno:" << errno;
+      // The peer would get the bytes after the file in its place.
+      ForceClose();
+      return;
     }
+    SendFile(file, offset, length);
+  }
+}
+
+void TCPConnection::SendFile(const SharedFile &file, off_t offset,
+                             size_t length) {
+  if (state_ == kConnected) {
+    if (loop_->IsInLoopThread()) {
+      sendFileInLoop(file, offset, length);
+    } else {
+      loop_->RunInLoop([self = shared_from_this(), file, offset, length]() {
+        self->sendFileInLoop(file, offset, length);
+      });
+    }
+  }
+}
+
+void TCPConnection::sendInLoop(std::string &&message) {
+  loop_->AssertInLoopThread();
+  if (state_ == kDisconnected) {
+    LOG(WARNING) << "disConnected, give up writing";
+    return;
+  }
+  if (zeroCopies(message.size())) {
+    const bool idle = !isWriting() && output_queue_.Empty();
+    checkHighWaterMark(message.size());
+    output_queue_.Append(std::move(message));
+    writeQueued(idle);
+    return;
+  }
+  const ssize_t nwrote = writeDirectly(message.data(), message.size());
+  if (nwrote < 0) {
+    return;
+  }
+  const size_t offset = static_cast<size_t>(nwrote);
+  if (offset < message.size()) {
+    checkHighWaterMark(message.size() - offset);
+    output_queue_.Append(std::move(message), offset);
+    startWriting();
   }
 }
 
@@ -104,48 +199,252 @@ void TCPConnection::sendInLoop(std::string_view message) {
 
 void TCPConnection::sendInLoop(const void *data, size_t len) {
   loop_->AssertInLoopThread();
-  ssize_t nwrote = 0;
-  size_t remaining = len;
-  bool fault_error = false;
   if (state_ == kDisconnected) {
     LOG(WARNING) << "disConnected, give up writing";
     return;
   }
-  // if no thinoutput_buffer_g in output queue, try writing directly
-  if (!loop_->epoll_server()->HasRegisterWrite(socket_->fd()) &&
-      output_buffer_.ReadableBytes() == 0) {
-    nwrote = socket_->Write(data, len);
-    if (nwrote >= 0) {
-      remaining = len - nwrote;
-      if (remaining == 0 && write_complete_callback_) {
-        loop_->QueueInLoop(
-            std::bind(write_complete_callback_, shared_from_this()));
-      }
-    } else {  // nwrote < 0
-      nwrote = 0;
-      if (errno != EWOULDBLOCK) {
-        LOG(ERROR) << "TCPConnection::sendInLoop";
-        if (errno == EPIPE || errno == ECONNRESET)  // FIXME: any others?
-        {
-          fault_error = true;
-        }
-      }
+  const ssize_t nwrote = writeDirectly(data, len);
+  if (nwrote < 0) {
+    return;
+  }
+  const size_t remaining = len - static_cast<size_t>(nwrote);
+  if (remaining > 0) {
+    checkHighWaterMark(remaining);
+    output_queue_.Append(static_cast<const char *>(data) + nwrote, remaining);
+    startWriting();
+  }
+}
+
+void TCPConnection::sendInLoop(ByteBuffer *buf) {
+  loop_->AssertInLoopThread();
+  if (state_ == kDisconnected) {
+    LOG(WARNING) << "disConnected, give up writing";
+    buf->SkipAll();
+    return;
+  }
+  if (zeroCopies(buf->ReadableBytes())) {
+    const bool idle = !isWriting() && output_queue_.Empty();
+    checkHighWaterMark(buf->ReadableBytes());
+    output_queue_.Append(buf);
+    writeQueued(idle);
+    return;
+  }
+  const ssize_t nwrote = writeDirectly(buf->BeginRead(), buf->ReadableBytes());
+  if (nwrote < 0) {
+    buf->SkipAll();
+    return;
+  }
+  buf->SkipReadBytes(static_cast<size_t>(nwrote));
+  if (buf->ReadableBytes() > 0) {
+    checkHighWaterMark(buf->ReadableBytes());
+    output_queue_.Append(buf);
+    startWriting();
+  }
+}
+
+void TCPConnection::sendInLoop(const SharedPayload &message) {
+  loop_->AssertInLoopThread();
+  if (state_ == kDisconnected) {
+    LOG(WARNING) << "disConnected, give up writing";
+    return;
+  }
+  if (zeroCopies(message.size())) {
+    const bool idle = !isWriting() && output_queue_.Empty();
+    checkHighWaterMark(message.size());
+    output_queue_.Append(message);
+    writeQueued(idle);
+    return;
+  }
+  const ssize_t nwrote = writeDirectly(message.data(), message.size());
+  if (nwrote < 0) {
+    return;
+  }
+  const size_t offset = static_cast<size_t>(nwrote);
+  if (offset < message.size()) {
+    checkHighWaterMark(message.size() - offset);
+    output_queue_.Append(message, offset);
+    startWriting();
+  }
+}
+
+void TCPConnection::sendFileInLoop(const SharedFile &file, off_t offset,
+                                   size_t length) {
+  loop_->AssertInLoopThread();
+  if (state_ == kDisconnected) {
+    LOG(WARNING) << "disConnected, give up writing";
+    return;
+  }
+  if (length == 0) {
+    return;
+  }
+  const bool idle = !isWriting() && output_queue_.Empty();
+  checkHighWaterMark(length);
+  output_queue_.AppendFile(file, offset, length);
+  writeQueued(idle);
+}
+
+void TCPConnection::writeQueued(bool was_idle) {
+  if (!was_idle) {
+    startWriting();
+    return;
+  }
+  if (io_uring_ != nullptr && io_uring_->Send(socket_->fd(), output_queue_)) {
+    return;
+  }
+  int saved_errno = 0;
+  ssize_t n;
+  size_t max_bytes;
+  do {
+    max_bytes = output_queue_.MaxWriteFDBytes();
+    n = output_queue_.WriteFD(socket_->fd(), &saved_errno);
+  } while (n > 0 && !output_queue_.Empty() &&
+           static_cast<size_t>(n) == max_bytes);
+  checkLowWaterMark();
+  if (output_queue_.Empty()) {
+    if (write_complete_callback_) {
+      loop_->QueueInLoop(
+          std::bind(write_complete_callback_, shared_from_this()));
     }
+    return;
+  }
+  if (n < 0 && saved_errno != EAGAIN && saved_errno != EWOULDBLOCK) {
+    handleWriteError(saved_errno);
+    return;
   }
+  startWriting();
+}
 
-  assert(remaining <= len);
-  if (!fault_error && remaining > 0) {
-    size_t old_len = output_buffer_.ReadableBytes();
-    if (old_len + remaining >= high_water_mark_ && old_len < high_water_mark_ &&
-        high_water_mark_callback_) {
-      loop_->QueueInLoop(std::bind(high_water_mark_callback_,
-                                   shared_from_this(), old_len + remaining));
+ssize_t TCPConnection::writeDirectly(const void *data, size_t len) {
+  // if nothing in output queue, try writing directly
+  if (isWriting() || !output_queue_.Empty()) {
+    return 0;
+  }
+  if (io_uring_ != nullptr && !zeroCopies(len)) {
+    // Queued, for startWriting() to have io_uring_ send with the next wait.
+    return 0;
+  }
+  ssize_t nwrote = socket_->Write(data, len);
+  if (nwrote >= 0) {
+    if (static_cast<size_t>(nwrote) == len && write_complete_callback_) {
+      loop_->QueueInLoop(
+          std::bind(write_complete_callback_, shared_from_this()));
     }
-    output_buffer_.Write(static_cast<const char *>(data) + nwrote, remaining);
-    if (!loop_->epoll_server()->HasRegisterWrite(socket_->fd())) {
-      loop_->epoll_server()->StartWrite(socket_->fd());
+    return nwrote;
+  }
+  if (errno != EWOULDBLOCK) {
+    LOG(ERROR) << "TCPConnection::sendInLoop";
+    if (errno == EPIPE || errno == ECONNRESET)  // FIXME: any others?
+    {
+      return -1;
     }
   }
+  return 0;
+}
+
+void TCPConnection::checkHighWaterMark(size_t len) {
+  const size_t new_len = output_queue_.ReadableBytes() + len;
+  if (new_len > max_output_backlog_.load(std::memory_order_relaxed)) {
+    max_output_backlog_.store(new_len, std::memory_order_relaxed);
+  }
+  if (new_len >= high_water_mark_ && !above_high_water_mark_) {
+    above_high_water_mark_ = true;
+    num_high_water_marks_.fetch_add(1, std::memory_order_relaxed);
+    pauseUpstreams();
+    if (high_water_mark_callback_) {
+      loop_->QueueInLoop(
+          std::bind(high_water_mark_callback_, shared_from_this(), new_len));
+    }
+  }
+}
+
+void TCPConnection::checkLowWaterMark() {
+  const size_t len = output_queue_.ReadableBytes();
+  if (above_high_water_mark_ && len <= low_water_mark_) {
+    above_high_water_mark_ = false;
+    num_low_water_marks_.fetch_add(1, std::memory_order_relaxed);
+    resumeUpstreams();
+    if (low_water_mark_callback_) {
+      loop_->QueueInLoop(
+          std::bind(low_water_mark_callback_, shared_from_this(), len));
+    }
+  }
+}
+
+void TCPConnection::AddUpstream(const TCPConnectionPtr &upstream) {
+  loop_->RunInLoop([self = shared_from_this(), upstream]() {
+    self->upstreams_.push_back(upstream);
+    if (self->above_high_water_mark_) {
+      upstream->GetLoop()->RunInLoop(
+          [upstream]() { upstream->pauseReadingInLoop(); });
+    }
+  });
+}
+
+void TCPConnection::pauseUpstreams() {
+  for (const std::weak_ptr<TCPConnection> &weak : upstreams_) {
+    if (TCPConnectionPtr upstream = weak.lock()) {
+      upstream->GetLoop()->RunInLoop(
+          [upstream]() { upstream->pauseReadingInLoop(); });
+    }
+  }
+}
+
+void TCPConnection::resumeUpstreams() {
+  for (const std::weak_ptr<TCPConnection> &weak : upstreams_) {
+    if (TCPConnectionPtr upstream = weak.lock()) {
+      upstream->GetLoop()->RunInLoop(
+          [upstream]() { upstream->resumeReadingInLoop(); });
+    }
+  }
+}
+
+void TCPConnection::SetCloseHook(const void *key, const CloseHook &hook) {
+  loop_->AssertInLoopThread();
+  for (auto &entry : close_hooks_) {
+    if (entry.first == key) {
+      entry.second = hook;
+      return;
+    }
+  }
+  close_hooks_.emplace_back(key, hook);
+}
+
+void TCPConnection::RemoveCloseHook(const void *key) {
+  loop_->AssertInLoopThread();
+  for (auto it = close_hooks_.begin(); it != close_hooks_.end(); ++it) {
+    if (it->first == key) {
+      close_hooks_.erase(it);
+      return;
+    }
+  }
+}
+
+TCPConnection::FlowControlStats TCPConnection::GetFlowControlStats() const {
+  FlowControlStats stats;
+  stats.num_high_water_marks =
+      num_high_water_marks_.load(std::memory_order_relaxed);
+  stats.num_low_water_marks =
+      num_low_water_marks_.load(std::memory_order_relaxed);
+  stats.num_read_pauses = num_read_pauses_.load(std::memory_order_relaxed);
+  stats.max_output_backlog =
+      max_output_backlog_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void TCPConnection::startWriting() {
+  if (io_uring_ != nullptr &&
+      (io_uring_->IsSending(socket_->fd()) ||
+       io_uring_->Send(socket_->fd(), output_queue_))) {
+    // Its completion comes as EPOLLOUT.
+    return;
+  }
+  // In edge-triggered mode EPOLLOUT stays registered, and the short write
+  // that left bytes queued guarantees an edge once the socket is writable
+  // again.
+  if (!edge_triggered_ &&
+      !loop_->epoll_server()->HasRegisterWrite(socket_->fd())) {
+    loop_->epoll_server()->StartWrite(socket_->fd());
+  }
 }
 
 void TCPConnection::Shutdown() {
@@ -159,7 +458,7 @@ void TCPConnection::Shutdown() {
 
 void TCPConnection::shutdownInLoop() {
   loop_->AssertInLoopThread();
-  if (!loop_->epoll_server()->HasRegisterWrite(socket_->fd())) {
+  if (!isWriting()) {
     // we are not writing
     socket_->ShutdownWrite();
   }
@@ -175,16 +474,16 @@ void TCPConnection::ForceClose() {
 }
 
 void TCPConnection::ForceCloseWithDelay(double seconds) {
-  if (state_ == kConnected || state_ == kDisconnecting) {
-    setState(kDisconnecting);
-    force_close_delay_timer_ =
-        loop_->CreateTimer(std::bind(&TCPConnection::ForceClose, this));
-    force_close_delay_timer_->Update(
-        Time::Now() +
-        Duration(static_cast<int64_t>(
-            seconds * 1000 *
-            1000)));  // not forceCloseInLoop to avoid race condition
-  }
+  const Duration delay(
+      static_cast<int64_t>(seconds * Time::kMicrosecondsPerSecond));
+  // The wheel of the loop is only touched from its thread.
+  loop_->RunInLoop([self = shared_from_this(), delay]() {
+    if (self->state_ == kConnected || self->state_ == kDisconnecting) {
+      self->setState(kDisconnecting);
+      // ForceClose, not forceCloseInLoop, to avoid race condition.
+      self->loop_->RunAfterCoarse(delay, &self->force_close_delay_timer_);
+    }
+  });
 }
 
 void TCPConnection::forceCloseInLoop() {
@@ -195,6 +494,25 @@ void TCPConnection::forceCloseInLoop() {
   }
 }
 
+void TCPConnection::setState(State s) {
+  // Counted from the creation until the first disconnection, which every
+  // connection goes through before it is destroyed.
+  if (s == kDisconnected && state_ != kDisconnected) {
+    loop_->AddConnections(-1);
+    // The output backlog will never drain.
+    if (above_high_water_mark_) {
+      above_high_water_mark_ = false;
+      resumeUpstreams();
+    }
+    std::vector<std::pair<const void *, CloseHook>> hooks;
+    hooks.swap(close_hooks_);
+    for (const auto &entry : hooks) {
+      entry.second();
+    }
+  }
+  state_ = s;
+}
+
 const char *TCPConnection::stateToString() const {
   switch (state_) {
     case kDisconnected:
@@ -218,9 +536,15 @@ void TCPConnection::StartRead() {
 
 void TCPConnection::startReadInLoop() {
   loop_->AssertInLoopThread();
+  if (read_pauses_ > 0) {
+    // Resumed along with the last pause.
+    reading_ = true;
+    return;
+  }
   if (!reading_ || !loop_->epoll_server()->HasRegisterRead(socket_->fd())) {
     loop_->epoll_server()->StartRead(socket_->fd());
     reading_ = true;
+    rearmEdgeTriggeredRead();
   }
 }
 
@@ -236,11 +560,53 @@ void TCPConnection::stopReadInLoop() {
   }
 }
 
+void TCPConnection::pauseReadingInLoop() {
+  loop_->AssertInLoopThread();
+  if (read_pauses_++ == 0) {
+    num_read_pauses_.fetch_add(1, std::memory_order_relaxed);
+    if (state_ != kDisconnected && reading_) {
+      loop_->epoll_server()->StopRead(socket_->fd());
+    }
+  }
+}
+
+void TCPConnection::resumeReadingInLoop() {
+  loop_->AssertInLoopThread();
+  assert(read_pauses_ > 0);
+  if (--read_pauses_ == 0 && state_ != kDisconnected && reading_) {
+    loop_->epoll_server()->StartRead(socket_->fd());
+    rearmEdgeTriggeredRead();
+  }
+}
+
+void TCPConnection::rearmEdgeTriggeredRead() {
+  if (!edge_triggered_) {
+    return;
+  }
+  // handleRead() drops the edges it gets while not reading, and one may
+  // have come since the data left was last read. Fake it instead of
+  // counting on epoll to raise it again. SetFDReady() replaces the events
+  // faked so far, so keep a pending EPOLLOUT; handleWrite() does nothing
+  // with an empty queue.
+  int events = EPOLLIN;
+  if (!output_queue_.Empty()) {
+    events |= EPOLLOUT;
+  }
+  loop_->epoll_server()->SetFDReady(socket_->fd(), events);
+}
+
 void TCPConnection::ConnectEstablished() {
   loop_->AssertInLoopThread();
   assert(state_ == kConnecting);
   setState(kConnected);
-  loop_->epoll_server()->RegisterFD(socket_->fd(), this, kEpollFlags);
+  loop_->epoll_server()->RegisterFD(
+      socket_->fd(), this,
+      edge_triggered_ ? kEdgeTriggeredEpollFlags : kEpollFlags);
+  io_uring_ = loop_->io_uring_server();
+  if (io_uring_ != nullptr) {
+    // Or the socket is read, where the kernel lacks it.
+    io_uring_->SetMultishotRecv(socket_->fd());
+  }
 
   connection_callback_(shared_from_this());
 }
@@ -260,40 +626,138 @@ void TCPConnection::OnEvent(int fd, EpollEvent *event) {
 
   event->out_ready_mask = 0;
 
-  if (event->in_events & EPOLLIN) {
-    handleRead();
+  if ((event->in_events & EPOLLIN) && handleRead()) {
+    event->out_ready_mask |= EPOLLIN;
   }
-  if (event->in_events & EPOLLOUT) {
-    handleWrite();
+  if ((event->in_events & EPOLLOUT) && state_ != kDisconnected &&
+      handleWrite()) {
+    event->out_ready_mask |= EPOLLOUT;
   }
   if (event->in_events & EPOLLERR) {
     handleError();
   }
 }
 
-void TCPConnection::handleRead() {
+bool TCPConnection::handleRead() {
   loop_->AssertInLoopThread();
-  int saved_errno = 0;
-  ssize_t n = input_buffer_.ReadFD(socket_->fd(), &saved_errno);
-  if (n > 0) {
+  if (!edge_triggered_) {
+    int saved_errno = 0;
+    ssize_t n = readInput(&saved_errno);
+    if (n > 0) {
+      message_callback_(shared_from_this(), &input_buffer_);
+      reclaimInput();
+    } else if (n == 0) {
+      handleClose();
+    } else {
+      errno = saved_errno;
+      LOG(ERROR) << "TCPConnection::handleRead errno:" << errno;
+      handleError();
+    }
+    return false;
+  }
+
+  if (!reading_ || read_pauses_ > 0) {
+    // The next StartRead(), or the last resume, fakes EPOLLIN to read the
+    // data left; see rearmEdgeTriggeredRead().
+    return false;
+  }
+  size_t total = 0;
+  bool drained = false;
+  bool closed = false;
+  while (total < kEdgeTriggeredIOBudget) {
+    const size_t max_bytes = input_buffer_.MaxReadFDBytes();
+    int saved_errno = 0;
+    ssize_t n = readInput(&saved_errno);
+    if (n > 0) {
+      total += static_cast<size_t>(n);
+      if (static_cast<size_t>(n) < max_bytes) {
+        // A short read emptied the socket; the next data raises a new edge.
+        drained = true;
+        break;
+      }
+    } else if (n == 0) {
+      closed = true;
+      break;
+    } else {
+      drained = true;
+      if (saved_errno != EAGAIN && saved_errno != EWOULDBLOCK &&
+          saved_errno != EINTR) {
+        errno = saved_errno;
+        LOG(ERROR) << "TCPConnection::handleRead errno:" << errno;
+        handleError();
+      }
+      break;
+    }
+  }
+  if (total > 0) {
     message_callback_(shared_from_this(), &input_buffer_);
-  } else if (n == 0) {
+    reclaimInput();
+  }
+  if (closed && state_ != kDisconnected) {
     handleClose();
-  } else {
-    errno = saved_errno;
-    LOG(ERROR) << "TCPConnection::handleRead errno:" << errno;
-    handleError();
+  }
+  return !drained && !closed && state_ != kDisconnected;
+}
+
+ssize_t TCPConnection::readInput(int *saved_errno) {
+  if (io_uring_ != nullptr) {
+    return io_uring_->Receive(socket_->fd(), &input_buffer_, saved_errno);
+  }
+  return input_buffer_.ReadFD(socket_->fd(), saved_errno);
+}
+
+void TCPConnection::reclaimInput() {
+  if (io_uring_ != nullptr) {
+    io_uring_->Reclaim(socket_->fd(), &input_buffer_);
   }
 }
 
-void TCPConnection::handleWrite() {
+bool TCPConnection::handleWrite() {
   loop_->AssertInLoopThread();
+  if (io_uring_ != nullptr && io_uring_->IsSending(socket_->fd())) {
+    handleSent();
+    return false;
+  }
+  if (edge_triggered_) {
+    size_t total = 0;
+    while (!output_queue_.Empty() && total < kEdgeTriggeredIOBudget) {
+      const size_t max_bytes = output_queue_.MaxWriteFDBytes();
+      int saved_errno = 0;
+      ssize_t n = output_queue_.WriteFD(socket_->fd(), &saved_errno);
+      if (n <= 0) {
+        if (n < 0 && saved_errno != EAGAIN && saved_errno != EWOULDBLOCK) {
+          handleWriteError(saved_errno);
+        }
+        return false;
+      }
+      total += static_cast<size_t>(n);
+      checkLowWaterMark();
+      if (static_cast<size_t>(n) < max_bytes) {
+        // The socket buffer is full; wait for the next EPOLLOUT edge.
+        return false;
+      }
+    }
+    if (!output_queue_.Empty()) {
+      return true;
+    }
+    if (total > 0) {
+      if (write_complete_callback_) {
+        loop_->QueueInLoop(
+            std::bind(write_complete_callback_, shared_from_this()));
+      }
+      if (state_ == kDisconnecting) {
+        shutdownInLoop();
+      }
+    }
+    return false;
+  }
+
   if (loop_->epoll_server()->HasRegisterWrite(socket_->fd())) {
-    ssize_t n = socket_->Write(output_buffer_.BeginRead(),
-                               output_buffer_.ReadableBytes());
+    int saved_errno = 0;
+    ssize_t n = output_queue_.WriteFD(socket_->fd(), &saved_errno);
     if (n > 0) {
-      output_buffer_.SkipReadBytes(n);
-      if (output_buffer_.ReadableBytes() == 0) {
+      checkLowWaterMark();
+      if (output_queue_.Empty()) {
         loop_->epoll_server()->StopWrite(socket_->fd());
         if (write_complete_callback_) {
           loop_->QueueInLoop(
@@ -304,7 +768,7 @@ void TCPConnection::handleWrite() {
         }
       }
     } else {
-      LOG(ERROR) << "TCPConnection::handleWrite";
+      handleWriteError(saved_errno);
       // if (state_ == kDisconnecting)
       // {
       //   shutdownInLoop();
@@ -314,11 +778,58 @@ void TCPConnection::handleWrite() {
     LOG(INFO) << "Connection fd = " << socket_->fd()
               << " is down, no more writing";
   }
+  return false;
+}
+
+void TCPConnection::handleSent() {
+  int saved_errno = 0;
+  const ssize_t n = io_uring_->TakeSent(socket_->fd(), &saved_errno);
+  if (n < 0) {
+    // EAGAIN for an edge of EPOLLOUT before the completion.
+    if (saved_errno != EAGAIN) {
+      handleWriteError(saved_errno);
+    }
+    return;
+  }
+  output_queue_.Skip(static_cast<size_t>(n));
+  checkLowWaterMark();
+  if (!output_queue_.Empty()) {
+    // The rest, and what was queued meanwhile.
+    writeQueued(true);
+  } else if (write_complete_callback_) {
+    loop_->QueueInLoop(
+        std::bind(write_complete_callback_, shared_from_this()));
+  }
+  if (output_queue_.Empty()) {
+    if (!edge_triggered_ &&
+        loop_->epoll_server()->HasRegisterWrite(socket_->fd())) {
+      loop_->epoll_server()->StopWrite(socket_->fd());
+    }
+    if (state_ == kDisconnecting) {
+      shutdownInLoop();
+    }
+  }
+}
+
+void TCPConnection::handleWriteError(int saved_errno) {
+  LOG(ERROR) << "TCPConnection::handleWrite errno:" << saved_errno;
+  if (saved_errno == ENODATA) {
+    // A file queued by SendFile() shrank, and the bytes after it cannot be
+    // sent in its place. Other errors come with EPOLLERR or EPOLLHUP.
+    ForceClose();
+  }
+}
+
+bool TCPConnection::isWriting() const {
+  if (edge_triggered_ || io_uring_ != nullptr) {
+    return !output_queue_.Empty();
+  }
+  return loop_->epoll_server()->HasRegisterWrite(socket_->fd());
 }
 
 void TCPConnection::handleClose() {
   loop_->AssertInLoopThread();
-  LOG(INFO) << "fd = " << socket_->fd() << " state = " << stateToString();
+  VLOG(1) << "fd = " << socket_->fd() << " state = " << stateToString();
   assert(state_ == kConnected || state_ == kDisconnecting);
   // we don't close fd, leave it to dtor, so we can find leaks easily.
   setState(kDisconnected);
@@ -329,12 +840,23 @@ void TCPConnection::handleClose() {
   // must be the last line
   close_callback_(guard_this);
 
-  LOG(INFO) << "Connection handleClose " << socket_->fd();
+  VLOG(1) << "Connection handleClose " << socket_->fd();
 }
 
 void TCPConnection::handleError() {
+  int num_completions = 0;
+  if (output_queue_.NumPinnedSends() > 0) {
+    // EPOLLERR also reports zerocopy completions on the error queue, which
+    // must be read for it to go.
+    int saved_errno = 0;
+    num_completions =
+        output_queue_.ReadZeroCopyCompletions(socket_->fd(), &saved_errno);
+  }
   int err = socket_->GetSocketError();
-  LOG(ERROR) << "TCPConnection::handleError [" << name_
+  if (err == 0 && num_completions > 0) {
+    return;
+  }
+  LOG(ERROR) << "TCPConnection::handleError [" << Name()
              << "] - SO_ERROR = " << err << " " << safe_strerror(err);
 }
 
@@ -8,11 +8,17 @@
 #include "raner/byte_buffer.h"
 #include "raner/callbacks.h"
 #include "raner/epoll_server.h"
-#include "raner/epoll_timer.h"
+#include "raner/output_queue.h"
+#include "raner/shared_file.h"
+#include "raner/shared_payload.h"
 #include "raner/socket.h"
+#include "raner/timing_wheel.h"
 
 #include <any>
+#include <atomic>
 #include <memory>
+#include <utility>
+#include <vector>
 
 // struct tcp_info is in <netinet/tcp.h>
 struct tcp_info;
@@ -20,16 +26,21 @@ struct tcp_info;
 namespace raner {
 
 class EventLoop;
+class IOUringServer;
 class Socket;
 
 class TCPConnection : public EpollCallbackInterface,
                       public std::enable_shared_from_this<TCPConnection> {
  public:
-  TCPConnection(EventLoop* loop, const std::string& name,
+  // 'id' identifies the connection among those sharing 'name_prefix',
+  // which is only read to build Name(), for logs.
+  TCPConnection(EventLoop* loop, uint64_t id,
+                std::shared_ptr<const std::string> name_prefix,
                 std::unique_ptr<Socket> socket);
   ~TCPConnection();
 
   EventLoop* GetLoop() const { return loop_; }
+  uint64_t id() const { return id_; }
   bool Connected() const { return state_ == kConnected; }
   bool Disconnected() const { return state_ == kDisconnected; }
 
@@ -37,16 +48,60 @@ class TCPConnection : public EpollCallbackInterface,
   bool GetTCPInfo(struct tcp_info*) const;
   std::string GetTCPInfoString() const;
 
-  void Send(std::string&& message);  // C++11
+  // Takes 'message' over: what cannot be written right away is queued as
+  // is, also when it is handed over from another thread.
+  void Send(std::string&& message);
+  // Copies what cannot be written right away, or, from another thread,
+  // the whole message, once.
   void Send(const void* message, int len);
   void Send(std::string_view message);
-  void Send(ByteBuffer* message);  // this one will swap data
+  // Takes the readable bytes of 'message' over, like Send(std::string&&),
+  // and leaves it empty.
+  void Send(ByteBuffer* message);
+  // Queues a reference to the bytes of 'message', never a copy, so that
+  // one payload can be sent to many connections.
+  void Send(const SharedPayload& message);
+  // Sends 'length' bytes of the file 'fd' starting at 'offset' with
+  // sendfile(2), in order with the other sends, without reading them into
+  // memory. 'fd' is duplicated, so the caller may close it right away. The
+  // file must not shrink before it is sent: the connection is closed if it
+  // does.
+  void SendFile(int fd, off_t offset, size_t length);
+  void SendFile(const SharedFile& file, off_t offset, size_t length);
   void Shutdown();                 // NOT thread safe, no simultaneous calling
   // void shutdownAndForceCloseAfter(double seconds); // NOT thread safe, no
   // simultaneous calling
   void ForceClose();
+  // Thread safe.
   void ForceCloseWithDelay(double seconds);
   void SetTCPNoDelay();
+
+  // Registers the socket for EPOLLIN | EPOLLOUT | EPOLLET once, instead of
+  // level-triggered EPOLLIN with EPOLLOUT added and removed around every
+  // write that does not complete. Each event then reads, or writes, until
+  // the socket would block or kEdgeTriggeredIOBudget bytes have moved;
+  // a socket with more to do goes back on the ready list behind the others.
+  // Must be called before the connection is established.
+  void SetEdgeTriggered(bool on) {
+    assert(state_ == kConnecting);
+    edge_triggered_ = on;
+  }
+  bool IsEdgeTriggered() const { return edge_triggered_; }
+
+  // Sends each write of at least 'threshold' bytes from memory with
+  // MSG_ZEROCOPY, so that the kernel reads the buffers in place instead of
+  // copying them; 0, the default, never does. Messages taken over, by
+  // Send(std::string&&), Send(ByteBuffer*) and Send(const SharedPayload&),
+  // are then queued whole rather than written right away with a copy, and
+  // stay referenced until the kernel reports the send complete. Under some
+  // 10 KB the pinning costs more than the copy; 64 KB is a fair start.
+  // Returns false, leaving it off, if the socket does not support it.
+  // NOT thread safe: call it before the connection is established, or in
+  // its loop.
+  bool SetZeroCopyThreshold(size_t threshold);
+
+  static constexpr size_t kEdgeTriggeredIOBudget = 256 * 1024;
+
   // reading or not
   void StartRead();
   void StopRead();
@@ -70,16 +125,56 @@ class TCPConnection : public EpollCallbackInterface,
     write_complete_callback_ = cb;
   }
 
+  // Called once the output backlog reaches 'high_water_mark', 64 MB by
+  // default, and not again until it has drained back to the low water mark.
   void SetHighWaterMarkCallback(const HighWaterMarkCallback& cb,
                                 size_t high_water_mark) {
     high_water_mark_callback_ = cb;
     high_water_mark_ = high_water_mark;
   }
 
+  // Called once the output backlog, having reached the high water mark,
+  // drains back to 'low_water_mark', 0 by default. Either callback may be
+  // empty, to only set the mark.
+  void SetLowWaterMarkCallback(const LowWaterMarkCallback& cb,
+                               size_t low_water_mark) {
+    low_water_mark_callback_ = cb;
+    low_water_mark_ = low_water_mark;
+  }
+
+  // Backpressure: stops reading from 'upstream', typically the connection
+  // whose input this one forwards, from when the output backlog of this
+  // connection reaches the high water mark until it drains back to the low
+  // one, or the connection closes. An upstream paused by several
+  // connections reads again once none of them holds it. Thread safe.
+  void AddUpstream(const TCPConnectionPtr& upstream);
+
+  // Calls 'hook' in the loop when the connection is disconnected, in place
+  // of the hook set before with the same 'key', for the objects which keep
+  // track of connections, such as a BroadcastGroup. The hooks run before
+  // the connection callback, possibly from within another call on the
+  // connection, so a hook should only queue its work. NOT thread safe:
+  // call it in the loop.
+  void SetCloseHook(const void* key, const CloseHook& hook);
+  void RemoveCloseHook(const void* key);
+
+  struct FlowControlStats {
+    // Times the output backlog reached the high water mark, and drained
+    // back to the low one.
+    uint64_t num_high_water_marks;
+    uint64_t num_low_water_marks;
+    // Times the connections this one is an upstream of paused its reading.
+    uint64_t num_read_pauses;
+    // The largest output backlog so far.
+    size_t max_output_backlog;
+  };
+  // Thread safe.
+  FlowControlStats GetFlowControlStats() const;
+
   /// Advanced interface
   ByteBuffer* input_buffer() { return &input_buffer_; }
 
-  ByteBuffer* output_buffer() { return &output_buffer_; }
+  OutputQueue* output_queue() { return &output_queue_; }
 
   /// Internal use only.
   void SetCloseCallback(const CloseCallback& cb) { close_callback_ = cb; }
@@ -98,42 +193,104 @@ class TCPConnection : public EpollCallbackInterface,
   void OnEvent(int fd, EpollEvent* event) override;
   void OnUnregistration(int fd, bool replaced) override {}
   void OnShutdown(EpollServer* eps, int fd) override {}
-  std::string Name() const override { return name_; }
+  // Builds "<name_prefix>#<id>" on each call; meant for logs, not as a key.
+  std::string Name() const override;
 
  private:
   enum State { kDisconnected, kConnecting, kConnected, kDisconnecting };
-  void handleRead();
-  void handleWrite();
+  // Both return true if, in edge-triggered mode, the budget ran out before
+  // the socket would block, so that the event has to be handled again.
+  bool handleRead();
+  bool handleWrite();
+  // Reads the socket into input_buffer_, as ByteBuffer::ReadFD() does, or
+  // takes what the multishot recv of io_uring_ got.
+  ssize_t readInput(int* saved_errno);
+  // Once the message callback has run, copies what it left of the input
+  // io_uring_ lent, and gives the buffer back.
+  void reclaimInput();
+  // Takes the result of the send of io_uring_, and sends what is left.
+  void handleSent();
+  // Logs a failed write, and closes the connection if it cannot go on.
+  void handleWriteError(int saved_errno);
+  // True if there is output waiting for the socket to become writable.
+  bool isWriting() const;
   void handleClose();
   void handleError();
   void sendInLoop(std::string&& message);
   void sendInLoop(std::string_view message);
   void sendInLoop(const void* message, size_t len);
+  void sendInLoop(ByteBuffer* message);
+  void sendInLoop(const SharedPayload& message);
+  void sendFileInLoop(const SharedFile& file, off_t offset, size_t length);
+  // With nothing queued, writes what the socket takes of 'message' right
+  // away. Returns the number of bytes written, or -1 on a fatal error.
+  ssize_t writeDirectly(const void* message, size_t len);
+  // True if 'len' bytes taken over are to be queued and sent with
+  // MSG_ZEROCOPY rather than written right away.
+  bool zeroCopies(size_t len) const {
+    return output_queue_.zerocopy_threshold() > 0 &&
+           len >= output_queue_.zerocopy_threshold();
+  }
+  // If nothing was queued before the last append, writes what the socket
+  // takes of the queue right away, as writeDirectly() does; otherwise, or
+  // for what is left, waits for the socket to be writable.
+  void writeQueued(bool was_idle);
+  // Checks the high water mark for 'len' more bytes, about to be queued.
+  void checkHighWaterMark(size_t len);
+  // Checks the low water mark after a write from the queue.
+  void checkLowWaterMark();
+  // Pause or resume reading from the upstreams, in their loops.
+  void pauseUpstreams();
+  void resumeUpstreams();
+  // Nested: reading stays stopped until each pause is resumed.
+  void pauseReadingInLoop();
+  void resumeReadingInLoop();
+  // Once reading restarts, reads the data which arrived while it was
+  // stopped.
+  void rearmEdgeTriggeredRead();
+  void startWriting();
   void shutdownInLoop();
   // void shutdownAndForceCloseInLoop(double seconds);
   void forceCloseInLoop();
-  void setState(State s) { state_ = s; }
+  void setState(State s);
   const char* stateToString() const;
   void startReadInLoop();
   void stopReadInLoop();
 
   EventLoop* loop_;
-  const std::string name_;
+  const uint64_t id_;
+  const std::shared_ptr<const std::string> name_prefix_;
   State state_;  // FIXME: use atomic variable
   bool reading_;
+  bool edge_triggered_;
+  // The poller of loop_ if it is an io_uring, which sends for the socket,
+  // and receives for it too where the kernel can; or nullptr.
+  IOUringServer* io_uring_;
   // we don't expose those classes to client.
   std::unique_ptr<Socket> socket_;
   ConnectionCallback connection_callback_;
   MessageCallback message_callback_;
   WriteCompleteCallback write_complete_callback_;
   HighWaterMarkCallback high_water_mark_callback_;
+  LowWaterMarkCallback low_water_mark_callback_;
   CloseCallback close_callback_;
   size_t high_water_mark_;
+  size_t low_water_mark_;
+  // Between reaching the high water mark and draining to the low one.
+  bool above_high_water_mark_;
+  std::vector<std::weak_ptr<TCPConnection>> upstreams_;
+  std::vector<std::pair<const void*, CloseHook>> close_hooks_;
+  // Pauses held by the connections this one is an upstream of.
+  int read_pauses_;
+  std::atomic<uint64_t> num_high_water_marks_;
+  std::atomic<uint64_t> num_low_water_marks_;
+  std::atomic<uint64_t> num_read_pauses_;
+  std::atomic<size_t> max_output_backlog_;
   ByteBuffer input_buffer_;
-  ByteBuffer output_buffer_;  // FIXME: use list<ByteBuffer> as output buffer.
+  OutputQueue output_queue_;
   std::any context_;
 
-  std::unique_ptr<EpollTimer> force_close_delay_timer_;
+  CoarseTimer force_close_delay_timer_;
 
   DISALLOW_COPY_AND_ASSIGN(TCPConnection);
 };
@@ -7,9 +7,13 @@
 #include <glog/logging.h>
 #include "raner/event_loop.h"
 #include "raner/event_loop_thread_pool.h"
+#include "raner/io_uring_server.h"
+#include "raner/safe_strerror.h"
 #include "raner/socket.h"
 
-#include <stdio.h>  // snprintf
+#include <errno.h>
+
+#include <future>
 
 namespace {
 const int kEpollFlags = EPOLLIN;
@@ -17,17 +21,167 @@ const int kEpollFlags = EPOLLIN;
 
 namespace raner {
 
+constexpr int TCPServer::kDefaultAcceptBatch;
+
+namespace {
+
+// Accepts one connection on 'listen_socket', or takes one the multishot
+// accept of 'io_uring' got, if not null; or returns nullptr. On EMFILE, the
+// pending connection is accepted and closed through 'idle_fd', an fd kept
+// open for the purpose, so that it is not reported again and again; read
+// the section named "The special problem of accept()ing when you can't" in
+// libev's doc, by Marc Lehmann, author of libev.
+std::unique_ptr<Socket> acceptOrShed(Socket *listen_socket,
+                                     IOUringServer *io_uring, int *idle_fd) {
+  std::unique_ptr<Socket> client_socket =
+      io_uring != nullptr ? Socket::Adopt(io_uring->Accept(listen_socket->fd()))
+                          : listen_socket->Accept();
+  if (client_socket || errno == EAGAIN || errno == EWOULDBLOCK) {
+    return client_socket;
+  }
+  LOG(ERROR) << "accept on fd " << listen_socket->fd() << ": "
+             << safe_strerror(errno);
+  if (errno == EMFILE) {
+    ::close(*idle_fd);
+    *idle_fd = ::accept(listen_socket->fd(), NULL, NULL);
+    ::close(*idle_fd);
+    *idle_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+// The connections of one I/O loop, keyed by their id. Connections are
+// added, removed and destroyed in that loop, so that neither accepting nor
+// closing one takes a lock or a hop to another loop.
+class TCPServer::ConnectionRegistry {
+ public:
+  explicit ConnectionRegistry(EventLoop *loop) : loop_(loop) {}
+
+  EventLoop *loop() const { return loop_; }
+
+  // Registers 'conn' and establishes it.
+  void Add(const TCPConnectionPtr &conn) {
+    loop_->AssertInLoopThread();
+    conn->SetCloseCallback(
+        std::bind(&ConnectionRegistry::Remove, this, _1));  // FIXME: unsafe
+    bool inserted = connections_.emplace(conn->id(), conn).second;
+    (void)inserted;
+    assert(inserted);
+    conn->ConnectEstablished();
+  }
+
+  // Destroys the connections left.
+  void DestroyAll() {
+    loop_->AssertInLoopThread();
+    for (auto &item : connections_) {
+      TCPConnectionPtr conn(std::move(item.second));
+      conn->ConnectDestroyed();
+    }
+    connections_.clear();
+  }
+
+ private:
+  void Remove(const TCPConnectionPtr &conn) {
+    loop_->AssertInLoopThread();
+    VLOG(1) << "TCPServer::ConnectionRegistry::Remove - connection "
+            << conn->id();
+    size_t n = connections_.erase(conn->id());
+    (void)n;
+    assert(n == 1);
+    loop_->QueueInLoop(std::bind(&TCPConnection::ConnectDestroyed, conn));
+  }
+
+  EventLoop *loop_;
+  std::unordered_map<uint64_t, TCPConnectionPtr> connections_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionRegistry);
+};
+
+// The listening socket of one I/O loop in reuse-port mode; the connections
+// accepted on it stay on that loop.
+class TCPServer::Acceptor : public EpollCallbackInterface {
+ public:
+  Acceptor(TCPServer *server, ConnectionRegistry *registry,
+           std::unique_ptr<Socket> socket)
+      : server_(server),
+        registry_(registry),
+        loop_(registry->loop()),
+        socket_(std::move(socket)),
+        idle_fd_(::open("/dev/null", O_RDONLY | O_CLOEXEC)) {
+    assert(idle_fd_ >= 0);
+  }
+
+  ~Acceptor() override { ::close(idle_fd_); }
+
+  EventLoop *loop() const { return loop_; }
+
+  void Listen() {
+    loop_->AssertInLoopThread();
+    loop_->epoll_server()->RegisterFD(socket_->fd(), this, kEpollFlags);
+    if (IOUringServer *io_uring = loop_->io_uring_server()) {
+      io_uring->SetMultishotAccept(socket_->fd());
+    }
+  }
+
+  void Stop() {
+    loop_->AssertInLoopThread();
+    loop_->epoll_server()->UnregisterFD(socket_->fd());
+  }
+
+  // From EpollCallbackInterface
+  void OnRegistration(EpollServer *eps, int fd, int event_mask) override {}
+  void OnModification(int fd, int event_mask) override {}
+  void OnEvent(int fd, EpollEvent *event) override {
+    loop_->AssertInLoopThread();
+    if (event->in_events & EPOLLIN) {
+      for (int i = 0; i < server_->accept_batch_; ++i) {
+        std::unique_ptr<Socket> client_socket = acceptOrShed(
+            socket_.get(), loop_->io_uring_server(), &idle_fd_);
+        if (!client_socket) {
+          break;
+        }
+        registry_->Add(
+            server_->createConnection(loop_, std::move(client_socket)));
+      }
+    }
+    if (event->in_events & EPOLLERR) {
+      LOG(INFO) << "OnEvent EPOLLERR fd:" << fd;
+    }
+  }
+  void OnUnregistration(int fd, bool replaced) override {}
+  void OnShutdown(EpollServer *eps, int fd) override {}
+  std::string Name() const override { return server_->Name(); }
+
+ private:
+  TCPServer *server_;
+  ConnectionRegistry *registry_;
+  EventLoop *loop_;
+  std::unique_ptr<Socket> socket_;
+  int idle_fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(Acceptor);
+};
+
 TCPServer::TCPServer(EventLoop *loop, std::string_view host, int port,
                      std::string_view name)
     : loop_(CHECK_NOTNULL(loop)),
       host_(host),
       port_(port),
       name_(name),
+      conn_name_prefix_(std::make_shared<const std::string>(
+          name_ + "-" + host_ + ":" + std::to_string(port_))),
       listenning_(false),
       idle_fd_(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
       thread_pool_(new EventLoopThreadPool(loop, name_)),
       connection_callback_(defaultConnectionCallback),
       message_callback_(defaultMessageCallback),
+      edge_triggered_(false),
+      busy_poll_us_(0),
+      zerocopy_threshold_(0),
+      reuse_port_(false),
+      accept_batch_(kDefaultAcceptBatch),
       started_(0),
       next_conn_id_(1) {
   assert(idle_fd_ >= 0);
@@ -37,14 +191,29 @@ TCPServer::~TCPServer() {
   loop_->AssertInLoopThread();
   LOG(INFO) << "TCPServer::~TCPServer [" << name_ << "] destructing";
 
-  for (auto &item : connections_) {
-    TCPConnectionPtr conn(item.second);
-    item.second.reset();
-    conn->GetLoop()->RunInLoop(
-        std::bind(&TCPConnection::ConnectDestroyed, conn));
+  // Each acceptor is registered with its own loop, and each registry is
+  // used by its own loop, so they have to be stopped there before they go.
+  for (auto &acceptor : acceptors_) {
+    std::promise<void> stopped;
+    acceptor->loop()->RunInLoop([&acceptor, &stopped]() {
+      acceptor->Stop();
+      stopped.set_value();
+    });
+    stopped.get_future().wait();
+  }
+  for (auto &item : registries_) {
+    ConnectionRegistry *registry = item.second.get();
+    std::promise<void> destroyed;
+    registry->loop()->RunInLoop([registry, &destroyed]() {
+      registry->DestroyAll();
+      destroyed.set_value();
+    });
+    destroyed.get_future().wait();
   }
 
-  loop_->epoll_server()->UnregisterFD(socket_->fd());
+  if (socket_) {
+    loop_->epoll_server()->UnregisterFD(socket_->fd());
+  }
   ::close(idle_fd_);
 }
 
@@ -59,26 +228,24 @@ void TCPServer::createSocketAndListen() {
   }
   listenning_ = true;
   loop_->epoll_server()->RegisterFD(socket_->fd(), this, kEpollFlags);
+  if (IOUringServer *io_uring = loop_->io_uring_server()) {
+    io_uring->SetMultishotAccept(socket_->fd());
+  }
 }
 
 void TCPServer::handleRead() {
   loop_->AssertInLoopThread();
 
-  std::unique_ptr<Socket> client_socket(new Socket());
-  bool res = socket_->Accept(client_socket.get());
-  if (res) {
-    newConnection(std::move(client_socket));
-  } else {  // if (res)
-    LOG(ERROR) << "in TCPServer::handleRead";
-    // Read the section named "The special problem of
-    // accept()ing when you can't" in libev's doc.
-    // By Marc Lehmann, author of libev.
-    if (errno == EMFILE) {
-      ::close(idle_fd_);
-      idle_fd_ = ::accept(socket_->fd(), NULL, NULL);
-      ::close(idle_fd_);
-      idle_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  // Up to accept_batch_ connections per event, rather than one per
+  // epoll_wait; whatever is left is reported again, the socket being
+  // level-triggered.
+  for (int i = 0; i < accept_batch_; ++i) {
+    std::unique_ptr<Socket> client_socket =
+        acceptOrShed(socket_.get(), loop_->io_uring_server(), &idle_fd_);
+    if (!client_socket) {
+      break;
     }
+    newConnection(std::move(client_socket));
   }
 }
 
@@ -86,7 +253,7 @@ void TCPServer::OnEvent(int fd, EpollEvent *event) {
   loop_->AssertInLoopThread();
 
   if (event->in_events & EPOLLIN) {
-    LOG(INFO) << "OnEvent EPOLLIN fd:" << fd;
+    VLOG(1) << "OnEvent EPOLLIN fd:" << fd;
     handleRead();
   }
 
@@ -100,51 +267,80 @@ void TCPServer::SetThreadNum(int num_threads) {
   thread_pool_->SetThreadNum(num_threads);
 }
 
+void TCPServer::SetPlacementPolicy(
+    std::unique_ptr<LoopPlacementPolicy> policy) {
+  thread_pool_->SetPlacementPolicy(std::move(policy));
+}
+
 void TCPServer::Start() {
   if (started_.fetch_add(1) == 0) {
     thread_pool_->Start(thread_init_callback_);
+    for (EventLoop *io_loop : thread_pool_->GetAllLoops()) {
+      registries_.emplace(io_loop, new ConnectionRegistry(io_loop));
+    }
 
     assert(!listenning_);
-    loop_->RunInLoop(std::bind(&TCPServer::createSocketAndListen, this));
+    if (!reuse_port_) {
+      loop_->RunInLoop(std::bind(&TCPServer::createSocketAndListen, this));
+      return;
+    }
+
+    // Bound here rather than in the loops, so that with port 0 the port
+    // the first socket gets is known to the others.
+    int port = port_;
+    for (EventLoop *io_loop : thread_pool_->GetAllLoops()) {
+      std::unique_ptr<Socket> socket(new Socket());
+      if (!socket->BindAndListen(host_, port, true)) {
+        LOG(FATAL) << "TCPServer could not bind and listen to " << host_
+                   << ":" << port << " with SO_REUSEPORT";
+        return;
+      }
+      port = socket->GetPort();
+      acceptors_.emplace_back(new Acceptor(
+          this, registries_[io_loop].get(), std::move(socket)));
+      io_loop->RunInLoop(
+          std::bind(&Acceptor::Listen, acceptors_.back().get()));
+    }
+    listenning_ = true;
   }
 }
 
 void TCPServer::newConnection(std::unique_ptr<Socket> client_socket) {
   loop_->AssertInLoopThread();
-  EventLoop *io_loop = thread_pool_->GetNextLoop();
-  char buf[64];
-  snprintf(buf, sizeof(buf), "-%s:%d#%d", host_.c_str(), port_, next_conn_id_);
-  ++next_conn_id_;
-  std::string conn_name = name_ + buf;
-
-  LOG(INFO) << "TCPServer::newConnection [" << name_ << "] - new connection ["
-            << conn_name << "] from " << client_socket->GetPeerAddr();
-
-  TCPConnectionPtr conn(
-      new TCPConnection(io_loop, conn_name, std::move(client_socket)));
-  connections_[conn_name] = conn;
-  conn->SetConnectionCallback(connection_callback_);
-  conn->SetMessageCallback(message_callback_);
-  conn->SetWriteCompleteCallback(write_complete_callback_);
-  conn->SetCloseCallback(
-      std::bind(&TCPServer::removeConnection, this, _1));  // FIXME: unsafe
-  io_loop->RunInLoop(std::bind(&TCPConnection::ConnectEstablished, conn));
+  EventLoop *io_loop =
+      thread_pool_->GetLoopForConnection(client_socket->fd());
+  ConnectionRegistry *registry = registries_[io_loop].get();
+  TCPConnectionPtr conn = createConnection(io_loop, std::move(client_socket));
+  io_loop->RunInLoop([registry, conn]() { registry->Add(conn); });
 }
 
-void TCPServer::removeConnection(const TCPConnectionPtr &conn) {
-  // FIXME: unsafe
-  loop_->RunInLoop(std::bind(&TCPServer::removeConnectionInLoop, this, conn));
-}
+TCPConnectionPtr TCPServer::createConnection(
+    EventLoop *io_loop, std::unique_ptr<Socket> client_socket) {
+  const uint64_t id = next_conn_id_.fetch_add(1, std::memory_order_relaxed);
+  VLOG(1) << "TCPServer::newConnection [" << name_ << "] - new connection #"
+          << id << " from " << client_socket->GetPeerAddr();
 
-void TCPServer::removeConnectionInLoop(const TCPConnectionPtr &conn) {
-  loop_->AssertInLoopThread();
-  LOG(INFO) << "TCPServer::removeConnectionInLoop [" << name_
-            << "] - connection " << conn->Name();
-  size_t n = connections_.erase(conn->Name());
-  (void)n;
-  assert(n == 1);
-  EventLoop *io_loop = conn->GetLoop();
-  io_loop->QueueInLoop(std::bind(&TCPConnection::ConnectDestroyed, conn));
+  const int busy_poll_us = busy_poll_us_.load(std::memory_order_relaxed);
+  if (busy_poll_us > 0 && client_socket->SetBusyPoll(busy_poll_us) != 0) {
+    LOG(WARNING) << "TCPServer::newConnection [" << name_
+                 << "] - SO_BUSY_POLL failed, busy polling turned off: "
+                 << safe_strerror(errno);
+    busy_poll_us_.store(0, std::memory_order_relaxed);
+  }
+
+  TCPConnectionPtr conn(new TCPConnection(io_loop, id, conn_name_prefix_,
+                                          std::move(client_socket)));
+  conn->SetConnectionCallback(connection_callback_);
+  conn->SetMessageCallback(message_callback_);
+  conn->SetWriteCompleteCallback(write_complete_callback_);
+  conn->SetEdgeTriggered(edge_triggered_);
+  const size_t zerocopy_threshold =
+      zerocopy_threshold_.load(std::memory_order_relaxed);
+  if (zerocopy_threshold > 0 &&
+      !conn->SetZeroCopyThreshold(zerocopy_threshold)) {
+    zerocopy_threshold_.store(0, std::memory_order_relaxed);
+  }
+  return conn;
 }
 
 }  // namespace raner
@@ -9,13 +9,16 @@
 #include "raner/tcp_connection.h"
 
 #include <atomic>
-#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 namespace raner {
 
 class Socket;
 class EventLoop;
 class EventLoopThreadPool;
+class LoopPlacementPolicy;
 
 class TCPServer : public EpollCallbackInterface {
  public:
@@ -31,15 +34,21 @@ class TCPServer : public EpollCallbackInterface {
 
   /// Set the number of threads for handling input.
   ///
-  /// Always accepts new connection in loop's thread.
+  /// Accepts new connection in loop's thread, unless SetReusePort().
   /// Must be called before @c start
   /// @param numThreads
   /// - 0 means all I/O in loop's thread, no thread will created.
   ///   this is the default value.
   /// - 1 means all I/O in another thread.
   /// - N means a thread pool with N threads, new connections
-  ///   are assigned on a round-robin basis.
+  ///   are assigned by the placement policy, on a round-robin basis by
+  ///   default.
   void SetThreadNum(int num_threads);
+  /// Sets how new connections are assigned to I/O loops, see
+  /// LoopPlacementPolicy. Not used with SetReusePort(), where the kernel
+  /// picks the socket, and so the loop.
+  /// Must be called before @c start
+  void SetPlacementPolicy(std::unique_ptr<LoopPlacementPolicy> policy);
   void SetThreadInitCallback(const ThreadInitCallback &cb) {
     thread_init_callback_ = cb;
   }
@@ -68,6 +77,43 @@ class TCPServer : public EpollCallbackInterface {
     write_complete_callback_ = cb;
   }
 
+  /// Makes new connections edge-triggered, see
+  /// TCPConnection::SetEdgeTriggered().
+  /// Not thread safe.
+  void SetEdgeTriggered(bool on) { edge_triggered_ = on; }
+
+  /// Busy-polls the sockets of new connections, see Socket::SetBusyPoll().
+  /// Goes well with EventLoop::SetSpinBudget() on the I/O loops.
+  /// Not thread safe.
+  void SetBusyPoll(int busy_poll_us) { busy_poll_us_ = busy_poll_us; }
+
+  /// Sends the large writes of new connections with MSG_ZEROCOPY, see
+  /// TCPConnection::SetZeroCopyThreshold().
+  /// Not thread safe.
+  void SetZeroCopyThreshold(size_t threshold) {
+    zerocopy_threshold_ = threshold;
+  }
+
+  /// Gives every I/O loop its own SO_REUSEPORT listening socket, so that
+  /// each loop accepts its own connections and keeps them, instead of the
+  /// loop's thread accepting them all and handing each over to an I/O loop.
+  /// The kernel spreads new connections over the sockets by a hash of their
+  /// addresses. As closing one already does, accepting a connection then
+  /// never leaves its loop.
+  /// Must be called before @c start
+  void SetReusePort(bool on) { reuse_port_ = on; }
+
+  /// Sets how many connections are accepted per readiness event of a
+  /// listening socket, at most; accepting stops earlier once there is none
+  /// left. A larger batch takes a connection storm in fewer epoll_waits,
+  /// a smaller one lets the other fds of the loop in more often.
+  /// Must be called before @c start
+  void SetAcceptBatch(int accept_batch) {
+    assert(accept_batch > 0);
+    accept_batch_ = accept_batch;
+  }
+  static constexpr int kDefaultAcceptBatch = 64;
+
   // From EpollCallbackInterface
   void OnRegistration(EpollServer *eps, int fd, int event_mask) override {
   }  // FIXME
@@ -78,22 +124,24 @@ class TCPServer : public EpollCallbackInterface {
   std::string Name() const override { return name_; }
 
  private:
+  class Acceptor;
+  class ConnectionRegistry;
+
   void createSocketAndListen();
   void handleRead();
 
   /// Not thread safe, but in loop
   void newConnection(std::unique_ptr<Socket> client_socket);
   /// Thread safe.
-  void removeConnection(const TCPConnectionPtr &conn);
-  /// Not thread safe, but in loop
-  void removeConnectionInLoop(const TCPConnectionPtr &conn);
-
-  typedef std::map<std::string, TCPConnectionPtr> ConnectionMap;
+  TCPConnectionPtr createConnection(EventLoop *io_loop,
+                                    std::unique_ptr<Socket> client_socket);
 
   EventLoop *loop_;
   const std::string host_;
   const int port_;
   const std::string name_;
+  // "<name>-<host>:<port>", shared by the connections for their Name().
+  const std::shared_ptr<const std::string> conn_name_prefix_;
 
   std::unique_ptr<Socket> socket_;  // avoid revealing Socket
   bool listenning_;
@@ -104,11 +152,22 @@ class TCPServer : public EpollCallbackInterface {
   MessageCallback message_callback_;
   WriteCompleteCallback write_complete_callback_;
   ThreadInitCallback thread_init_callback_;
+  bool edge_triggered_;
+  std::atomic<int> busy_poll_us_;
+  std::atomic<size_t> zerocopy_threshold_;
+  bool reuse_port_;
+  int accept_batch_;
 
   std::atomic_int32_t started_;
-  // always in loop thread
-  int next_conn_id_;
-  ConnectionMap connections_;
+  // Shared by the acceptors in reuse-port mode.
+  std::atomic<uint64_t> next_conn_id_;
+  // One per I/O loop, holding the connections of that loop, and used in
+  // that loop only. The map itself is filled in by Start() and not changed
+  // afterwards.
+  std::unordered_map<EventLoop *, std::unique_ptr<ConnectionRegistry>>
+      registries_;
+  // One per I/O loop in reuse-port mode, each used in its loop only.
+  std::vector<std::unique_ptr<Acceptor>> acceptors_;
 
   DISALLOW_COPY_AND_ASSIGN(TCPServer);
 };
@@ -0,0 +1,184 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/timing_wheel.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace raner {
+
+namespace {
+const size_t kBitsPerWord = 64;
+}  // namespace
+
+CoarseTimer::CoarseTimer(TimerCallback timer_cb)
+    : wheel_(nullptr), expiry_tick_(0), timer_cb_(std::move(timer_cb)) {
+  entry_.le_next = NULL;
+  entry_.le_prev = NULL;
+}
+
+CoarseTimer::~CoarseTimer() { Cancel(); }
+
+void CoarseTimer::Cancel() {
+  if (wheel_ != nullptr) {
+    wheel_->Cancel(this);
+  }
+}
+
+TimingWheel::TimingWheel(int64_t tick_in_us, size_t num_slots)
+    : tick_in_us_(tick_in_us),
+      slot_mask_(num_slots - 1),
+      slots_(num_slots),
+      occupied_((num_slots + kBitsPerWord - 1) / kBitsPerWord, 0),
+      current_tick_(0),
+      size_(0) {
+  CHECK_GT(tick_in_us_, 0);
+  CHECK(num_slots > 0 && (num_slots & slot_mask_) == 0)
+      << "num_slots must be a power of two: " << num_slots;
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    LIST_INIT(&slots_[i]);
+  }
+}
+
+TimingWheel::~TimingWheel() {
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    while (slots_[i].lh_first != NULL) {
+      CoarseTimer *timer = slots_[i].lh_first;
+      LIST_REMOVE(timer, entry_);
+      timer->entry_.le_prev = NULL;
+      timer->wheel_ = nullptr;
+    }
+  }
+}
+
+void TimingWheel::Schedule(CoarseTimer *timer, int64_t now_in_us,
+                           int64_t delay_in_us) {
+  if (timer->IsSet()) {
+    timer->wheel_->Cancel(timer);
+  }
+  if (size_ == 0) {
+    // Nothing is pending, so no tick before now can hold a timer that still
+    // has to be fired; catch up with the clock in case Advance() has not
+    // been called for a while.
+    current_tick_ = std::max(current_tick_, now_in_us / tick_in_us_);
+  }
+  const int64_t deadline_in_us =
+      now_in_us + std::max(delay_in_us, static_cast<int64_t>(0));
+  // Round up, so that the timer never fires before its deadline.
+  const int64_t tick = (deadline_in_us + tick_in_us_ - 1) / tick_in_us_;
+  timer->expiry_tick_ = std::max(tick, current_tick_);
+
+  const size_t slot = slotOf(timer->expiry_tick_);
+  LIST_INSERT_HEAD(&slots_[slot], timer, entry_);
+  markOccupied(slot);
+  timer->wheel_ = this;
+  ++size_;
+}
+
+void TimingWheel::Cancel(CoarseTimer *timer) {
+  if (timer->wheel_ != this) {
+    return;
+  }
+  LIST_REMOVE(timer, entry_);
+  timer->entry_.le_prev = NULL;
+  timer->wheel_ = nullptr;
+  --size_;
+  clearIfEmpty(slotOf(timer->expiry_tick_));
+}
+
+void TimingWheel::Advance(int64_t now_in_us) {
+  const int64_t now_tick = now_in_us / tick_in_us_;
+  if (now_tick < current_tick_) {
+    return;
+  }
+  if (size_ == 0) {
+    current_tick_ = now_tick + 1;
+    return;
+  }
+
+  // One revolution visits every slot, so never look at more ticks than that.
+  const int64_t num_slots = static_cast<int64_t>(slot_mask_ + 1);
+  int64_t tick = std::max(current_tick_, now_tick - num_slots + 1);
+  // Move on before running any callback, so that a timer scheduled from a
+  // callback lands in a later tick and is not picked up by this call.
+  current_tick_ = now_tick + 1;
+
+  // Unlink every due timer first, and only then run the callbacks, which are
+  // then free to schedule or cancel any timer.
+  Slot expired;
+  LIST_INIT(&expired);
+  while (tick <= now_tick) {
+    const size_t distance = distanceToOccupied(slotOf(tick));
+    if (static_cast<int64_t>(distance) > now_tick - tick) {
+      break;
+    }
+    tick += static_cast<int64_t>(distance);
+    const size_t slot = slotOf(tick);
+    CoarseTimer *timer = slots_[slot].lh_first;
+    while (timer != NULL) {
+      CoarseTimer *next = timer->entry_.le_next;
+      // Timers of a later revolution stay where they are.
+      if (timer->expiry_tick_ <= now_tick) {
+        LIST_REMOVE(timer, entry_);
+        LIST_INSERT_HEAD(&expired, timer, entry_);
+      }
+      timer = next;
+    }
+    clearIfEmpty(slot);
+    ++tick;
+  }
+
+  while (expired.lh_first != NULL) {
+    CoarseTimer *timer = expired.lh_first;
+    LIST_REMOVE(timer, entry_);
+    timer->entry_.le_prev = NULL;
+    timer->wheel_ = nullptr;
+    --size_;
+    if (timer->timer_cb_) {
+      timer->timer_cb_();
+    }
+  }
+}
+
+int64_t TimingWheel::NextSlotTimeInUs() const {
+  if (size_ == 0) {
+    return -1;
+  }
+  const size_t distance = distanceToOccupied(slotOf(current_tick_));
+  if (distance > slot_mask_) {
+    return -1;
+  }
+  return (current_tick_ + static_cast<int64_t>(distance)) * tick_in_us_;
+}
+
+void TimingWheel::markOccupied(size_t slot) {
+  occupied_[slot / kBitsPerWord] |= 1ULL << (slot % kBitsPerWord);
+}
+
+void TimingWheel::clearIfEmpty(size_t slot) {
+  if (slots_[slot].lh_first == NULL) {
+    occupied_[slot / kBitsPerWord] &= ~(1ULL << (slot % kBitsPerWord));
+  }
+}
+
+size_t TimingWheel::distanceToOccupied(size_t slot) const {
+  size_t word = slot / kBitsPerWord;
+  uint64_t bits = occupied_[word] & (~0ULL << (slot % kBitsPerWord));
+  // The first word is looked at twice: from 'slot' onwards first, and as a
+  // whole again after wrapping round.
+  for (size_t scanned = 0; scanned <= occupied_.size(); ++scanned) {
+    if (bits != 0) {
+      const size_t found =
+          word * kBitsPerWord + static_cast<size_t>(__builtin_ctzll(bits));
+      return (found - slot) & slot_mask_;
+    }
+    word = (word + 1) % occupied_.size();
+    bits = occupied_[word];
+  }
+  return slot_mask_ + 1;
+}
+
+}  // namespace raner
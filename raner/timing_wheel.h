@@ -0,0 +1,123 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_NET_TIMING_WHEEL_H_
+#define RANER_NET_TIMING_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include <vector>
+
+#include "raner/callbacks.h"
+#include "raner/macros.h"
+
+namespace raner {
+
+class TimingWheel;
+
+// A timer scheduled on a TimingWheel. The timer is intrusive: its owner
+// embeds it (typically as a member) and the wheel only links it into one of
+// its slots, so scheduling, rescheduling and cancelling never allocate.
+class CoarseTimer {
+ public:
+  explicit CoarseTimer(TimerCallback timer_cb = TimerCallback());
+
+  // Cancels the timer if it is scheduled.
+  ~CoarseTimer();
+
+  void SetTimerCallback(TimerCallback timer_cb) {
+    timer_cb_ = std::move(timer_cb);
+  }
+
+  // Cancels the timer.  May be called repeatedly.
+  void Cancel();
+
+  // Returns true if the timer is scheduled on a wheel.
+  bool IsSet() const { return wheel_ != nullptr; }
+
+ private:
+  friend class TimingWheel;
+
+  LIST_ENTRY(CoarseTimer) entry_;
+  TimingWheel *wheel_;
+  int64_t expiry_tick_;
+  TimerCallback timer_cb_;
+
+  DISALLOW_COPY_AND_ASSIGN(CoarseTimer);
+};
+
+// A hashed timing wheel for large numbers of timeouts that only need coarse
+// precision, such as per-connection idle timeouts.
+//
+// Time is cut into ticks of tick_in_us. A timer due in tick T is linked into
+// slot T % num_slots; timers more than one revolution away just stay in their
+// slot until the wheel comes round to the right tick. Schedule() and Cancel()
+// are O(1). Advance() visits each elapsed tick once, and a bitmap of the
+// non-empty slots lets it, and NextSlotTimeInUs(), skip empty slots a word at
+// a time.
+//
+// A timer never fires before its deadline, and fires at most one tick after
+// it, provided Advance() is called at least once per tick.
+class TimingWheel {
+ public:
+  // num_slots must be a power of two.
+  TimingWheel(int64_t tick_in_us, size_t num_slots);
+
+  // Cancels every timer still scheduled.
+  ~TimingWheel();
+
+  // Summary:
+  //   Schedules 'timer' to fire once 'delay_in_us' after 'now_in_us'.  If
+  //   the timer is already scheduled (on this or another wheel) it is moved.
+  void Schedule(CoarseTimer *timer, int64_t now_in_us, int64_t delay_in_us);
+
+  // Summary:
+  //   Unschedules 'timer'.  Does nothing if it is not scheduled here.
+  void Cancel(CoarseTimer *timer);
+
+  // Summary:
+  //   Fires every timer whose deadline has been reached at 'now_in_us'.
+  //   Callbacks may schedule or cancel any timer, including other timers
+  //   that are due in this call.
+  void Advance(int64_t now_in_us);
+
+  // Summary:
+  //   Returns the start of the earliest tick whose slot holds a timer, or -1
+  //   if nothing is scheduled. The timers in that slot may belong to a later
+  //   revolution, so this is a lower bound for the next deadline, and the
+  //   right time to call Advance() next.
+  int64_t NextSlotTimeInUs() const;
+
+  size_t size() const { return size_; }
+  int64_t tick_in_us() const { return tick_in_us_; }
+
+ private:
+  LIST_HEAD(Slot, CoarseTimer);
+
+  size_t slotOf(int64_t tick) const {
+    return static_cast<size_t>(tick) & slot_mask_;
+  }
+  void markOccupied(size_t slot);
+  void clearIfEmpty(size_t slot);
+  // Returns the distance from 'slot' to the next occupied slot, going round
+  // the wheel, or num_slots if there is none.
+  size_t distanceToOccupied(size_t slot) const;
+
+  const int64_t tick_in_us_;
+  const size_t slot_mask_;
+  std::vector<Slot> slots_;
+  // One bit per slot, set when the slot's list is not empty.
+  std::vector<uint64_t> occupied_;
+  // Every tick before this one has been processed by Advance().
+  int64_t current_tick_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimingWheel);
+};
+
+}  // namespace raner
+
+#endif  // RANER_NET_TIMING_WHEEL_H_
@@ -0,0 +1,158 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/trace_ring.h"
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace raner {
+
+namespace {
+
+const char *const kTypeNames[] = {"epoll_wait", "OnEvent", "OnAlarm",
+                                  "functors"};
+const char *const kArgNames[] = {"events", "mask", nullptr, "count"};
+
+const char *typeName(int32_t type) {
+  if (type < 0 || type > TraceRing::kFunctors) {
+    return "unknown";
+  }
+  return kTypeNames[type];
+}
+
+int64_t monotonicNowInNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Reads the monotonic clock into *now_ns, and returns the TSC at the middle
+// of the read.
+int64_t bracketedTicks(int64_t *now_ns) {
+  const uint64_t before = TSCClock::ReadTicks();
+  *now_ns = monotonicNowInNs();
+  const uint64_t after = TSCClock::ReadTicks();
+  return static_cast<int64_t>(before + (after - before) / 2);
+}
+
+}  // namespace
+
+constexpr size_t TraceRing::kDefaultCapacity;
+
+TraceRing::TraceRing(size_t capacity, Clock clock)
+    : uses_tsc_(clock == kTSCClock && TSCClock::IsSupported()),
+      anchor_ticks_(0),
+      anchor_ns_(0),
+      mask_(capacity - 1),
+      slots_(new Slot[capacity]()),
+      next_(0),
+      writing_(0),
+      enabled_(true),
+      pid_(static_cast<int>(getpid())),
+      tid_(static_cast<int>(syscall(SYS_gettid))) {
+  CHECK(capacity > 0 && (capacity & mask_) == 0)
+      << "capacity must be a power of two: " << capacity;
+  if (uses_tsc_) {
+    anchor_ticks_ = bracketedTicks(&anchor_ns_);
+  }
+}
+
+std::vector<TraceRing::Record> TraceRing::Snapshot() const {
+  const uint64_t end = next_.load(std::memory_order_acquire);
+  uint64_t begin = end > capacity() ? end - capacity() : 0;
+  std::vector<Record> records;
+  records.reserve(static_cast<size_t>(end - begin));
+  for (uint64_t i = begin; i < end; ++i) {
+    const Slot &slot = slots_[i & mask_];
+    Record record;
+    record.start_ns = slot.start.load(std::memory_order_relaxed);
+    record.duration_ns = slot.duration.load(std::memory_order_relaxed);
+    record.type = slot.type.load(std::memory_order_relaxed);
+    record.fd = slot.fd.load(std::memory_order_relaxed);
+    record.arg = slot.arg.load(std::memory_order_relaxed);
+    records.push_back(record);
+  }
+  // Records from before any slot the writer has started to overwrite since
+  // may have been torn while they were copied.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const uint64_t writing = writing_.load(std::memory_order_relaxed);
+  if (writing > capacity() && writing - capacity() > begin) {
+    const uint64_t torn = std::min(writing - capacity(), end) - begin;
+    records.erase(records.begin(),
+                  records.begin() + static_cast<ptrdiff_t>(torn));
+  }
+  if (uses_tsc_) {
+    int64_t now_ns;
+    const int64_t now_ticks = bracketedTicks(&now_ns);
+    const double ns_per_tick =
+        now_ticks > anchor_ticks_
+            ? static_cast<double>(now_ns - anchor_ns_) /
+                  static_cast<double>(now_ticks - anchor_ticks_)
+            : 0;
+    for (Record &record : records) {
+      record.start_ns =
+          anchor_ns_ + static_cast<int64_t>(
+                           static_cast<double>(record.start_ns - anchor_ticks_) *
+                           ns_per_tick);
+      record.duration_ns = static_cast<int64_t>(
+          static_cast<double>(record.duration_ns) * ns_per_tick);
+    }
+  }
+  return records;
+}
+
+void TraceRing::WriteChromeTrace(std::ostream *os) const {
+  const std::vector<Record> records = Snapshot();
+  *os << "{\"traceEvents\":[";
+  char buf[64];
+  for (size_t i = 0; i < records.size(); ++i) {
+    const Record &record = records[i];
+    if (i > 0) {
+      *os << ",";
+    }
+    *os << "\n{\"name\":\"" << typeName(record.type)
+        << "\",\"cat\":\"raner\",\"ph\":\"X\"";
+    // Microseconds, which is what the format takes, to the nanosecond.
+    snprintf(buf, sizeof(buf), ",\"ts\":%.3f,\"dur\":%.3f",
+             static_cast<double>(record.start_ns) / 1000,
+             static_cast<double>(record.duration_ns) / 1000);
+    *os << buf << ",\"pid\":" << pid_ << ",\"tid\":" << tid_
+        << ",\"args\":{";
+    if (record.fd >= 0) {
+      *os << "\"fd\":" << record.fd;
+    }
+    const char *arg_name =
+        record.type >= 0 && record.type <= kFunctors ? kArgNames[record.type]
+                                                     : nullptr;
+    if (arg_name != nullptr) {
+      *os << (record.fd >= 0 ? "," : "") << "\"" << arg_name
+          << "\":" << record.arg;
+    }
+    *os << "}}";
+  }
+  *os << "\n]}\n";
+}
+
+std::string TraceRing::ToChromeTrace() const {
+  std::ostringstream os;
+  WriteChromeTrace(&os);
+  return os.str();
+}
+
+// static
+std::string TraceRing::ToString(const Record &record) {
+  std::ostringstream os;
+  os << record.start_ns << "ns " << typeName(record.type) << " took "
+     << record.duration_ns << "ns fd " << record.fd << " arg " << record.arg;
+  return os.str();
+}
+
+}  // namespace raner
@@ -0,0 +1,143 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "raner/tsc_clock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace raner {
+
+namespace {
+
+// How long the rate is first measured for, once per process.
+const int64_t kCalibrationNs = 10 * 1000 * 1000;
+
+// A refined rate further than this from the current one means the wall
+// clock has been stepped, not that the rate was off, and is not taken.
+const double kMaxRateChange = 1e-3;
+
+int64_t monotonicNowInNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Reads the monotonic clock into *now_ns, and returns the TSC at the middle
+// of the read.
+uint64_t bracketedTicks(int64_t *now_ns) {
+  const uint64_t before = __rdtsc();
+  *now_ns = monotonicNowInNs();
+  const uint64_t after = __rdtsc();
+  return before + (after - before) / 2;
+}
+#endif
+
+double calibrateUsPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+  // The first read may have to fault in the vDSO data page.
+  monotonicNowInNs();
+  int64_t start_ns;
+  const uint64_t start_ticks = bracketedTicks(&start_ns);
+  struct timespec ts = {0, kCalibrationNs};
+  while (nanosleep(&ts, &ts) != 0) {
+  }
+  int64_t end_ns;
+  const uint64_t end_ticks = bracketedTicks(&end_ns);
+  const double us_per_tick = static_cast<double>(end_ns - start_ns) / 1000 /
+                             static_cast<double>(end_ticks - start_ticks);
+  VLOG(1) << "TSC runs at " << 1 / us_per_tick / 1000 << " MHz";
+  return us_per_tick;
+#else
+  return 0;
+#endif
+}
+
+}  // namespace
+
+constexpr int64_t TSCClock::kFirstResyncIntervalUs;
+constexpr int64_t TSCClock::kResyncIntervalUs;
+
+TSCClock::TSCClock()
+    : uses_tsc_(IsSupported()),
+      us_per_tick_(0),
+      resync_interval_us_(kFirstResyncIntervalUs),
+      resync_ticks_(0),
+      sync_ticks_(0),
+      sync_us_(0),
+      base_ticks_(0),
+      base_us_(0),
+      last_us_(0) {
+  if (!uses_tsc_) {
+    return;
+  }
+  static const double calibrated_us_per_tick = calibrateUsPerTick();
+  us_per_tick_ = calibrated_us_per_tick;
+  resync_ticks_ = static_cast<uint64_t>(
+      static_cast<double>(resync_interval_us_) / us_per_tick_);
+  sync_ticks_ = ReadTicks();
+  sync_us_ = WallNowInUsec();
+  base_ticks_ = sync_ticks_;
+  base_us_ = sync_us_;
+}
+
+// static
+bool TSCClock::IsSupported() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool supported = [] {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+      return false;
+    }
+    // CPUID.80000007H:EDX[8], the invariant TSC bit.
+    return (edx & (1u << 8)) != 0;
+  }();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+int64_t TSCClock::Resync(uint64_t ticks) {
+  const int64_t now_us = WallNowInUsec();
+  if (ticks > base_ticks_ && now_us > base_us_) {
+    const double us_per_tick = static_cast<double>(now_us - base_us_) /
+                               static_cast<double>(ticks - base_ticks_);
+    if (std::fabs(us_per_tick / us_per_tick_ - 1) < kMaxRateChange) {
+      us_per_tick_ = us_per_tick;
+    } else {
+      base_ticks_ = ticks;
+      base_us_ = now_us;
+    }
+  } else {
+    base_ticks_ = ticks;
+    base_us_ = now_us;
+  }
+  resync_interval_us_ = std::min(2 * resync_interval_us_, kResyncIntervalUs);
+  resync_ticks_ = static_cast<uint64_t>(
+      static_cast<double>(resync_interval_us_) / us_per_tick_);
+  sync_ticks_ = ticks;
+  sync_us_ = now_us;
+
+  // Having run ahead by the rate error of the last interval, the clock
+  // stands still until the wall clock catches up; a step back of the wall
+  // clock is followed instead.
+  if (last_us_ - now_us > kResyncIntervalUs) {
+    last_us_ = now_us;
+  }
+  if (now_us < last_us_) {
+    return last_us_;
+  }
+  last_us_ = now_us;
+  return now_us;
+}
+
+}  // namespace raner
@@ -0,0 +1,107 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef RANER_BASE_TSC_CLOCK_H_
+#define RANER_BASE_TSC_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "raner/macros.h"
+
+namespace raner {
+
+// A clock in microseconds since the Unix epoch, like Time::Now(), read with
+// rdtsc instead of a vDSO clock_gettime() or gettimeofday().
+//
+// The tick rate is calibrated against the wall clock once per process.
+// Each clock then reads the wall clock again to re-anchor itself and refine
+// the rate, first after kFirstResyncIntervalUs and then at twice the last
+// interval, up to kResyncIntervalUs, so that it never drifts far from
+// Time::Now(): by the rate error over one interval, which shrinks as the
+// rate is measured over longer spans. It never goes backwards, unless the
+// wall clock is stepped back by more than kResyncIntervalUs.
+//
+// Where the TSC is not invariant, that is where its rate changes with the
+// CPU frequency or it stops in deep sleep states, uses_tsc() is false and
+// NowInUsec() reads the wall clock instead.
+//
+// Not thread safe: each thread, typically each EpollServer, owns its clock.
+class TSCClock {
+ public:
+  TSCClock();
+
+  static constexpr int64_t kFirstResyncIntervalUs = 10 * 1000;
+  static constexpr int64_t kResyncIntervalUs = 1000 * 1000;
+
+  // Returns true if this CPU has an invariant TSC.
+  static bool IsSupported();
+
+  bool uses_tsc() const { return uses_tsc_; }
+
+  int64_t NowInUsec() {
+    if (!uses_tsc_) {
+      return WallNowInUsec();
+    }
+    const uint64_t ticks = ReadTicks();
+    // Also true if the TSC of this CPU is behind the one of the CPU which
+    // last resynced, as the difference then wraps around.
+    const uint64_t elapsed = ticks - sync_ticks_;
+    if (elapsed >= resync_ticks_) {
+      return Resync(ticks);
+    }
+    const int64_t now_us =
+        sync_us_ +
+        static_cast<int64_t>(static_cast<double>(elapsed) * us_per_tick_);
+    if (now_us < last_us_) {
+      return last_us_;
+    }
+    last_us_ = now_us;
+    return now_us;
+  }
+
+  double us_per_tick() const { return us_per_tick_; }
+
+  // Returns the raw TSC.
+  static uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  // The clock read when the TSC is not used, and to resync.
+  static int64_t WallNowInUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+ private:
+  int64_t Resync(uint64_t ticks);
+
+  const bool uses_tsc_;
+  double us_per_tick_;
+  int64_t resync_interval_us_;
+  uint64_t resync_ticks_;
+  // The last resync, from which NowInUsec() extrapolates.
+  uint64_t sync_ticks_;
+  int64_t sync_us_;
+  // Where the rate is measured from; the longer ago, the better the rate.
+  uint64_t base_ticks_;
+  int64_t base_us_;
+  // The largest time returned so far.
+  int64_t last_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(TSCClock);
+};
+
+}  // namespace raner
+
+#endif  // RANER_BASE_TSC_CLOCK_H_
@@ -0,0 +1,121 @@
+// Measures how many connections per second a TCPServer accepts while
+// client threads connect as fast as they can, with one accept per
+// readiness event and with batches of them. The clients connect in bursts
+// of non-blocking connects, which the kernel completes on loopback without
+// the server, so that connections queue up on the listening socket as they
+// do in a connection storm. A client waits for its burst to be accepted,
+// so that the queue never overflows, and then resets the connections, so
+// the server also pays for the closes.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/tcp_server.h"
+#include "raner/time.h"
+
+namespace raner {
+namespace {
+
+const int kBasePort = 27383;
+const int kConnectionsPerThread = 20000;
+const int kBurst = 128;
+
+// Leaves a core to the server.
+int numClientThreads() {
+  return std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+}
+
+std::atomic<int> g_num_connecting(0);
+std::atomic<int> g_num_accepted(0);
+
+void connectAndReset(int port, int num_connections,
+                     const std::atomic<bool> *stop) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fds[kBurst];
+  for (int i = 0; i < num_connections && !*stop; i += kBurst) {
+    const int burst = std::min(kBurst, num_connections - i);
+    for (int j = 0; j < burst; ++j) {
+      fds[j] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (connect(fds[j], reinterpret_cast<struct sockaddr *>(&addr),
+                  sizeof(addr)) != 0 &&
+          errno != EINPROGRESS) {
+        perror("connect");
+      }
+    }
+    const int num_connecting = g_num_connecting.fetch_add(burst) + burst;
+    while (g_num_accepted.load() < num_connecting && !*stop) {
+      std::this_thread::yield();
+    }
+    for (int j = 0; j < burst; ++j) {
+      // A reset instead of a FIN leaves no TIME_WAIT behind to run out of
+      // ports with.
+      struct linger linger = {1, 0};
+      setsockopt(fds[j], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+      close(fds[j]);
+    }
+  }
+}
+
+void Run(int accept_batch, int port) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", port, "AcceptBench");
+  server.SetAcceptBatch(accept_batch);
+  const int num_client_threads = numClientThreads();
+  const int num_connections = num_client_threads * kConnectionsPerThread;
+  g_num_connecting = 0;
+  g_num_accepted = 0;
+  server.SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+    if (conn->Connected() && ++g_num_accepted == num_connections) {
+      loop.Quit();
+    }
+  });
+  server.Start();
+
+  std::atomic<bool> stop(false);
+  std::unique_ptr<EpollTimer> timeout = loop.CreateTimer([&loop, &stop] {
+    fprintf(stderr, "timed out\n");
+    stop = true;
+    loop.Quit();
+  });
+  timeout->Update(Time::Now() + Duration(60 * 1000 * 1000));
+
+  const Time start = Time::Now();
+  std::vector<std::thread> clients;
+  for (int i = 0; i < num_client_threads; ++i) {
+    clients.emplace_back(connectAndReset, port, kConnectionsPerThread, &stop);
+  }
+  loop.Loop();
+  const Duration elapsed = Time::Now() - start;
+  for (std::thread &client : clients) {
+    client.join();
+  }
+  const double num_accepted = g_num_accepted.load();
+  printf("accept batch %-4d %8.0f accepts/s, %.1f per loop iteration\n",
+         accept_batch, num_accepted * 1e6 / static_cast<double>(elapsed.count()),
+         num_accepted / static_cast<double>(loop.iteration()));
+}
+
+}  // namespace
+}  // namespace raner
+
+int main() {
+  raner::Run(1, raner::kBasePort);
+  raner::Run(16, raner::kBasePort + 1);
+  raner::Run(raner::TCPServer::kDefaultAcceptBatch, raner::kBasePort + 2);
+  return 0;
+}
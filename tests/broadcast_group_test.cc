@@ -0,0 +1,62 @@
+#include "raner/broadcast_group.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/event_loop_thread_pool.h"
+#include "raner/tcp_server.h"
+#include "tests/test_util.h"
+
+namespace raner {
+namespace {
+
+const int kBasePort = 27483;
+
+// Four clients on two I/O loops join the group. The first one closes after
+// the first message; the second message reaches only the others.
+TEST(BroadcastGroupTest, ClosedConnectionsLeaveTheGroup) {
+  const int kNumClients = 4;
+  EventLoop loop;
+  // Outlives the server, whose connections use it until they are gone.
+  std::unique_ptr<BroadcastGroup> group;
+  TCPServer server(&loop, "127.0.0.1", kBasePort, "GroupServer");
+  server.SetThreadNum(2);
+  std::atomic<int> num_joined(0);
+  std::atomic<bool> said_bye(false);
+  server.SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+    if (conn->Connected()) {
+      group->Join(conn);
+      if (++num_joined == kNumClients) {
+        group->Publish(std::string_view("hello"));
+      }
+    } else if (!said_bye.exchange(true)) {
+      // The first client closed.
+      group->Publish(std::string_view("bye"));
+    }
+  });
+  server.Start();
+  group.reset(new BroadcastGroup(server.thread_pool()->GetAllLoops()));
+
+  const std::vector<std::string> received = receiveFromClients(
+      &loop, server, kNumClients, std::string(),
+      [](int i, const std::string &bytes) {
+        return bytes == (i == 0 ? "hello" : "hellobye");
+      });
+
+  EXPECT_EQ("hello", received[0]);
+  for (int i = 1; i < kNumClients; ++i) {
+    EXPECT_EQ("hellobye", received[i]);
+  }
+  // The loop quit once the clients saw their connections close, which the
+  // server connections did before; their removals ran in their own loops.
+  EXPECT_EQ(0u, group->NumSubscribers());
+}
+
+}  // namespace
+}  // namespace raner
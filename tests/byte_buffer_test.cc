@@ -130,6 +130,36 @@ TEST(ByteBufferTest, Move) {
   output(std::move(buf), inner);
 }
 
+TEST(ByteBufferTest, Borrow) {
+  std::string lent("hello world");
+  ByteBuffer buf;
+  buf.Borrow(lent.data(), lent.size());
+  EXPECT_TRUE(buf.borrowed());
+  EXPECT_EQ(lent.data(), buf.BeginRead());
+  EXPECT_EQ(0, buf.WritableBytes());
+  EXPECT_EQ("hello", buf.ToString(5));
+
+  // What is left is copied before anything is written.
+  buf.Write(std::string_view("!"));
+  EXPECT_FALSE(buf.borrowed());
+  lent.assign(lent.size(), 'x');
+  EXPECT_EQ(" world!", buf.ToString());
+
+  // Skipping all the bytes forgets them, and a copy or a move owns them.
+  buf.Borrow(lent.data(), lent.size());
+  buf.SkipAll();
+  EXPECT_FALSE(buf.borrowed());
+  EXPECT_EQ(ByteBuffer::kInitialSize, buf.WritableBytes());
+  buf.Borrow(lent.data(), lent.size());
+  ByteBuffer copy(buf);
+  ByteBuffer moved(std::move(buf));
+  EXPECT_FALSE(copy.borrowed());
+  EXPECT_FALSE(moved.borrowed());
+  EXPECT_NE(lent.data(), moved.BeginRead());
+  EXPECT_EQ(lent, copy.ToString());
+  EXPECT_EQ(lent, moved.ToString());
+}
+
 }  // namespace
 }  // namespace raner
 
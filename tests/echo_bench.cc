@@ -0,0 +1,128 @@
+// Measures the CPU a loop spends per echoed message, polling with epoll and
+// reading, writing and accepting through io_uring. Clients and server share
+// one loop, and every client keeps one small message in flight, so that
+// each wait finds many sockets ready: epoll then reads and writes them one
+// read() and write() at a time, where the multishot recvs have had the
+// kernel fill their buffers before the wait returns, and the sends queued
+// meanwhile go with the io_uring_enter() of the next wait.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/io_uring_server.h"
+#include "raner/tcp_client.h"
+#include "raner/tcp_server.h"
+#include "raner/time.h"
+
+namespace raner {
+namespace {
+
+const int kBasePort = 27583;
+const int kNumClients = 64;
+const int kRoundTripsPerClient = 5000;
+
+double cpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return static_cast<double>(ts.tv_sec) +
+         static_cast<double>(ts.tv_nsec) / 1e9;
+}
+
+void Run(EventLoop::Poller poller, int port) {
+  EventLoop loop(poller);
+  TCPServer server(&loop, "127.0.0.1", port, "EchoBench");
+  server.SetMessageCallback(
+      [](const TCPConnectionPtr &conn, ByteBuffer *buf) { conn->Send(buf); });
+  server.Start();
+
+  const std::string message(64, 'x');
+  int num_done = 0;
+  int num_closed = 0;
+  double cpu_start = 0;
+  double cpu = 0;
+  Time start;
+  Duration elapsed;
+  int64_t iterations = 0;
+  std::vector<std::unique_ptr<TCPClient>> clients;
+  std::vector<TCPConnectionPtr> conns;
+  std::vector<int> round_trips(kNumClients, 0);
+  for (int i = 0; i < kNumClients; ++i) {
+    clients.emplace_back(
+        new TCPClient(&loop, server.host(), server.port(), "EchoClient"));
+    clients.back()->SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+      if (!conn->Connected()) {
+        // Quits once both sides have closed, so that no connection
+        // outlives the loop.
+        if (++num_closed == kNumClients) {
+          loop.Quit();
+        }
+        return;
+      }
+      conns.push_back(conn);
+      if (conns.size() == kNumClients) {
+        // Starts the clock once all are connected, then the traffic.
+        cpu_start = cpuSeconds();
+        start = Time::Now();
+        iterations = loop.iteration();
+        for (const TCPConnectionPtr &c : conns) {
+          c->Send(std::string_view(message));
+        }
+        conns.clear();
+      }
+    });
+    clients.back()->SetMessageCallback(
+        [&, i](const TCPConnectionPtr &conn, ByteBuffer *buf) {
+          if (buf->ReadableBytes() < message.size()) {
+            return;
+          }
+          buf->SkipReadBytes(message.size());
+          if (++round_trips[i] < kRoundTripsPerClient) {
+            conn->Send(std::string_view(message));
+            return;
+          }
+          if (++num_done == kNumClients) {
+            cpu = cpuSeconds() - cpu_start;
+            elapsed = Time::Now() - start;
+            iterations = loop.iteration() - iterations;
+          }
+          conn->Shutdown();
+        });
+  }
+  for (const std::unique_ptr<TCPClient> &client : clients) {
+    client->Connect();
+  }
+  std::unique_ptr<EpollTimer> timeout = loop.CreateTimer([&loop] {
+    fprintf(stderr, "timed out\n");
+    loop.Quit();
+  });
+  timeout->Update(Time::Now() + Duration(60 * 1000 * 1000));
+  loop.Loop();
+
+  const double num_round_trips =
+      static_cast<double>(kNumClients) * kRoundTripsPerClient;
+  printf(
+      "%-8s %8.0f round trips/s, %.2f us CPU per round trip, %.1f per loop "
+      "iteration\n",
+      poller == EventLoop::kIOUring ? "io_uring" : "epoll",
+      num_round_trips * 1e6 / static_cast<double>(elapsed.count()),
+      cpu * 1e6 / num_round_trips,
+      num_round_trips / static_cast<double>(iterations));
+}
+
+}  // namespace
+}  // namespace raner
+
+int main() {
+  raner::Run(raner::EventLoop::kEpoll, raner::kBasePort);
+  if (!raner::IOUringServer::IsSupported()) {
+    printf("io_uring is not supported\n");
+    return 0;
+  }
+  raner::Run(raner::EventLoop::kIOUring, raner::kBasePort + 1);
+  return 0;
+}
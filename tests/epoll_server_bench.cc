@@ -0,0 +1,108 @@
+// Measures the cost of the per-fd lookups done on the hot path of the
+// EpollServer (HasRegisterWrite, StartWrite/StopWrite and HandleEvent) with
+// 100k registered fds. The epoll set itself is never touched, so only the
+// EpollServer bookkeeping is timed.
+
+#include "raner/epoll_server.h"
+
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+#include "raner/time.h"
+
+namespace raner {
+namespace {
+
+const int kNumFDs = 100000;
+const int kNumIterations = 10 * 1000 * 1000;
+
+class FakeEpollServer : public EpollServer {
+ protected:
+  void SetNonblocking(int /*fd*/) override {}
+  void DelFD(int /*fd*/) const override {}
+  void AddFD(int /*fd*/, int /*event_mask*/) const override {}
+  void ModFD(int /*fd*/, int /*event_mask*/) const override {}
+};
+
+class NullCB : public EpollCallbackInterface {
+ public:
+  void OnRegistration(EpollServer * /*eps*/, int /*fd*/,
+                      int /*event_mask*/) override {}
+  void OnModification(int /*fd*/, int /*event_mask*/) override {}
+  void OnEvent(int /*fd*/, EpollEvent * /*event*/) override {}
+  void OnUnregistration(int /*fd*/, bool /*replaced*/) override {}
+  void OnShutdown(EpollServer * /*eps*/, int /*fd*/) override {}
+  std::string Name() const override { return "NullCB"; }
+};
+
+void Report(const char *name, Time start) {
+  const Duration elapsed = Time::Now() - start;
+  printf("%-24s %8.2f ns/op\n", name,
+         static_cast<double>(elapsed.count()) * 1000.0 / kNumIterations);
+}
+
+void Run() {
+  FakeEpollServer eps;
+  NullCB cb;
+  Time start = Time::Now();
+  for (int fd = 0; fd < kNumFDs; ++fd) {
+    eps.RegisterFDForRead(fd + 16, &cb);
+  }
+  printf("%-24s %8.2f ns/op\n", "RegisterFD",
+         static_cast<double>((Time::Now() - start).count()) * 1000.0 /
+             kNumFDs);
+
+  // Visit the fds in a random order, as connections do.
+  std::vector<int> fds(1 << 16);
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> dist(16, kNumFDs + 15);
+  for (size_t i = 0; i < fds.size(); ++i) {
+    fds[i] = dist(rng);
+  }
+  const size_t mask = fds.size() - 1;
+
+  int writable = 0;
+  start = Time::Now();
+  for (int i = 0; i < kNumIterations; ++i) {
+    writable += eps.HasRegisterWrite(fds[static_cast<size_t>(i) & mask]);
+  }
+  Report("HasRegisterWrite", start);
+
+  start = Time::Now();
+  for (int i = 0; i < kNumIterations; ++i) {
+    const int fd = fds[static_cast<size_t>(i) & mask];
+    if (i & 1) {
+      eps.StopWrite(fd);
+    } else {
+      eps.StartWrite(fd);
+    }
+  }
+  Report("StartWrite/StopWrite", start);
+
+  start = Time::Now();
+  for (int i = 0; i < kNumIterations; ++i) {
+    const int fd = fds[static_cast<size_t>(i) & mask];
+    eps.HandleEvent(fd, EPOLLIN);
+    eps.SetFDNotReady(fd);
+  }
+  Report("HandleEvent", start);
+
+  start = Time::Now();
+  for (int fd = 0; fd < kNumFDs; ++fd) {
+    eps.UnregisterFD(fd + 16);
+  }
+  printf("%-24s %8.2f ns/op\n", "UnregisterFD",
+         static_cast<double>((Time::Now() - start).count()) * 1000.0 /
+             kNumFDs);
+  printf("(%d)\n", writable);
+}
+
+}  // namespace
+}  // namespace raner
+
+int main() {
+  raner::Run();
+  return 0;
+}
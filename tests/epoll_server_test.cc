@@ -0,0 +1,298 @@
+#include "raner/epoll_server.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace raner {
+namespace {
+
+// An EpollServer that keeps its bookkeeping but never touches the epoll set,
+// so that any integer can be registered as an fd.
+class FakeEpollServer : public EpollServer {
+ public:
+  FakeEpollServer() : num_ready_fds_(0) {}
+
+  // Makes every epoll_wait report fds kFirstFD.. kFirstFD + n - 1 readable.
+  void set_num_ready_fds(int n) { num_ready_fds_ = n; }
+
+  static const int kFirstFD = 100;
+
+  // The masks handed to ModFD(), in order.
+  const std::vector<int> &mod_fd_masks() const { return mod_fd_masks_; }
+
+ protected:
+  void SetNonblocking(int /*fd*/) override {}
+  void DelFD(int /*fd*/) const override {}
+  void AddFD(int /*fd*/, int /*event_mask*/) const override {}
+  void ModFD(int /*fd*/, int event_mask) const override {
+    mod_fd_masks_.push_back(event_mask);
+  }
+
+  int epoll_wait_impl(int /*epfd*/, struct epoll_event *events,
+                      int max_events, int /*timeout_in_ms*/) override {
+    const int num_events = std::min(num_ready_fds_, max_events);
+    for (int i = 0; i < num_events; ++i) {
+      events[i].events = EPOLLIN;
+      events[i].data.fd = kFirstFD + i;
+    }
+    return num_events;
+  }
+
+ private:
+  int num_ready_fds_;
+  mutable std::vector<int> mod_fd_masks_;
+};
+
+class RecordingCB : public EpollCallbackInterface {
+ public:
+  RecordingCB()
+      : eps_(nullptr),
+        num_events_(0),
+        num_unregistrations_(0),
+        num_shutdowns_(0),
+        unregister_on_event_(false) {}
+
+  void OnRegistration(EpollServer *eps, int /*fd*/,
+                      int /*event_mask*/) override {
+    eps_ = eps;
+  }
+  void OnModification(int /*fd*/, int /*event_mask*/) override {}
+  void OnEvent(int fd, EpollEvent * /*event*/) override {
+    ++num_events_;
+    if (unregister_on_event_) {
+      eps_->UnregisterFD(fd);
+    }
+  }
+  void OnUnregistration(int /*fd*/, bool /*replaced*/) override {
+    ++num_unregistrations_;
+  }
+  void OnShutdown(EpollServer * /*eps*/, int /*fd*/) override {
+    ++num_shutdowns_;
+  }
+  std::string Name() const override { return "RecordingCB"; }
+
+  void set_unregister_on_event(bool value) { unregister_on_event_ = value; }
+  int num_events() const { return num_events_; }
+  int num_unregistrations() const { return num_unregistrations_; }
+  int num_shutdowns() const { return num_shutdowns_; }
+
+ private:
+  EpollServer *eps_;
+  int num_events_;
+  int num_unregistrations_;
+  int num_shutdowns_;
+  bool unregister_on_event_;
+};
+
+TEST(EpollServerTest, RegisterSparseFDs) {
+  RecordingCB cb;
+  FakeEpollServer eps;
+  const std::vector<int> fds = {100, 1023, 1024, 5000, 70000};
+  for (int fd : fds) {
+    eps.RegisterFDForRead(fd, &cb);
+  }
+  EXPECT_EQ(static_cast<int>(fds.size()), eps.NumFDsRegistered());
+
+  for (int fd : fds) {
+    EXPECT_TRUE(eps.HasRegisterRead(fd));
+    EXPECT_FALSE(eps.HasRegisterWrite(fd));
+    eps.StartWrite(fd);
+    EXPECT_TRUE(eps.HasRegisterWrite(fd));
+  }
+  EXPECT_FALSE(eps.HasRegisterRead(101));
+  EXPECT_FALSE(eps.HasRegisterRead(-1));
+  EXPECT_FALSE(eps.HasRegisterRead(1 << 20));
+
+  eps.UnregisterFD(1024);
+  EXPECT_FALSE(eps.HasRegisterRead(1024));
+  EXPECT_EQ(static_cast<int>(fds.size()) - 1, eps.NumFDsRegistered());
+  EXPECT_EQ(1, cb.num_unregistrations());
+}
+
+TEST(EpollServerTest, ReadyListSurvivesGrowth) {
+  RecordingCB cb;
+  FakeEpollServer eps;
+  eps.RegisterFDForRead(10, &cb);
+  eps.SetFDReady(10, EPOLLIN);
+  EXPECT_TRUE(eps.IsFDReady(10));
+
+  // Registering a much higher fd grows the table; the entry of fd 10, which
+  // is linked into the ready list, must stay where it is.
+  eps.RegisterFDForRead(100000, &cb);
+  eps.HandleEvent(100000, EPOLLIN);
+  EXPECT_EQ(2u, eps.ReadyListSize());
+  eps.VerifyReadyList();
+
+  eps.set_timeout_in_us(0);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+  EXPECT_EQ(0u, eps.ReadyListSize());
+  EXPECT_FALSE(eps.IsFDReady(10));
+}
+
+TEST(EpollServerTest, UnregisterAndReregisterFromOnEvent) {
+  RecordingCB cb;
+  RecordingCB other_cb;
+  FakeEpollServer eps;
+  cb.set_unregister_on_event(true);
+  eps.RegisterFDForRead(7, &cb);
+  eps.SetFDReady(7, EPOLLIN);
+
+  eps.set_timeout_in_us(0);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+  EXPECT_EQ(1, cb.num_unregistrations());
+  EXPECT_FALSE(eps.HasRegisterRead(7));
+  EXPECT_EQ(0, eps.NumFDsRegistered());
+
+  // The slot can be taken again.
+  eps.RegisterFDForWrite(7, &other_cb);
+  EXPECT_TRUE(eps.HasRegisterWrite(7));
+  EXPECT_EQ(1, eps.NumFDsRegistered());
+}
+
+TEST(EpollServerTest, ShutdownCallsEveryCallback) {
+  RecordingCB cb;
+  {
+    FakeEpollServer eps;
+    for (int fd = 0; fd < 3000; fd += 3) {
+      eps.RegisterFDForRead(fd + 100, &cb);
+    }
+    eps.SetFDReady(100, EPOLLIN);
+  }
+  EXPECT_EQ(1000, cb.num_shutdowns());
+}
+
+TEST(EpollServerTest, WakeCoalescesUntilDrained) {
+  EpollServer eps;
+  eps.Wake();
+  eps.Wake();
+  eps.Wake();
+  EXPECT_EQ(2, eps.NumWakesCoalesced());
+
+  // Draining the eventfd lets the next Wake() write again.
+  eps.set_timeout_in_us(0);
+  eps.WaitForEventsAndExecuteCallbacks();
+  eps.Wake();
+  EXPECT_EQ(2, eps.NumWakesCoalesced());
+  eps.Wake();
+  EXPECT_EQ(3, eps.NumWakesCoalesced());
+}
+
+TEST(EpollServerTest, EventsArrayAdaptsToLoad) {
+  RecordingCB cb;
+  FakeEpollServer eps;
+  const int kNumFDs = 1000;
+  for (int i = 0; i < kNumFDs; ++i) {
+    eps.RegisterFDForRead(FakeEpollServer::kFirstFD + i, &cb);
+  }
+  eps.set_timeout_in_us(0);
+  EXPECT_EQ(EpollServer::kMinEventsSize, eps.EventsSize());
+
+  // Every full wait doubles the array, until all ready fds fit.
+  eps.set_num_ready_fds(kNumFDs);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(512u, eps.EventsSize());
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1024u, eps.EventsSize());
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1024u, eps.EventsSize());
+  EXPECT_EQ(256 + 512 + 1000, cb.num_events());
+
+  // It only shrinks after a long run of quiet waits.
+  eps.set_num_ready_fds(10);
+  for (int i = 0; i < EpollServer::kShrinkEventsAfterWaits - 1; ++i) {
+    eps.WaitForEventsAndExecuteCallbacks();
+  }
+  EXPECT_EQ(1024u, eps.EventsSize());
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(512u, eps.EventsSize());
+
+  // A busy wait in between starts the count again.
+  for (int i = 0; i < EpollServer::kShrinkEventsAfterWaits - 1; ++i) {
+    eps.WaitForEventsAndExecuteCallbacks();
+  }
+  eps.set_num_ready_fds(200);
+  eps.WaitForEventsAndExecuteCallbacks();
+  eps.set_num_ready_fds(10);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(512u, eps.EventsSize());
+
+  const std::vector<int64_t> &histogram = eps.EventsPerWaitHistogram();
+  ASSERT_EQ(11u, histogram.size());
+  EXPECT_EQ(2 * EpollServer::kShrinkEventsAfterWaits, histogram[4]);  // 10
+  EXPECT_EQ(1, histogram[8]);   // 200
+  EXPECT_EQ(1, histogram[9]);   // 256
+  EXPECT_EQ(2, histogram[10]);  // 512 and 1000
+}
+
+TEST(EpollServerTest, ModifyFDIsDeferredToTheWait) {
+  RecordingCB cb;
+  FakeEpollServer eps;
+  const int fd = FakeEpollServer::kFirstFD;
+  eps.RegisterFDForRead(fd, &cb);
+  eps.set_timeout_in_us(0);
+
+  for (int i = 0; i < 100; ++i) {
+    eps.StartWrite(fd);
+    eps.StopWrite(fd);
+  }
+  eps.StartWrite(fd);
+  EXPECT_TRUE(eps.HasRegisterWrite(fd));
+  EXPECT_TRUE(eps.mod_fd_masks().empty());
+  EXPECT_EQ(200, eps.NumEpollCtlsSaved());
+
+  // Only the net change reaches the epoll set.
+  eps.WaitForEventsAndExecuteCallbacks();
+  ASSERT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(EPOLLIN | EPOLLOUT, eps.mod_fd_masks()[0]);
+
+  // Changes which cancel out make no call at all.
+  eps.StopWrite(fd);
+  eps.StartWrite(fd);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(202, eps.NumEpollCtlsSaved());
+
+  // Nor does a change to an fd unregistered before the wait.
+  eps.StopWrite(fd);
+  eps.UnregisterFD(fd);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(203, eps.NumEpollCtlsSaved());
+}
+
+// An edge-triggered fd is re-armed by a MOD, so one which stopped and
+// started reading before the wait still gets it.
+TEST(EpollServerTest, ModifyFDRearmsEdgeTriggeredFDs) {
+  RecordingCB cb;
+  FakeEpollServer eps;
+  const int fd = FakeEpollServer::kFirstFD;
+  eps.RegisterFD(fd, &cb, EPOLLIN | EPOLLET);
+  eps.set_timeout_in_us(0);
+
+  eps.StopRead(fd);
+  eps.StartRead(fd);
+  eps.WaitForEventsAndExecuteCallbacks();
+  ASSERT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(EPOLLIN | EPOLLET, eps.mod_fd_masks()[0]);
+  EXPECT_EQ(1, eps.NumEpollCtlsSaved());
+
+  // Adding an event it already has re-arms nothing.
+  eps.StartRead(fd);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(2, eps.NumEpollCtlsSaved());
+
+  // Nor does adding and removing one it did not have.
+  eps.StartWrite(fd);
+  eps.StopWrite(fd);
+  eps.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1u, eps.mod_fd_masks().size());
+  EXPECT_EQ(4, eps.NumEpollCtlsSaved());
+}
+
+}  // namespace
+}  // namespace raner
@@ -4,6 +4,9 @@
 
 #include <gtest/gtest.h>
 
+#include <memory>
+#include <vector>
+
 namespace raner {
 namespace {
 
@@ -89,9 +92,7 @@ class MockEpollServer : public FakeTimeEpollServer {
     WaitForEventsAndExecuteCallbacks();
   }
 
-  std::unordered_set<AlarmCB *>::size_type NumberOfAlarms() const {
-    return all_alarms_.size();
-  }
+  size_t NumberOfAlarms() const { return NumAlarmsRegistered(); }
 
  protected:  // functions
   // These functions do nothing here, as we're not actually
@@ -231,5 +232,62 @@ TEST(EpollTimerTest, CreateTimerAndUpdate) {
   EXPECT_FALSE(timer->IsSet());
 }
 
+TEST(EpollTimerTest, TimersFireInDeadlineOrder) {
+  MockEpollServer epoll_server;
+  std::vector<int> fired;
+  std::vector<std::unique_ptr<EpollTimer>> timers;
+  const int kNumTimers = 100;
+  for (int i = 0; i < kNumTimers; ++i) {
+    timers.emplace_back(new EpollTimer(&epoll_server));
+    timers.back()->SetTimerCallback([&fired, i]() { fired.push_back(i); });
+  }
+  // Deadlines in a scrambled order: (i * 37) % kNumTimers is a permutation.
+  for (int i = 0; i < kNumTimers; ++i) {
+    int64_t delta = 1 + (i * 37) % kNumTimers;
+    timers[i]->Set(epoll_server.Now() + Duration(delta));
+  }
+  EXPECT_EQ(static_cast<size_t>(kNumTimers), epoll_server.NumberOfAlarms());
+
+  for (int i = 0; i < kNumTimers; ++i) {
+    epoll_server.AdvanceByExactlyAndCallCallbacks(1);
+  }
+  ASSERT_EQ(static_cast<size_t>(kNumTimers), fired.size());
+  for (int i = 1; i < kNumTimers; ++i) {
+    EXPECT_LT((fired[i - 1] * 37) % kNumTimers, (fired[i] * 37) % kNumTimers);
+  }
+  EXPECT_EQ(0u, epoll_server.NumberOfAlarms());
+}
+
+TEST(EpollTimerTest, UpdateAndCancelKeepAlarmCount) {
+  MockEpollServer epoll_server;
+  std::vector<std::unique_ptr<EpollTimer>> timers;
+  int fired = 0;
+  for (int i = 0; i < 10; ++i) {
+    timers.emplace_back(new EpollTimer(&epoll_server));
+    timers.back()->SetTimerCallback([&fired]() { ++fired; });
+    timers.back()->Set(epoll_server.Now() + Duration(10 + i));
+  }
+
+  // Rescheduling in either direction keeps each timer registered once.
+  timers[0]->Update(epoll_server.Now() + Duration(100));
+  timers[9]->Update(epoll_server.Now() + Duration(1));
+  timers[5]->Update(epoll_server.Now() + Duration(50));
+  EXPECT_EQ(10u, epoll_server.NumberOfAlarms());
+
+  // Cancel a few from the middle of the heap.
+  timers[3]->Cancel();
+  timers[4]->Cancel();
+  timers[7]->Cancel();
+  EXPECT_EQ(7u, epoll_server.NumberOfAlarms());
+
+  epoll_server.AdvanceByExactlyAndCallCallbacks(1);
+  EXPECT_EQ(1, fired);
+  epoll_server.AdvanceByExactlyAndCallCallbacks(30);
+  EXPECT_EQ(5, fired);
+  epoll_server.AdvanceByExactlyAndCallCallbacks(100);
+  EXPECT_EQ(7, fired);
+  EXPECT_EQ(0u, epoll_server.NumberOfAlarms());
+}
+
 }  // namespace
 }  // namespace raner
@@ -2,6 +2,13 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
 namespace raner {
 namespace {
 
@@ -51,5 +58,187 @@ TEST(EventLoopTest, GetCurrentThreadEventLoop) {
   new_thread.join();
 }
 
+TEST(EventLoopTest, RunAfterCoarse) {
+  EventLoop loop;
+  int fired = 0;
+  CoarseTimer cancelled([&fired]() { ++fired; });
+  CoarseTimer quit([&loop]() { loop.Quit(); });
+
+  Time start = Time::Now();
+  loop.RunAfterCoarse(Duration(1000), &cancelled);
+  loop.RunAfterCoarse(Duration(1000), &quit);
+  cancelled.Cancel();
+  loop.Loop();
+
+  EXPECT_EQ(0, fired);
+  EXPECT_FALSE(quit.IsSet());
+  EXPECT_LE(Duration(1000), Time::Now() - start);
+}
+
+TEST(EventLoopTest, QueueInLoopCoalescesWakeups) {
+  EventLoop loop;
+  const int kNumFunctors = 100;
+  int called = 0;
+
+  // The loop is not running, so only the first functor has to wake it.
+  std::thread producer([&]() {
+    for (int i = 0; i < kNumFunctors; ++i) {
+      loop.QueueInLoop([&called]() { ++called; });
+    }
+    loop.QueueInLoop([&loop]() { loop.Quit(); });
+  });
+  producer.join();
+  EXPECT_EQ(kNumFunctors, loop.NumWakeupsCoalesced());
+
+  loop.Loop();
+  EXPECT_EQ(kNumFunctors, called);
+}
+
+void queueInLoopFromManyThreads(EventLoop::Poller poller) {
+  EventLoop loop(poller);
+  const int kNumProducers = 4;
+  const int kFunctorsPerProducer = 10000;
+  std::vector<int> next_sequence(kNumProducers, 0);
+  int out_of_order = 0;
+  int done = 0;
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&, p]() {
+      for (int i = 0; i < kFunctorsPerProducer; ++i) {
+        loop.QueueInLoop([&, p, i]() {
+          int &expected = next_sequence[static_cast<size_t>(p)];
+          if (expected != i) {
+            ++out_of_order;
+          }
+          expected = i + 1;
+          if (++done == kNumProducers * kFunctorsPerProducer) {
+            loop.Quit();
+          }
+        });
+      }
+    });
+  }
+  loop.Loop();
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+
+  EXPECT_EQ(0, out_of_order);
+  EXPECT_EQ(kNumProducers * kFunctorsPerProducer, done);
+  EXPECT_EQ(0u, loop.QueueSize());
+}
+
+TEST(EventLoopTest, QueueInLoopFromManyThreads) {
+  queueInLoopFromManyThreads(EventLoop::kEpoll);
+}
+
+TEST(EventLoopTest, QueueInLoopFromManyThreadsWithIOUring) {
+  queueInLoopFromManyThreads(EventLoop::kIOUring);
+}
+
+// Returns the smallest lateness, in microseconds, of a number of 200us
+// timers on 'loop'.
+int64_t minTimerLatenessUs(EventLoop *loop) {
+  int64_t min_lateness_us = std::numeric_limits<int64_t>::max();
+  Time deadline;
+  std::unique_ptr<EpollTimer> timer = loop->CreateTimer([&] {
+    min_lateness_us =
+        std::min(min_lateness_us, (Time::Now() - deadline).count());
+    loop->Quit();
+  });
+  for (int i = 0; i < 20; ++i) {
+    deadline = Time::Now() + Duration(200);
+    timer->Update(deadline);
+    loop->Loop();
+  }
+  return min_lateness_us;
+}
+
+TEST(EventLoopTest, SpinBudget) {
+  EventLoop loop;
+  loop.SetSpinBudget(Duration(1000 * 1000));
+  const EpollServer *eps = loop.epoll_server();
+
+  // Found while spinning.
+  std::thread producer([&loop]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    loop.QueueInLoop([&loop]() { loop.Quit(); });
+  });
+  loop.Loop();
+  producer.join();
+  EXPECT_EQ(1, eps->NumProductivePolls());
+  EXPECT_LT(0, eps->NumEmptyPolls());
+  EXPECT_EQ(0, eps->NumSpinsFallenAsleep());
+
+  // Not found before the budget runs out.
+  loop.SetSpinBudget(Duration(1000));
+  std::unique_ptr<EpollTimer> timer =
+      loop.CreateTimer([&loop]() { loop.Quit(); });
+  timer->Update(Time::Now() + Duration(20 * 1000));
+  loop.Loop();
+  EXPECT_LE(1, eps->NumSpinsFallenAsleep());
+}
+
+TEST(EventLoopTest, HighResolutionTimers) {
+  EventLoop loop;
+  // A wait in milliseconds rounds 200us up to a whole one.
+  EXPECT_GE(minTimerLatenessUs(&loop), 500);
+  loop.SetHighResolutionTimers(true);
+  EXPECT_LT(minTimerLatenessUs(&loop), 500);
+}
+
+TEST(EventLoopTest, HighResolutionTimersWithIOUring) {
+  EventLoop loop(EventLoop::kIOUring);
+  loop.SetHighResolutionTimers(true);
+  EXPECT_LT(minTimerLatenessUs(&loop), 500);
+}
+
+TEST(EventLoopTest, LoopTimeIsCachedPerIteration) {
+  EventLoop loop;
+  loop.SetTSCClock(true);
+  std::vector<Time> times;
+  // Two functors queued together run in one iteration, between the events
+  // and the next wait. Queued from another thread, they wake the loop up.
+  std::thread producer([&loop, &times]() {
+    loop.QueueInLoop([&loop, &times]() {
+      times.push_back(loop.LoopTime());
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    });
+    loop.QueueInLoop([&loop, &times]() {
+      times.push_back(loop.LoopTime());
+      loop.QueueInLoop([&loop, &times]() {
+        times.push_back(loop.LoopTime());
+        loop.Quit();
+      });
+    });
+  });
+  producer.join();
+  loop.Loop();
+  ASSERT_EQ(3u, times.size());
+  EXPECT_EQ(times[0], times[1]);
+  EXPECT_LE(times[1] + Duration(2000), times[2]);
+}
+
+TEST(EventLoopTest, QueueSizeCountsTheFunctorsNotRunYet) {
+  EventLoop loop;
+  EXPECT_EQ(0u, loop.QueueSize());
+  std::thread producer([&loop]() {
+    for (int i = 0; i < 3; ++i) {
+      loop.QueueInLoop([]() {});
+    }
+  });
+  producer.join();
+  EXPECT_EQ(3u, loop.QueueSize());
+  // The functors before this one have run, and the one it queues waits for
+  // the next iteration.
+  loop.QueueInLoop([&loop]() {
+    loop.QueueInLoop([&loop]() { loop.Quit(); });
+    EXPECT_EQ(1u, loop.QueueSize());
+  });
+  loop.Loop();
+  EXPECT_EQ(0u, loop.QueueSize());
+}
+
 }  // namespace
 }  // namespace raner
@@ -0,0 +1,361 @@
+#include "raner/io_uring_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "raner/byte_buffer.h"
+#include "raner/output_queue.h"
+
+namespace raner {
+namespace {
+
+class RecordingCB : public EpollCallbackInterface {
+ public:
+  RecordingCB() : num_events_(0), last_events_(0) {}
+
+  void OnRegistration(EpollServer * /*eps*/, int /*fd*/,
+                      int /*event_mask*/) override {}
+  void OnModification(int /*fd*/, int /*event_mask*/) override {}
+  void OnEvent(int /*fd*/, EpollEvent *event) override {
+    ++num_events_;
+    last_events_ = event->in_events;
+  }
+  void OnUnregistration(int /*fd*/, bool /*replaced*/) override {}
+  void OnShutdown(EpollServer * /*eps*/, int /*fd*/) override {}
+  std::string Name() const override { return "RecordingCB"; }
+
+  int num_events() const { return num_events_; }
+  int last_events() const { return last_events_; }
+
+ private:
+  int num_events_;
+  int last_events_;
+};
+
+class Pipe {
+ public:
+  Pipe() { EXPECT_EQ(0, pipe(fds_)); }
+  ~Pipe() {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  int read_fd() const { return fds_[0]; }
+  int write_fd() const { return fds_[1]; }
+
+  void Write() { EXPECT_EQ(1, write(fds_[1], "x", 1)); }
+  void Drain() {
+    char buf[64];
+    while (read(fds_[0], buf, sizeof(buf)) > 0) {
+    }
+  }
+
+ private:
+  int fds_[2];
+};
+
+// Long enough for a completion to arrive, short enough to keep the test
+// fast when none is expected.
+const int64_t kWaitUs = 50 * 1000;
+
+class IOUringServerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    if (!IOUringServer::IsSupported()) {
+      GTEST_SKIP() << "io_uring is not supported";
+    }
+  }
+};
+
+TEST_F(IOUringServerTest, LevelTriggeredReportsUntilDrained) {
+  RecordingCB cb;
+  Pipe pipe;
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(pipe.read_fd(), &cb);
+
+  pipe.Write();
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+  EXPECT_TRUE(cb.last_events() & EPOLLIN);
+
+  // Not drained, so it is reported again.
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+
+  pipe.Drain();
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+  server.UnregisterFD(pipe.read_fd());
+}
+
+TEST_F(IOUringServerTest, EdgeTriggeredReportsNewDataOnly) {
+  RecordingCB cb;
+  Pipe pipe;
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFD(pipe.read_fd(), &cb, EPOLLIN | EPOLLET);
+
+  pipe.Write();
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+
+  pipe.Write();
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+  server.UnregisterFD(pipe.read_fd());
+}
+
+TEST_F(IOUringServerTest, MaskChangesAreBatchedIntoTheWait) {
+  RecordingCB cb;
+  Pipe pipe;
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(pipe.write_fd(), &cb);
+
+  const int64_t num_enters = server.NumEnters();
+  for (int i = 0; i < 100; ++i) {
+    server.StartWrite(pipe.write_fd());
+    server.StopWrite(pipe.write_fd());
+  }
+  server.StartWrite(pipe.write_fd());
+  EXPECT_EQ(num_enters, server.NumEnters());
+
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(num_enters + 1, server.NumEnters());
+  EXPECT_EQ(1, cb.num_events());
+  EXPECT_TRUE(cb.last_events() & EPOLLOUT);
+  server.UnregisterFD(pipe.write_fd());
+}
+
+TEST_F(IOUringServerTest, UnregisteredFDIsNotReported) {
+  RecordingCB cb;
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  int fd;
+  {
+    Pipe pipe;
+    fd = pipe.read_fd();
+    server.RegisterFDForRead(pipe.read_fd(), &cb);
+    pipe.Write();
+    server.UnregisterFD(pipe.read_fd());
+  }
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(0, cb.num_events());
+
+  // A new registration of the same fd number only sees its own events.
+  Pipe pipe;
+  ASSERT_EQ(fd, pipe.read_fd());
+  server.RegisterFDForRead(pipe.read_fd(), &cb);
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(0, cb.num_events());
+  pipe.Write();
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+  server.UnregisterFD(pipe.read_fd());
+}
+
+TEST_F(IOUringServerTest, MultishotRecvReceivesUntilTheEndOfTheStream) {
+  RecordingCB cb;
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(fds[0], &cb);
+  if (!server.SetMultishotRecv(fds[0])) {
+    server.UnregisterFD(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    GTEST_SKIP() << "io_uring has no provided buffer rings";
+  }
+
+  ByteBuffer buf;
+  int saved_errno = 0;
+  EXPECT_EQ(-1, server.Receive(fds[0], &buf, &saved_errno));
+  EXPECT_EQ(EAGAIN, saved_errno);
+
+  EXPECT_EQ(5, write(fds[1], "hello", 5));
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+  EXPECT_TRUE(cb.last_events() & EPOLLIN);
+  EXPECT_EQ(5, server.Receive(fds[0], &buf, &saved_errno));
+  EXPECT_EQ("hello", buf.ToString());
+  EXPECT_EQ(1, server.NumTransfers());
+
+  // Taken, so not reported again.
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+
+  shutdown(fds[1], SHUT_WR);
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+  EXPECT_EQ(0, server.Receive(fds[0], &buf, &saved_errno));
+  server.UnregisterFD(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(IOUringServerTest, ReceiveLendsTheRingBuffer) {
+  RecordingCB cb;
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(fds[0], &cb);
+  if (!server.SetMultishotRecv(fds[0])) {
+    server.UnregisterFD(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    GTEST_SKIP() << "io_uring has no provided buffer rings";
+  }
+
+  ByteBuffer buf;
+  int saved_errno = 0;
+  EXPECT_EQ(11, write(fds[1], "hello world", 11));
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(11, server.Receive(fds[0], &buf, &saved_errno));
+  EXPECT_TRUE(buf.borrowed());
+  EXPECT_EQ("hello", buf.ToString(5));
+  server.Reclaim(fds[0], &buf);
+  EXPECT_FALSE(buf.borrowed());
+
+  // With bytes left over, what comes next is copied after them.
+  EXPECT_EQ(1, write(fds[1], "!", 1));
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, server.Receive(fds[0], &buf, &saved_errno));
+  EXPECT_FALSE(buf.borrowed());
+  EXPECT_EQ(" world!", buf.ToString());
+  server.UnregisterFD(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(IOUringServerTest, SendsGoWithTheWait) {
+  RecordingCB cb;
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(fds[0], &cb);
+
+  OutputQueue queue;
+  queue.Append("hello ", 6);
+  queue.Append(std::string(OutputQueue::kMinMoveSize, 'x'));
+  const int64_t num_enters = server.NumEnters();
+  ASSERT_TRUE(server.Send(fds[0], queue));
+  EXPECT_TRUE(server.IsSending(fds[0]));
+  EXPECT_FALSE(server.Send(fds[0], queue));
+  int saved_errno = 0;
+  EXPECT_EQ(-1, server.TakeSent(fds[0], &saved_errno));
+  EXPECT_EQ(EAGAIN, saved_errno);
+  EXPECT_EQ(num_enters, server.NumEnters());
+
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(num_enters + 1, server.NumEnters());
+  EXPECT_EQ(1, cb.num_events());
+  EXPECT_TRUE(cb.last_events() & EPOLLOUT);
+  const ssize_t n = server.TakeSent(fds[0], &saved_errno);
+  EXPECT_EQ(static_cast<ssize_t>(queue.ReadableBytes()), n);
+  EXPECT_FALSE(server.IsSending(fds[0]));
+  queue.Skip(static_cast<size_t>(n));
+  char received[16];
+  EXPECT_EQ(6, read(fds[1], received, 6));
+  EXPECT_EQ("hello ", std::string(received, 6));
+
+  // A level-triggered socket is not polled for EPOLLOUT while it sends.
+  server.StartWrite(fds[0]);
+  queue.Append("again", 5);
+  ASSERT_TRUE(server.Send(fds[0], queue));
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2, cb.num_events());
+  EXPECT_EQ(5, server.TakeSent(fds[0], &saved_errno));
+  server.UnregisterFD(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(IOUringServerTest, SendsOutliveTheirRegistration) {
+  RecordingCB cb;
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(fds[0], &cb);
+
+  // The socket is full, so the send waits for room, holding the queue's
+  // buffers after the queue is gone, until it is cancelled.
+  const std::string block(4096, 'x');
+  while (write(fds[0], block.data(), block.size()) > 0) {
+  }
+  {
+    OutputQueue queue;
+    queue.Append(block);
+    ASSERT_TRUE(server.Send(fds[0], queue));
+    server.WaitForEventsAndExecuteCallbacks();
+  }
+  EXPECT_EQ(0, cb.num_events());
+  server.UnregisterFD(fds[0]);
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_FALSE(server.IsSending(fds[0]));
+  close(fds[0]);
+  close(fds[1]);
+  server.WaitForEventsAndExecuteCallbacks();
+}
+
+TEST_F(IOUringServerTest, MultishotAcceptQueuesTheConnections) {
+  RecordingCB cb;
+  const int listen_fd =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  ASSERT_GE(listen_fd, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(0, bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr)));
+  ASSERT_EQ(0, listen(listen_fd, 16));
+  ASSERT_EQ(0, getsockname(listen_fd,
+                           reinterpret_cast<struct sockaddr *>(&addr), &len));
+  IOUringServer server;
+  server.set_timeout_in_us(kWaitUs);
+  server.RegisterFDForRead(listen_fd, &cb);
+  if (!server.SetMultishotAccept(listen_fd)) {
+    server.UnregisterFD(listen_fd);
+    close(listen_fd);
+    GTEST_SKIP() << "io_uring has no multishot accept";
+  }
+
+  int clients[2];
+  for (int &client : clients) {
+    client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_EQ(0, connect(client, reinterpret_cast<struct sockaddr *>(&addr),
+                         sizeof(addr)));
+  }
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(1, cb.num_events());
+  for (int i = 0; i < 2; ++i) {
+    const int fd = server.Accept(listen_fd);
+    EXPECT_GE(fd, 0);
+    close(fd);
+  }
+  EXPECT_EQ(-1, server.Accept(listen_fd));
+  EXPECT_EQ(EAGAIN, errno);
+  EXPECT_EQ(2, server.NumTransfers());
+  server.UnregisterFD(listen_fd);
+  close(listen_fd);
+  for (int client : clients) {
+    close(client);
+  }
+}
+
+}  // namespace
+}  // namespace raner
@@ -0,0 +1,155 @@
+#include "raner/loop_placement.h"
+
+#include <gtest/gtest.h>
+
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/event_loop_thread_pool.h"
+
+namespace raner {
+namespace {
+
+// Gives the loops of 'pool' the given numbers of connections.
+void setConnections(EventLoopThreadPool *pool,
+                    const std::vector<int> &num_connections) {
+  std::vector<EventLoop *> loops = pool->GetAllLoops();
+  ASSERT_EQ(loops.size(), num_connections.size());
+  for (size_t i = 0; i < loops.size(); ++i) {
+    loops[i]->AddConnections(num_connections[i] - loops[i]->NumConnections());
+  }
+}
+
+TEST(LoopPlacementTest, LeastConnectionsPicksTheEmptiestLoop) {
+  EventLoop loop;
+  EventLoopThreadPool pool(&loop, "least");
+  pool.SetThreadNum(3);
+  pool.SetPlacementPolicy(std::unique_ptr<LoopPlacementPolicy>(
+      new LeastConnectionsPlacement()));
+  pool.Start();
+  const std::vector<EventLoop *> loops = pool.GetAllLoops();
+
+  setConnections(&pool, {2, 1, 3});
+  EXPECT_EQ(loops[1], pool.GetLoopForConnection(-1));
+  setConnections(&pool, {0, 1, 0});
+  EXPECT_EQ(loops[0], pool.GetLoopForConnection(-1));
+
+  const std::vector<EventLoopThreadPool::LoopStats> stats =
+      pool.GetLoopStats();
+  ASSERT_EQ(3u, stats.size());
+  EXPECT_EQ(loops[1], stats[1].loop);
+  EXPECT_EQ(1, stats[1].num_connections);
+  setConnections(&pool, {0, 0, 0});
+}
+
+TEST(LoopPlacementTest, PowerOfTwoChoicesNeverPicksTheFullest) {
+  EventLoop loop;
+  EventLoopThreadPool pool(&loop, "two");
+  pool.SetThreadNum(3);
+  pool.SetPlacementPolicy(std::unique_ptr<LoopPlacementPolicy>(
+      new PowerOfTwoChoicesPlacement()));
+  pool.Start();
+  const std::vector<EventLoop *> loops = pool.GetAllLoops();
+
+  setConnections(&pool, {0, 0, 5});
+  int picked[2] = {0, 0};
+  for (int i = 0; i < 100; ++i) {
+    EventLoop *picked_loop = pool.GetLoopForConnection(-1);
+    ASSERT_NE(loops[2], picked_loop);
+    ++picked[picked_loop == loops[0] ? 0 : 1];
+  }
+  EXPECT_LT(0, picked[0]);
+  EXPECT_LT(0, picked[1]);
+  setConnections(&pool, {0, 0, 0});
+}
+
+TEST(LoopPlacementTest, LeastBusyAvoidsABusyLoop) {
+  EventLoop loop;
+  EventLoopThreadPool pool(&loop, "busy");
+  pool.SetThreadNum(2);
+  pool.SetPlacementPolicy(
+      std::unique_ptr<LoopPlacementPolicy>(new LeastBusyPlacement()));
+  pool.Start();
+  const std::vector<EventLoop *> loops = pool.GetAllLoops();
+
+  // With no load, the one with fewer connections.
+  setConnections(&pool, {1, 0});
+  EXPECT_EQ(loops[1], pool.GetLoopForConnection(-1));
+
+  // Keeps the second loop busy for a while.
+  const int64_t busy_time_in_us = loops[1]->BusyTimeInUs();
+  std::promise<void> done;
+  loops[1]->RunInLoop([&done] {
+    const Time end = Time::Now() + Duration(30 * 1000);
+    while (Time::Now() < end) {
+    }
+    done.set_value();
+  });
+  done.get_future().wait();
+  // Busy time is counted at the end of the iteration.
+  while (loops[1]->BusyTimeInUs() - busy_time_in_us < 30 * 1000) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(loops[0], pool.GetLoopForConnection(-1));
+  setConnections(&pool, {0, 0});
+}
+
+TEST(LoopPlacementTest, IncomingCPUFallsBackWithoutACPU) {
+  EventLoop loop;
+  EventLoopThreadPool pool(&loop, "cpu");
+  pool.SetThreadNum(2);
+  pool.SetPlacementPolicy(
+      std::unique_ptr<LoopPlacementPolicy>(new IncomingCPUPlacement()));
+  pool.Start();
+  const std::vector<EventLoop *> loops = pool.GetAllLoops();
+
+  // Not a socket, so least connections decides.
+  setConnections(&pool, {1, 0});
+  EXPECT_EQ(loops[1], pool.GetLoopForConnection(-1));
+  setConnections(&pool, {0, 1});
+  EXPECT_EQ(loops[0], pool.GetLoopForConnection(-1));
+  setConnections(&pool, {0, 0});
+}
+
+// Round robin reads no load statistics, so its loops do not pay for them.
+TEST(LoopPlacementTest, LoopsKeepOnlyTheStatsThePolicyReads) {
+  EventLoop loop;
+  EventLoopThreadPool pool(&loop, "stats");
+  pool.SetThreadNum(2);
+  pool.Start();
+  const std::vector<EventLoop *> loops = pool.GetAllLoops();
+  std::promise<void> done;
+  loops[0]->RunInLoop([&done] {
+    const Time end = Time::Now() + Duration(10 * 1000);
+    while (Time::Now() < end) {
+    }
+    done.set_value();
+  });
+  done.get_future().wait();
+  // Once the iteration has ended.
+  std::promise<void> next;
+  loops[0]->QueueInLoop([&next] { next.set_value(); });
+  next.get_future().wait();
+  EXPECT_EQ(0, loops[0]->BusyTimeInUs());
+  EXPECT_EQ(-1, loops[0]->LastCPU());
+
+  EventLoopThreadPool cpu_pool(&loop, "cpu");
+  cpu_pool.SetThreadNum(2);
+  cpu_pool.SetPlacementPolicy(
+      std::unique_ptr<LoopPlacementPolicy>(new IncomingCPUPlacement()));
+  cpu_pool.Start();
+  EventLoop *cpu_loop = cpu_pool.GetAllLoops()[0];
+  // Waits for an iteration to end, as above.
+  for (int i = 0; i < 2; ++i) {
+    std::promise<void> iteration;
+    cpu_loop->QueueInLoop([&iteration] { iteration.set_value(); });
+    iteration.get_future().wait();
+  }
+  EXPECT_LE(0, cpu_loop->LastCPU());
+  EXPECT_EQ(0, cpu_loop->BusyTimeInUs());
+}
+
+}  // namespace
+}  // namespace raner
@@ -0,0 +1,174 @@
+#include "raner/mpsc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace raner {
+namespace {
+
+struct Item : public MPSCQueueNode {
+  Item(int p, int s) : producer(p), sequence(s) {}
+
+  int producer;
+  int sequence;
+};
+
+TEST(MPSCQueueTest, SingleThreadIsFIFO) {
+  MPSCQueue queue;
+  EXPECT_EQ(nullptr, queue.Pop());
+
+  Item a(0, 0);
+  Item b(0, 1);
+  Item c(0, 2);
+  queue.Push(&a);
+  EXPECT_EQ(&a, queue.Pop());
+  EXPECT_EQ(nullptr, queue.Pop());
+
+  // Nodes can be pushed again once popped.
+  queue.Push(&b);
+  queue.Push(&c);
+  queue.Push(&a);
+  EXPECT_EQ(&b, queue.Pop());
+  EXPECT_EQ(&c, queue.Pop());
+  EXPECT_EQ(&a, queue.Pop());
+  EXPECT_EQ(nullptr, queue.Pop());
+}
+
+TEST(MPSCQueueTest, EmptyAndSize) {
+  MPSCQueue queue;
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_EQ(0u, queue.Size());
+
+  Item a(0, 0);
+  Item b(0, 1);
+  queue.Push(&a);
+  queue.Push(&b);
+  EXPECT_FALSE(queue.Empty());
+  EXPECT_EQ(2u, queue.Size());
+  EXPECT_EQ(&a, queue.Pop());
+  EXPECT_EQ(1u, queue.Size());
+  EXPECT_EQ(&b, queue.Pop());
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_EQ(0u, queue.Size());
+}
+
+TEST(MPSCQueueTest, ProducersKeepTheirOrder) {
+  const int kNumProducers = 4;
+  const int kItemsPerProducer = 100000;
+  MPSCQueue queue;
+
+  std::vector<std::unique_ptr<Item>> items;
+  for (int p = 0; p < kNumProducers; ++p) {
+    for (int i = 0; i < kItemsPerProducer; ++i) {
+      items.emplace_back(new Item(p, i));
+    }
+  }
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&queue, &items, p, kItemsPerProducer]() {
+      for (int i = 0; i < kItemsPerProducer; ++i) {
+        queue.Push(items[static_cast<size_t>(p * kItemsPerProducer + i)].get());
+      }
+    });
+  }
+
+  std::vector<int> next_sequence(kNumProducers, 0);
+  int popped = 0;
+  while (popped < kNumProducers * kItemsPerProducer) {
+    MPSCQueueNode *node = queue.Pop();
+    if (node == nullptr) {
+      std::this_thread::yield();
+      continue;
+    }
+    Item *item = static_cast<Item *>(node);
+    ASSERT_EQ(next_sequence[static_cast<size_t>(item->producer)],
+              item->sequence);
+    ++next_sequence[static_cast<size_t>(item->producer)];
+    ++popped;
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+  EXPECT_EQ(nullptr, queue.Pop());
+}
+
+TEST(MPSCNodeStackTest, RecyclesNodesBetweenProducersAndConsumer) {
+  const int kNumProducers = 4;
+  const int kPushesPerProducer = 100000;
+  const int kNumNodes = 64;
+  MPSCQueue queue;
+  MPSCNodeStack free_nodes;
+  EXPECT_EQ(nullptr, free_nodes.TakeAll());
+
+  // 'producer' is -1 while a node is free.
+  std::vector<std::unique_ptr<Item>> items;
+  for (int i = 0; i < kNumNodes; ++i) {
+    items.emplace_back(new Item(-1, 0));
+    free_nodes.Push(items.back().get(), items.back().get());
+  }
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&queue, &free_nodes, p, kPushesPerProducer]() {
+      MPSCQueueNode *taken = nullptr;
+      for (int i = 0; i < kPushesPerProducer; ++i) {
+        while (taken == nullptr) {
+          taken = free_nodes.TakeAll();
+          if (taken == nullptr) {
+            std::this_thread::yield();
+          }
+        }
+        Item *item = static_cast<Item *>(taken);
+        taken = taken->next.load(std::memory_order_relaxed);
+        ASSERT_EQ(-1, item->producer);
+        item->producer = p;
+        item->sequence = i;
+        queue.Push(item);
+      }
+      if (taken != nullptr) {
+        MPSCQueueNode *last = taken;
+        while (last->next.load(std::memory_order_relaxed) != nullptr) {
+          last = last->next.load(std::memory_order_relaxed);
+        }
+        free_nodes.Push(taken, last);
+      }
+    });
+  }
+
+  std::vector<int> next_sequence(kNumProducers, 0);
+  int popped = 0;
+  while (popped < kNumProducers * kPushesPerProducer) {
+    MPSCQueueNode *node = queue.Pop();
+    if (node == nullptr) {
+      std::this_thread::yield();
+      continue;
+    }
+    Item *item = static_cast<Item *>(node);
+    ASSERT_LE(0, item->producer);
+    ASSERT_EQ(next_sequence[static_cast<size_t>(item->producer)],
+              item->sequence);
+    ++next_sequence[static_cast<size_t>(item->producer)];
+    ++popped;
+    item->producer = -1;
+    free_nodes.Push(item, item);
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+
+  // Every node is back, once.
+  int num_free = 0;
+  for (MPSCQueueNode *node = free_nodes.TakeAll(); node != nullptr;
+       node = node->next.load(std::memory_order_relaxed)) {
+    EXPECT_EQ(-1, static_cast<Item *>(node)->producer);
+    ++num_free;
+  }
+  EXPECT_EQ(kNumNodes, num_free);
+}
+
+}  // namespace
+}  // namespace raner
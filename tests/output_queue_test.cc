@@ -0,0 +1,324 @@
+#include "raner/output_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "raner/byte_buffer.h"
+#include "raner/shared_file.h"
+#include "raner/shared_payload.h"
+
+namespace raner {
+namespace {
+
+std::string pattern(size_t len, char first) {
+  std::string s(len, '\0');
+  for (size_t i = 0; i < len; ++i) {
+    s[i] = static_cast<char>(first + i % 26);
+  }
+  return s;
+}
+
+// A non-blocking stream socket pair, for WriteFD().
+class OutputQueueTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds_));
+  }
+  void TearDown() override {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  // Writes the whole queue, reading as it goes, and returns what was read.
+  std::string drain(OutputQueue *queue) {
+    std::string received;
+    char buf[65536];
+    while (!queue->Empty()) {
+      int saved_errno = 0;
+      ssize_t n = queue->WriteFD(fds_[0], &saved_errno);
+      if (n < 0) {
+        EXPECT_EQ(EAGAIN, saved_errno);
+      }
+      while ((n = read(fds_[1], buf, sizeof(buf))) > 0) {
+        received.append(buf, static_cast<size_t>(n));
+      }
+    }
+    EXPECT_EQ(0u, queue->ReadableBytes());
+    EXPECT_EQ(0u, queue->NumChunks());
+    return received;
+  }
+
+  int fds_[2];
+};
+
+TEST_F(OutputQueueTest, SmallAppendsShareABlock) {
+  OutputQueue queue;
+  std::string expected;
+  for (int i = 0; i < 100; ++i) {
+    const std::string s = pattern(10, static_cast<char>('a' + i % 26));
+    queue.Append(s);
+    queue.Append(std::string(s));
+    expected += s + s;
+  }
+  EXPECT_EQ(1u, queue.NumChunks());
+  EXPECT_EQ(expected.size(), queue.ReadableBytes());
+  EXPECT_EQ(expected, drain(&queue));
+}
+
+// Gather() hands out the chunks as they are, for a write by other means,
+// and the block written out last takes the next bytes.
+TEST_F(OutputQueueTest, GathersAndReusesTheLastBlock) {
+  OutputQueue queue;
+  queue.Append("head", 4);
+  const std::string body = pattern(OutputQueue::kMinMoveSize, 'a');
+  queue.Append(std::string(body));
+  struct iovec iov[2];
+  size_t bytes = 0;
+  std::vector<std::shared_ptr<const void>> owners;
+  ASSERT_EQ(2u, queue.Gather(iov, 2, &bytes, &owners));
+  EXPECT_EQ(4 + body.size(), bytes);
+  EXPECT_EQ(2u, owners.size());
+  EXPECT_EQ("head", std::string(static_cast<const char *>(iov[0].iov_base),
+                                iov[0].iov_len));
+  EXPECT_EQ(1u, queue.Gather(iov, 1, &bytes, nullptr));
+  EXPECT_EQ(4u, bytes);
+
+  // Held by 'owners', as by a write in flight, the block is not reused.
+  queue.Skip(4 + body.size());
+  EXPECT_TRUE(queue.Empty());
+  queue.Append("next", 4);
+  ASSERT_EQ(1u, queue.Gather(iov, 2, &bytes, nullptr));
+  const void *next = iov[0].iov_base;
+  EXPECT_NE(owners[0].get(), next);
+  owners.clear();
+  EXPECT_EQ("next", drain(&queue));
+  queue.Append("more", 4);
+  ASSERT_EQ(1u, queue.Gather(iov, 2, &bytes, nullptr));
+  EXPECT_EQ(next, iov[0].iov_base);
+  EXPECT_EQ("more", drain(&queue));
+}
+
+TEST_F(OutputQueueTest, OwnedBuffersAreMovedIn) {
+  OutputQueue queue;
+  const std::string head = pattern(100, 'a');
+  const std::string body = pattern(64 * 1024, 'b');
+  const std::string tail = pattern(5000, 'c');
+  queue.Append(head);
+
+  std::string owned = body;
+  const char *owned_data = owned.data();
+  queue.Append(std::move(owned));
+  EXPECT_EQ(2u, queue.NumChunks());
+  EXPECT_NE(owned_data, owned.data());
+
+  ByteBuffer buf;
+  buf.Write(tail);
+  queue.Append(&buf);
+  EXPECT_EQ(0u, buf.ReadableBytes());
+  EXPECT_EQ(3u, queue.NumChunks());
+
+  std::string offset = pattern(2000, 'd');
+  queue.Append(std::move(offset), 500);
+  EXPECT_EQ(4u, queue.NumChunks());
+
+  const std::string expected =
+      head + body + tail + pattern(2000, 'd').substr(500);
+  EXPECT_EQ(expected.size(), queue.ReadableBytes());
+  EXPECT_EQ(expected, drain(&queue));
+}
+
+TEST_F(OutputQueueTest, PartialWritesKeepTheRest) {
+  int sndbuf = 4096;
+  ASSERT_EQ(0, setsockopt(fds_[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                          sizeof(sndbuf)));
+  OutputQueue queue;
+  const std::string body = pattern(1024 * 1024, 'a');
+  queue.Append(body);
+  queue.Append("tail", 4);
+
+  int saved_errno = 0;
+  const ssize_t n = queue.WriteFD(fds_[0], &saved_errno);
+  ASSERT_LT(0, n);
+  ASSERT_LT(static_cast<size_t>(n), body.size());
+  EXPECT_EQ(body.size() + 4 - static_cast<size_t>(n), queue.ReadableBytes());
+
+  std::string received(static_cast<size_t>(n), '\0');
+  ASSERT_EQ(n, read(fds_[1], &received[0], received.size()));
+  received += drain(&queue);
+  EXPECT_EQ(body + "tail", received);
+}
+
+TEST_F(OutputQueueTest, WritesAtMostIOVMaxChunksAtOnce) {
+  OutputQueue queue;
+  const size_t num_chunks = IOV_MAX + 100;
+  std::string expected;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    std::string s = pattern(OutputQueue::kMinMoveSize,
+                            static_cast<char>('a' + i % 26));
+    expected += s;
+    queue.Append(std::move(s));
+  }
+  EXPECT_EQ(num_chunks, queue.NumChunks());
+  EXPECT_EQ(IOV_MAX * OutputQueue::kMinMoveSize, queue.MaxWriteFDBytes());
+  EXPECT_EQ(expected, drain(&queue));
+}
+
+TEST_F(OutputQueueTest, SharedPayloadsAreQueuedByReference) {
+  const std::string bytes = pattern(100, 'a');
+  const SharedPayload payload(bytes.data(), bytes.size());
+  EXPECT_EQ(1, payload.use_count());
+  {
+    OutputQueue queue;
+    OutputQueue other;
+    queue.Append("head", 4);
+    queue.Append(payload);
+    other.Append(payload, 10);
+    EXPECT_EQ(3, payload.use_count());
+    EXPECT_EQ(2u, queue.NumChunks());
+    EXPECT_EQ(90u, other.ReadableBytes());
+    EXPECT_EQ("head" + bytes, drain(&queue));
+    EXPECT_EQ(2, payload.use_count());
+    EXPECT_EQ(bytes.substr(10), drain(&other));
+  }
+  EXPECT_EQ(1, payload.use_count());
+  EXPECT_EQ(bytes, payload.ToStringView());
+}
+
+// A temporary file holding 'content'.
+SharedFile tempFile(const std::string &content) {
+  FILE *file = tmpfile();
+  EXPECT_TRUE(file != nullptr);
+  EXPECT_EQ(content.size(), fwrite(content.data(), 1, content.size(), file));
+  EXPECT_EQ(0, fflush(file));
+  SharedFile shared = SharedFile::Dup(fileno(file));
+  fclose(file);
+  EXPECT_TRUE(shared.valid());
+  return shared;
+}
+
+TEST_F(OutputQueueTest, FilesAreSentInOrder) {
+  const std::string content = pattern(256 * 1024, 'a');
+  OutputQueue queue;
+  queue.Append("head", 4);
+  queue.AppendFile(tempFile(content), 100, content.size() - 200);
+  queue.Append("tail", 4);
+  EXPECT_EQ(3u, queue.NumChunks());
+  EXPECT_EQ(content.size() - 200 + 8, queue.ReadableBytes());
+  // The file waits for the bytes before it.
+  EXPECT_EQ(4u, queue.MaxWriteFDBytes());
+  EXPECT_EQ("head" + content.substr(100, content.size() - 200) + "tail",
+            drain(&queue));
+}
+
+TEST_F(OutputQueueTest, FilesAreWrittenUntilTheSocketIsFull) {
+  // One sendfile() call takes no more than its pipe holds, 64KB or so,
+  // which a short write must not be taken for a full socket buffer over.
+  const int sndbuf = 1024 * 1024;
+  ASSERT_EQ(0, setsockopt(fds_[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                          sizeof(sndbuf)));
+  const std::string content = pattern(160 * 1024, 'a');
+  OutputQueue queue;
+  queue.AppendFile(tempFile(content), 10, content.size() - 10);
+  const size_t max_bytes = queue.MaxWriteFDBytes();
+  int saved_errno = 0;
+  EXPECT_EQ(static_cast<ssize_t>(max_bytes),
+            queue.WriteFD(fds_[0], &saved_errno));
+  EXPECT_TRUE(queue.Empty());
+}
+
+TEST_F(OutputQueueTest, ShrunkFilesFail) {
+  OutputQueue queue;
+  queue.AppendFile(tempFile("abc"), 0, 10);
+  int saved_errno = 0;
+  EXPECT_EQ(3, queue.WriteFD(fds_[0], &saved_errno));
+  EXPECT_EQ(-1, queue.WriteFD(fds_[0], &saved_errno));
+  EXPECT_EQ(ENODATA, saved_errno);
+  EXPECT_EQ(7u, queue.ReadableBytes());
+}
+
+// Connects a TCP socket pair over loopback, as SO_ZEROCOPY does not apply
+// to Unix domain sockets.
+void tcpPair(int fds[2]) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_LE(0, listener);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  ASSERT_EQ(0, bind(listener, reinterpret_cast<struct sockaddr *>(&addr),
+                    addr_len));
+  ASSERT_EQ(0, listen(listener, 1));
+  ASSERT_EQ(0, getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr),
+                           &addr_len));
+  fds[0] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  ASSERT_LE(0, fds[0]);
+  connect(fds[0], reinterpret_cast<struct sockaddr *>(&addr), addr_len);
+  fds[1] = accept(listener, nullptr, nullptr);
+  ASSERT_LE(0, fds[1]);
+  ASSERT_EQ(0, fcntl(fds[1], F_SETFL, O_NONBLOCK));
+  close(listener);
+}
+
+TEST(OutputQueueZeroCopyTest, PinsBuffersUntilCompleted) {
+  int fds[2];
+  tcpPair(fds);
+  int on = 1;
+  if (setsockopt(fds[0], SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    GTEST_SKIP() << "no SO_ZEROCOPY";
+  }
+  const std::string bytes = pattern(128 * 1024, 'a');
+  const SharedPayload payload(bytes.data(), bytes.size());
+  OutputQueue queue;
+  queue.SetZeroCopyThreshold(64 * 1024);
+  queue.Append("head", 4);
+  queue.Append(payload);
+  queue.Append("small", 5);
+
+  int saved_errno = 0;
+  ASSERT_LT(0, queue.WriteFD(fds[0], &saved_errno));
+  EXPECT_EQ(1u, queue.NumPinnedSends());
+  std::string received;
+  char buf[65536];
+  while (queue.NumPinnedSends() > 0 || !queue.Empty()) {
+    if (!queue.Empty()) {
+      queue.WriteFD(fds[0], &saved_errno);
+    }
+    ssize_t n;
+    while ((n = read(fds[1], buf, sizeof(buf))) > 0) {
+      received.append(buf, static_cast<size_t>(n));
+    }
+    struct pollfd pfd = {fds[0], 0, 0};
+    if (queue.NumPinnedSends() > 0 && poll(&pfd, 1, 10) == 1 &&
+        (pfd.revents & POLLERR)) {
+      EXPECT_LE(0, queue.ReadZeroCopyCompletions(fds[0], &saved_errno));
+    }
+    // Written or not, the payload is still referenced until completed.
+    if (queue.NumPinnedSends() > 0) {
+      EXPECT_LT(1, payload.use_count());
+    }
+  }
+  EXPECT_EQ(0u, queue.PinnedBytes());
+  EXPECT_EQ(1, payload.use_count());
+  EXPECT_EQ("head" + bytes + "small", received);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+}  // namespace
+}  // namespace raner
@@ -0,0 +1,106 @@
+#include "raner/task.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace raner {
+namespace {
+
+struct Counters {
+  int calls = 0;
+  int destructions = 0;
+};
+
+class Callable {
+ public:
+  explicit Callable(Counters *counters) : counters_(counters) {}
+  Callable(Callable &&other) noexcept : counters_(other.counters_) {
+    other.counters_ = nullptr;
+  }
+  ~Callable() {
+    if (counters_ != nullptr) {
+      ++counters_->destructions;
+    }
+  }
+  void operator()() { ++counters_->calls; }
+
+ private:
+  Counters *counters_;
+};
+
+struct Big {
+  char padding[Task::kInlineSize + 8];
+  int *calls;
+  void operator()() { ++*calls; }
+};
+
+TEST(TaskTest, Size) {
+  EXPECT_EQ(Task::kInlineSize + sizeof(void *), sizeof(Task));
+}
+
+TEST(TaskTest, EmptyTask) {
+  Task task;
+  EXPECT_FALSE(task);
+  Task null_task(nullptr);
+  EXPECT_FALSE(null_task);
+}
+
+TEST(TaskTest, BindOfSharedPtrIsInline) {
+  struct Connection {
+    void Send(const std::string &message) {
+      sent += static_cast<int>(message.size());
+    }
+    int sent = 0;
+  };
+  std::shared_ptr<Connection> conn(new Connection);
+  Task task(std::bind(&Connection::Send, conn, std::string("hello")));
+  EXPECT_TRUE(task.is_inline());
+  EXPECT_EQ(2, conn.use_count());
+  task();
+  EXPECT_EQ(5, conn->sent);
+  task = nullptr;
+  EXPECT_EQ(1, conn.use_count());
+}
+
+TEST(TaskTest, MoveKeepsExactlyOneCallable) {
+  Counters counters;
+  {
+    Task task{Callable(&counters)};
+    EXPECT_TRUE(task.is_inline());
+    Task moved(std::move(task));
+    EXPECT_FALSE(task);
+    moved();
+    Task assigned;
+    assigned = std::move(moved);
+    EXPECT_FALSE(moved);
+    assigned();
+    EXPECT_EQ(0, counters.destructions);
+  }
+  EXPECT_EQ(2, counters.calls);
+  EXPECT_EQ(1, counters.destructions);
+}
+
+TEST(TaskTest, LargeCallableGoesOnTheHeap) {
+  int calls = 0;
+  Big big;
+  big.calls = &calls;
+  Task task(big);
+  EXPECT_FALSE(task.is_inline());
+  Task moved(std::move(task));
+  moved();
+  EXPECT_EQ(1, calls);
+}
+
+TEST(TaskTest, MoveOnlyCapture) {
+  std::unique_ptr<int> value(new int(42));
+  int seen = 0;
+  Task task([v = std::move(value), &seen]() { seen = *v; });
+  task();
+  EXPECT_EQ(42, seen);
+}
+
+}  // namespace
+}  // namespace raner
@@ -0,0 +1,188 @@
+#include "raner/tcp_server.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/event_loop_thread_pool.h"
+#include "raner/loop_placement.h"
+#include "raner/shared_payload.h"
+#include "raner/tcp_client.h"
+#include "tests/test_util.h"
+
+namespace raner {
+namespace {
+
+const int kBasePort = 27283;
+
+// Connects 'num_clients' clients on 'loop' to 'server', has each one echo a
+// message and close, and returns the loops on which the server side of the
+// connections ran. 'on_connected', if set, is also called, under a lock,
+// for each new server side connection.
+std::set<EventLoop *> echoFromClients(
+    EventLoop *loop, TCPServer *server, int num_clients,
+    const ConnectionCallback &on_connected = ConnectionCallback()) {
+  std::mutex mutex;
+  std::set<EventLoop *> io_loops;
+  server->SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+    if (conn->Connected()) {
+      EXPECT_TRUE(conn->GetLoop()->IsInLoopThread());
+      std::lock_guard<std::mutex> lock(mutex);
+      io_loops.insert(conn->GetLoop());
+      if (on_connected) {
+        on_connected(conn);
+      }
+    }
+  });
+  server->SetMessageCallback(
+      [](const TCPConnectionPtr &conn, ByteBuffer *buf) { conn->Send(buf); });
+  server->Start();
+
+  const std::string message = "hello";
+  const std::vector<std::string> received = receiveFromClients(
+      loop, *server, num_clients, message,
+      [&message](int, const std::string &bytes) {
+        return bytes.size() >= message.size();
+      });
+  for (const std::string &bytes : received) {
+    EXPECT_EQ(message, bytes);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  return io_loops;
+}
+
+TEST(TCPServerTest, ReusePortAcceptsOnEveryLoop) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort, "ReusePortServer");
+  server.SetThreadNum(3);
+  server.SetReusePort(true);
+  // Spread by a hash of the client ports, 32 connections all land on one of
+  // the three sockets with a probability of 3^-31.
+  const std::set<EventLoop *> io_loops = echoFromClients(&loop, &server, 32);
+  EXPECT_LT(1u, io_loops.size());
+  EXPECT_EQ(0u, io_loops.count(&loop));
+}
+
+TEST(TCPServerTest, ReusePortWithoutThreads) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort + 1, "ReusePortServer");
+  server.SetReusePort(true);
+  const std::set<EventLoop *> io_loops = echoFromClients(&loop, &server, 4);
+  ASSERT_EQ(1u, io_loops.size());
+  EXPECT_EQ(&loop, *io_loops.begin());
+}
+
+TEST(TCPServerTest, ConnectionsAreNamedByTheirIds) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort + 2, "IdServer");
+  server.SetThreadNum(2);
+  std::set<uint64_t> ids;
+  const std::set<EventLoop *> io_loops =
+      echoFromClients(&loop, &server, 8, [&ids](const TCPConnectionPtr &conn) {
+        EXPECT_TRUE(ids.insert(conn->id()).second);
+        EXPECT_EQ("IdServer-127.0.0.1:" + std::to_string(kBasePort + 2) +
+                      "#" + std::to_string(conn->id()),
+                  conn->Name());
+      });
+  EXPECT_EQ(2u, io_loops.size());
+  EXPECT_EQ(8u, ids.size());
+}
+
+TEST(TCPServerTest, PlacesConnectionsByPolicy) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort + 3, "PlacedServer");
+  server.SetThreadNum(2);
+  server.SetPlacementPolicy(std::unique_ptr<LoopPlacementPolicy>(
+      new LeastConnectionsPlacement()));
+  const std::set<EventLoop *> io_loops = echoFromClients(&loop, &server, 8);
+  EXPECT_EQ(2u, io_loops.size());
+  // The server side of a connection is disconnected before the client
+  // sees it closed.
+  for (const EventLoopThreadPool::LoopStats &stats :
+       server.thread_pool()->GetLoopStats()) {
+    EXPECT_EQ(0, stats.num_connections);
+  }
+}
+
+TEST(TCPServerTest, ClientConnectionRunsOnItsPool) {
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort + 4, "Server");
+  server.SetMessageCallback(
+      [](const TCPConnectionPtr &conn, ByteBuffer *buf) { conn->Send(buf); });
+  server.Start();
+  EventLoopThreadPool pool(&loop, "ClientPool");
+  pool.SetThreadNum(1);
+  pool.Start();
+  EventLoop *io_loop = pool.GetAllLoops()[0];
+
+  const std::string message = "hello";
+  bool closed = false;
+  TCPClient client(&loop, server.host(), server.port(), "Client");
+  client.SetThreadPool(&pool);
+  client.SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+    EXPECT_EQ(io_loop, conn->GetLoop());
+    EXPECT_TRUE(io_loop->IsInLoopThread());
+    if (conn->Connected()) {
+      conn->Send(std::string_view(message));
+    } else {
+      closed = true;
+      loop.Quit();
+    }
+  });
+  client.SetMessageCallback([&](const TCPConnectionPtr &conn, ByteBuffer *buf) {
+    if (buf->ReadableBytes() >= message.size()) {
+      EXPECT_EQ(message, buf->ToString());
+      conn->Shutdown();
+    }
+  });
+  client.Connect();
+  runWithTimeout(&loop);
+  EXPECT_TRUE(closed);
+}
+
+TEST(TCPServerTest, BroadcastsASharedPayload) {
+  const int kNumClients = 4;
+  EventLoop loop;
+  TCPServer server(&loop, "127.0.0.1", kBasePort + 5, "BroadcastServer");
+  server.SetThreadNum(2);
+  const std::string message(256 * 1024, 'x');
+  const SharedPayload payload(message.data(), message.size());
+  std::mutex mutex;
+  std::vector<TCPConnectionPtr> connections;
+  server.SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+    if (!conn->Connected()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    connections.push_back(conn);
+    if (connections.size() == kNumClients) {
+      // Once, from the base loop, to connections of both I/O loops.
+      loop.QueueInLoop([&connections, &payload] {
+        for (const TCPConnectionPtr &connection : connections) {
+          connection->Send(payload);
+        }
+        connections.clear();
+      });
+    }
+  });
+  server.Start();
+
+  const std::vector<std::string> received = receiveFromClients(
+      &loop, server, kNumClients, std::string(),
+      [&message](int, const std::string &bytes) {
+        return bytes.size() >= message.size();
+      });
+  for (const std::string &bytes : received) {
+    EXPECT_TRUE(bytes == message);
+  }
+  EXPECT_EQ(1, payload.use_count());
+}
+
+}  // namespace
+}  // namespace raner
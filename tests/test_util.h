@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Williammuji Wong. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Helpers shared by the tests which run servers and clients on a loop.
+
+#ifndef RANER_TESTS_TEST_UTIL_H_
+#define RANER_TESTS_TEST_UTIL_H_
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "raner/event_loop.h"
+#include "raner/tcp_client.h"
+#include "raner/tcp_server.h"
+#include "raner/time.h"
+
+namespace raner {
+
+// Runs 'loop' until it quits, or fails the test and quits it once
+// 'timeout' has passed.
+inline void runWithTimeout(EventLoop *loop,
+                           Duration timeout = Duration(30 * 1000 * 1000)) {
+  std::unique_ptr<EpollTimer> timer = loop->CreateTimer([loop] {
+    ADD_FAILURE() << "timed out";
+    loop->Quit();
+  });
+  timer->Update(Time::Now() + timeout);
+  loop->Loop();
+}
+
+// Connects 'num_clients' clients on 'loop' to 'server', which has started.
+// Each one sends 'greeting', if not empty, and collects what it receives
+// until 'done' returns true for the number of the client and what it got,
+// and then shuts down. Runs the loop until all have closed, and returns
+// what each one received.
+inline std::vector<std::string> receiveFromClients(
+    EventLoop *loop, const TCPServer &server, int num_clients,
+    const std::string &greeting,
+    const std::function<bool(int, const std::string &)> &done) {
+  int num_closed = 0;
+  std::vector<std::string> received(static_cast<size_t>(num_clients));
+  std::vector<std::unique_ptr<TCPClient>> clients;
+  for (int i = 0; i < num_clients; ++i) {
+    clients.emplace_back(
+        new TCPClient(loop, server.host(), server.port(), "Client"));
+    TCPClient *client = clients.back().get();
+    client->SetConnectionCallback([&](const TCPConnectionPtr &conn) {
+      if (conn->Connected()) {
+        if (!greeting.empty()) {
+          conn->Send(std::string_view(greeting));
+        }
+      } else if (++num_closed == num_clients) {
+        loop->Quit();
+      }
+    });
+    std::string *bytes = &received[static_cast<size_t>(i)];
+    client->SetMessageCallback(
+        [&done, bytes, i](const TCPConnectionPtr &conn, ByteBuffer *buf) {
+          *bytes += buf->ToString();
+          if (done(i, *bytes)) {
+            conn->Shutdown();
+          }
+        });
+    client->Connect();
+  }
+  runWithTimeout(loop);
+  EXPECT_EQ(num_clients, num_closed);
+  return received;
+}
+
+}  // namespace raner
+
+#endif  // RANER_TESTS_TEST_UTIL_H_
@@ -0,0 +1,130 @@
+#include "raner/timing_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+namespace raner {
+namespace {
+
+const int64_t kTickUs = 100;
+const size_t kNumSlots = 8;
+
+TEST(TimingWheelTest, FiresWithinOneTickAfterDeadline) {
+  TimingWheel wheel(kTickUs, kNumSlots);
+  int fired = 0;
+  CoarseTimer timer([&fired]() { ++fired; });
+
+  wheel.Schedule(&timer, 1000, 250);
+  EXPECT_TRUE(timer.IsSet());
+  EXPECT_EQ(1u, wheel.size());
+  EXPECT_EQ(1300, wheel.NextSlotTimeInUs());
+
+  wheel.Advance(1249);
+  EXPECT_EQ(0, fired);
+  wheel.Advance(1299);
+  EXPECT_EQ(0, fired);
+  wheel.Advance(1300);
+  EXPECT_EQ(1, fired);
+  EXPECT_FALSE(timer.IsSet());
+  EXPECT_EQ(0u, wheel.size());
+  EXPECT_EQ(-1, wheel.NextSlotTimeInUs());
+}
+
+TEST(TimingWheelTest, RescheduleAndCancel) {
+  TimingWheel wheel(kTickUs, kNumSlots);
+  int fired = 0;
+  CoarseTimer timer([&fired]() { ++fired; });
+
+  wheel.Schedule(&timer, 0, 200);
+  // Touching the timeout again just moves it.
+  wheel.Schedule(&timer, 100, 200);
+  EXPECT_EQ(1u, wheel.size());
+  wheel.Advance(250);
+  EXPECT_EQ(0, fired);
+  wheel.Advance(300);
+  EXPECT_EQ(1, fired);
+
+  wheel.Schedule(&timer, 300, 100);
+  timer.Cancel();
+  timer.Cancel();
+  EXPECT_EQ(0u, wheel.size());
+  wheel.Advance(1000);
+  EXPECT_EQ(1, fired);
+}
+
+TEST(TimingWheelTest, TimersBeyondOneRevolution) {
+  TimingWheel wheel(kTickUs, kNumSlots);
+  std::vector<int> fired;
+  CoarseTimer near([&fired]() { fired.push_back(1); });
+  CoarseTimer far([&fired]() { fired.push_back(2); });
+
+  // Both land in the same slot, one revolution apart.
+  wheel.Schedule(&near, 0, 300);
+  wheel.Schedule(&far, 0, 300 + kTickUs * kNumSlots);
+  EXPECT_EQ(300, wheel.NextSlotTimeInUs());
+
+  wheel.Advance(300);
+  ASSERT_EQ(1u, fired.size());
+  EXPECT_EQ(1, fired[0]);
+  EXPECT_EQ(1u, wheel.size());
+
+  // Skipping several revolutions at once still fires it.
+  wheel.Advance(10 * kTickUs * kNumSlots);
+  ASSERT_EQ(2u, fired.size());
+  EXPECT_EQ(2, fired[1]);
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(TimingWheelTest, CallbacksMayScheduleAndCancel) {
+  TimingWheel wheel(kTickUs, kNumSlots);
+  int first_fired = 0;
+  int second_fired = 0;
+  int64_t now = 0;
+  CoarseTimer second([&second_fired]() { ++second_fired; });
+  CoarseTimer first;
+  first.SetTimerCallback([&]() {
+    ++first_fired;
+    // Rescheduling itself with no delay waits for the next tick.
+    wheel.Schedule(&first, now, 0);
+    // Cancelling a timer due in the same call.
+    second.Cancel();
+  });
+
+  wheel.Schedule(&first, now, 100);
+  wheel.Schedule(&second, now, 100);
+  now = 100;
+  wheel.Advance(now);
+  EXPECT_EQ(1, first_fired + second_fired);
+  EXPECT_TRUE(first.IsSet());
+
+  now = 200;
+  wheel.Advance(now);
+  EXPECT_GE(first_fired, 1);
+  EXPECT_EQ(2, first_fired + second_fired);
+}
+
+TEST(TimingWheelTest, ManyTimers) {
+  TimingWheel wheel(kTickUs, 64);
+  const int kNumTimers = 1000;
+  int fired = 0;
+  std::vector<std::unique_ptr<CoarseTimer>> timers;
+  for (int i = 0; i < kNumTimers; ++i) {
+    timers.emplace_back(new CoarseTimer([&fired]() { ++fired; }));
+    wheel.Schedule(timers.back().get(), 0, (i * 7919) % 100000);
+  }
+  EXPECT_EQ(static_cast<size_t>(kNumTimers), wheel.size());
+  for (int64_t now = 0; now <= 100000; now += kTickUs) {
+    int64_t next = wheel.NextSlotTimeInUs();
+    if (next >= 0) {
+      EXPECT_GE(next, now - kTickUs);
+    }
+    wheel.Advance(now);
+  }
+  EXPECT_EQ(kNumTimers, fired);
+  EXPECT_EQ(0u, wheel.size());
+}
+
+}  // namespace
+}  // namespace raner
@@ -0,0 +1,40 @@
+// Measures what tracing one callback costs the loop: reading the clock at
+// its end, which is where the next one starts, and adding the record, with
+// the TSC and with clock_gettime(CLOCK_MONOTONIC) as the clock.
+
+#include <stdio.h>
+
+#include "raner/time.h"
+#include "raner/trace_ring.h"
+
+namespace raner {
+namespace {
+
+const int kNumEvents = 10 * 1000 * 1000;
+
+void Run(const char *name, TraceRing::Clock clock) {
+  TraceRing ring(TraceRing::kDefaultCapacity, clock);
+  if (clock == TraceRing::kTSCClock && !ring.uses_tsc()) {
+    printf("%-16s the TSC is not invariant\n", name);
+    return;
+  }
+  Time start = Time::Now();
+  int64_t event_start = ring.Now();
+  for (int i = 0; i < kNumEvents; ++i) {
+    const int64_t event_end = ring.Now();
+    ring.Add(TraceRing::kEvent, event_start, event_end, i, 1);
+    event_start = event_end;
+  }
+  const Duration elapsed = Time::Now() - start;
+  printf("%-16s %6.2f ns/event\n", name,
+         static_cast<double>(elapsed.count()) * 1000.0 / kNumEvents);
+}
+
+}  // namespace
+}  // namespace raner
+
+int main() {
+  raner::Run("TSC", raner::TraceRing::kTSCClock);
+  raner::Run("clock_gettime", raner::TraceRing::kMonotonicClock);
+  return 0;
+}
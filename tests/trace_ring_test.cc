@@ -0,0 +1,143 @@
+#include "raner/trace_ring.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "raner/epoll_server.h"
+
+namespace raner {
+namespace {
+
+TEST(TraceRingTest, KeepsTheLatestRecordsInOrder) {
+  TraceRing ring(8, TraceRing::kMonotonicClock);
+  EXPECT_TRUE(ring.Snapshot().empty());
+  for (int i = 0; i < 20; ++i) {
+    ring.Add(TraceRing::kEvent, i * 10, i * 10 + 3, i, 1);
+  }
+  EXPECT_EQ(20u, ring.NumAdded());
+
+  const std::vector<TraceRing::Record> records = ring.Snapshot();
+  ASSERT_EQ(8u, records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    EXPECT_EQ(static_cast<int>(12 + i), records[i].fd);
+    EXPECT_EQ(static_cast<int64_t>(120 + 10 * i), records[i].start_ns);
+    EXPECT_EQ(3, records[i].duration_ns);
+  }
+}
+
+TEST(TraceRingTest, ChromeTrace) {
+  TraceRing ring(8, TraceRing::kMonotonicClock);
+  ring.Add(TraceRing::kWait, 1000, 3500, -1, 2);
+  ring.Add(TraceRing::kEvent, 3500, 4000, 7, EPOLLIN);
+  ring.Add(TraceRing::kFunctors, 4000, 4100, -1, 5);
+
+  const std::string trace = ring.ToChromeTrace();
+  EXPECT_EQ(0u, trace.find("{\"traceEvents\":["));
+  EXPECT_NE(std::string::npos,
+            trace.find("\"name\":\"epoll_wait\",\"cat\":\"raner\",\"ph\":\"X\","
+                       "\"ts\":1.000,\"dur\":2.500"));
+  EXPECT_NE(std::string::npos, trace.find("\"args\":{\"events\":2}"));
+  EXPECT_NE(std::string::npos, trace.find("\"args\":{\"fd\":7,\"mask\":1}"));
+  EXPECT_NE(std::string::npos, trace.find("\"args\":{\"count\":5}"));
+  EXPECT_EQ("]}\n", trace.substr(trace.size() - 3));
+}
+
+TEST(TraceRingTest, SnapshotsWhileTheLoopAdds) {
+  TraceRing ring(16, TraceRing::kMonotonicClock);
+  std::atomic<bool> done(false);
+  std::thread loop_thread([&ring, &done] {
+    for (int i = 0; i < 200 * 1000; ++i) {
+      ring.Add(TraceRing::kEvent, i, 2 * i, i, i);
+    }
+    done = true;
+  });
+  while (!done) {
+    int64_t last = -1;
+    for (const TraceRing::Record &record : ring.Snapshot()) {
+      // No record is torn, and they come in order.
+      EXPECT_EQ(record.start_ns, record.duration_ns);
+      EXPECT_EQ(record.start_ns, record.fd);
+      EXPECT_EQ(record.start_ns, record.arg);
+      EXPECT_LT(last, record.start_ns);
+      last = record.start_ns;
+    }
+  }
+  loop_thread.join();
+}
+
+int64_t monotonicNowInNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+TEST(TraceRingTest, SnapshotTurnsTheTSCIntoMonotonicTime) {
+  TraceRing ring(8);
+  if (!ring.uses_tsc()) {
+    return;
+  }
+  const int64_t before_ns = monotonicNowInNs();
+  const int64_t start = ring.Now();
+  usleep(10 * 1000);
+  ring.Add(TraceRing::kWait, start, ring.Now(), -1, 0);
+  const int64_t after_ns = monotonicNowInNs();
+
+  const std::vector<TraceRing::Record> records = ring.Snapshot();
+  ASSERT_EQ(1u, records.size());
+  // Within 100us and 1%, much looser than the rate of the TSC as measured
+  // over the life of the ring.
+  EXPECT_LE(before_ns - 100 * 1000, records[0].start_ns);
+  EXPECT_GE(after_ns + 100 * 1000, records[0].start_ns);
+  EXPECT_LE(10 * 1000 * 1000 * 99 / 100, records[0].duration_ns);
+  EXPECT_GE(after_ns - before_ns + 100 * 1000, records[0].duration_ns);
+}
+
+class PipeCB : public EpollCallbackInterface {
+ public:
+  void OnRegistration(EpollServer * /*eps*/, int /*fd*/,
+                      int /*event_mask*/) override {}
+  void OnModification(int /*fd*/, int /*event_mask*/) override {}
+  void OnEvent(int fd, EpollEvent * /*event*/) override {
+    char c;
+    EXPECT_EQ(1, read(fd, &c, 1));
+  }
+  void OnUnregistration(int /*fd*/, bool /*replaced*/) override {}
+  void OnShutdown(EpollServer * /*eps*/, int /*fd*/) override {}
+  std::string Name() const override { return "PipeCB"; }
+};
+
+TEST(TraceRingTest, EpollServerTracesWaitsAndCallbacks) {
+  PipeCB cb;
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  EpollServer server;
+  server.RegisterFDForRead(fds[0], &cb);
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  server.WaitForEventsAndExecuteCallbacks();
+
+  const std::vector<TraceRing::Record> records =
+      server.trace_ring()->Snapshot();
+  ASSERT_EQ(2u, records.size());
+  EXPECT_EQ(TraceRing::kWait, records[0].type);
+  EXPECT_EQ(1, records[0].arg);
+  EXPECT_EQ(TraceRing::kEvent, records[1].type);
+  EXPECT_EQ(fds[0], records[1].fd);
+  EXPECT_EQ(EPOLLIN, records[1].arg);
+  EXPECT_LE(records[0].start_ns + records[0].duration_ns,
+            records[1].start_ns);
+
+  server.trace_ring()->set_enabled(false);
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  server.WaitForEventsAndExecuteCallbacks();
+  EXPECT_EQ(2u, server.trace_ring()->NumAdded());
+
+  server.UnregisterFD(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+}  // namespace
+}  // namespace raner
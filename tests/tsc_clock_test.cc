@@ -0,0 +1,57 @@
+#include "raner/tsc_clock.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "raner/time.h"
+
+namespace raner {
+namespace {
+
+const int64_t kSlackUs = 50;
+
+int64_t wallNowInUsec() { return (Time::Now() - Time::UnixEpoch()).count(); }
+
+TEST(TSCClockTest, TracksTheWallClock) {
+  TSCClock clock;
+  if (!clock.uses_tsc()) {
+    GTEST_SKIP() << "no invariant TSC";
+  }
+  EXPECT_LT(0, clock.us_per_tick());
+  for (int i = 0; i < 5; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const int64_t before = wallNowInUsec();
+    const int64_t now = clock.NowInUsec();
+    const int64_t after = wallNowInUsec();
+    // Slack for the rate error over the interval since the last resync.
+    EXPECT_LE(before - kSlackUs, now);
+    EXPECT_GE(after + kSlackUs, now);
+  }
+}
+
+TEST(TSCClockTest, NeverGoesBackwardsAcrossResyncs) {
+  TSCClock clock;
+  if (!clock.uses_tsc()) {
+    GTEST_SKIP() << "no invariant TSC";
+  }
+  const int64_t end = wallNowInUsec() + 2 * TSCClock::kResyncIntervalUs + 1;
+  int64_t last = clock.NowInUsec();
+  int64_t now = last;
+  int num_backwards = 0;
+  while (now < end) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    now = clock.NowInUsec();
+    if (now < last) {
+      ++num_backwards;
+    }
+    last = now;
+  }
+  EXPECT_EQ(0, num_backwards);
+  EXPECT_NEAR(static_cast<double>(wallNowInUsec()),
+              static_cast<double>(clock.NowInUsec()), kSlackUs);
+}
+
+}  // namespace
+}  // namespace raner